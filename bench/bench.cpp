@@ -0,0 +1,380 @@
+// FireBench: recall, latency and throughput of the FireDB indexes on a
+// standard dataset (SIFT1M, GloVe, ...).
+//
+//   FireBench --base sift_base.fvecs --query sift_query.fvecs [--gt sift_groundtruth.ivecs]
+//             [--modes gpu,fp16,sq8,pq:16,ivf:1024] [--batch 1,10,100] [--k 1,10,100]
+//             [--nprobe 8,32] [--rerank N] [--metric l2|ip|cosine] [--nb ROWS] [--nq QUERIES]
+//             [--dir DIR] [--csv FILE]
+//
+// The base set is imported into a fresh database under --dir (default
+// /tmp/firebench) to measure ingest, exact ground truth comes from --gt
+// or is computed with the exact index, then every mode is built and swept
+// over batch size x k (x nprobe for ivf). Latency is per search call of
+// `batch` queries, QPS counts queries. Base and queries are .npy or .fvecs.
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <algorithm>
+#include <unordered_set>
+
+#include "../src/core/slab.h"
+#include "../src/core/dataset.h"
+#include "../src/core/gpu.h"
+#include "../src/core/quant.h"
+#include "../src/core/ivf.h"
+#include "../src/core/cpu.h"
+#include "../src/core/shard.h"
+
+// max_batch_size of the GPU indexes, larger batches are split
+const int BENCH_MAX_BATCH = 100;
+const size_t IMPORT_CHUNK_ROWS = 65536;
+
+using Clock = std::chrono::high_resolution_clock;
+
+// Answers n queries with k slots each in `out`, see pad_results().
+using SearchFn = std::function<void(const float* queries, int n, int k, SearchResult* out)>;
+
+struct BenchResult {
+    std::string mode;
+    int batch = 0;
+    int k = 0;
+    int nprobe = 0;
+    double qps = 0;
+    double p50_ms = 0;
+    double p99_ms = 0;
+    double recall = 0;
+};
+
+std::vector<std::string> split(const std::string& s, char sep) {
+    std::vector<std::string> parts;
+    std::stringstream ss(s);
+    std::string part;
+    while (std::getline(ss, part, sep)) {
+        if (!part.empty()) parts.push_back(part);
+    }
+    return parts;
+}
+
+std::vector<int> parse_ints(const std::string& s) {
+    std::vector<int> values;
+    for (auto& part : split(s, ',')) values.push_back(std::stoi(part));
+    return values;
+}
+
+double seconds_since(Clock::time_point t0) {
+    return std::chrono::duration<double>(Clock::now() - t0).count();
+}
+
+double percentile(std::vector<double> values, double p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+}
+
+// Vector-of-vectors indexes (quantized, IVF, sharded) behind the span API.
+SearchFn wrap_vector_search(size_t dim,
+                            std::function<std::vector<std::vector<SearchResult>>(
+                                const std::vector<std::vector<float>>&, int)> search) {
+    return [dim, search](const float* queries, int n, int k, SearchResult* out) {
+        std::vector<std::vector<float>> batch(n);
+        for (int q = 0; q < n; q++) batch[q].assign(queries + q * dim, queries + (q + 1) * dim);
+        auto results = search(batch, k);
+        pad_results(out, (size_t)n * k);
+        for (int q = 0; q < n; q++) {
+            for (size_t i = 0; i < results[q].size() && i < (size_t)k; i++) out[(size_t)q * k + i] = results[q][i];
+        }
+    };
+}
+
+// Runs every query once in calls of `batch` queries (each split into
+// BENCH_MAX_BATCH pieces) after one warm-up call. User ids are the base
+// rows, so recall compares them with the ground truth directly.
+BenchResult measure(const SearchFn& search, const VectorSet<float>& queries, int batch, int k,
+                    const VectorSet<int32_t>& truth) {
+    size_t nq = queries.rows;
+    std::vector<SearchResult> out(nq * k);
+    search(queries.row(0), std::min<int>(BENCH_MAX_BATCH, nq), k, out.data());
+
+    std::vector<double> latencies;
+    auto t0 = Clock::now();
+    for (size_t i = 0; i < nq; i += batch) {
+        int c = std::min<size_t>(batch, nq - i);
+        auto t = Clock::now();
+        for (int j = 0; j < c; j += BENCH_MAX_BATCH) {
+            int n = std::min(BENCH_MAX_BATCH, c - j);
+            search(queries.row(i + j), n, k, out.data() + (i + j) * k);
+        }
+        latencies.push_back(seconds_since(t) * 1000.0);
+    }
+    double total = seconds_since(t0);
+
+    size_t hits = 0;
+    size_t depth = std::min<size_t>(k, truth.dim);
+    for (size_t q = 0; q < nq; q++) {
+        std::unordered_set<uint64_t> expected(truth.row(q), truth.row(q) + depth);
+        for (size_t i = 0; i < depth; i++) {
+            uint64_t id = out[q * k + i].id;
+            if (id != EMPTY_ID) hits += expected.count(id);
+        }
+    }
+
+    BenchResult r;
+    r.batch = batch;
+    r.k = k;
+    r.qps = nq / total;
+    r.p50_ms = percentile(latencies, 0.50);
+    r.p99_ms = percentile(latencies, 0.99);
+    r.recall = depth ? (double)hits / (nq * depth) : 0;
+    return r;
+}
+
+void print_result(const BenchResult& r, std::ofstream& csv) {
+    std::cout << std::left << std::setw(12) << r.mode << std::right
+              << std::setw(7) << r.batch << std::setw(6) << r.k << std::setw(8) << (r.nprobe ? std::to_string(r.nprobe) : "-")
+              << std::fixed << std::setprecision(0) << std::setw(12) << r.qps
+              << std::setprecision(3) << std::setw(10) << r.p50_ms << std::setw(10) << r.p99_ms
+              << std::setprecision(4) << std::setw(9) << r.recall << std::defaultfloat << "\n";
+    if (csv.is_open()) {
+        csv << r.mode << "," << r.batch << "," << r.k << "," << r.nprobe << "," << r.qps << ","
+            << r.p50_ms << "," << r.p99_ms << "," << r.recall << "\n";
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string base_path, query_path, gt_path, csv_path;
+    std::string dir = "/tmp/firebench";
+    std::vector<std::string> modes;
+    std::vector<int> batches = { 1, 10, 100 };
+    std::vector<int> ks = { 1, 10, 100 };
+    std::vector<int> nprobes = { 8, 32 };
+    int rerank = 0;
+    size_t nb = 0, nq = 0;
+    Metric metric = METRIC_L2;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--base" && has_value) base_path = argv[++i];
+        else if (arg == "--query" && has_value) query_path = argv[++i];
+        else if (arg == "--gt" && has_value) gt_path = argv[++i];
+        else if (arg == "--csv" && has_value) csv_path = argv[++i];
+        else if (arg == "--dir" && has_value) dir = argv[++i];
+        else if (arg == "--modes" && has_value) modes = split(argv[++i], ',');
+        else if (arg == "--batch" && has_value) batches = parse_ints(argv[++i]);
+        else if (arg == "--k" && has_value) ks = parse_ints(argv[++i]);
+        else if (arg == "--nprobe" && has_value) nprobes = parse_ints(argv[++i]);
+        else if (arg == "--rerank" && has_value) rerank = std::atoi(argv[++i]);
+        else if (arg == "--nb" && has_value) nb = std::atoll(argv[++i]);
+        else if (arg == "--nq" && has_value) nq = std::atoll(argv[++i]);
+        else if (arg == "--metric" && has_value) {
+            std::string name = argv[++i];
+            if (name == "ip") metric = METRIC_IP;
+            else if (name == "cosine") metric = METRIC_COSINE;
+        }
+        else {
+            std::cout << "Unknown argument '" << arg << "'\n";
+            return 1;
+        }
+    }
+    if (base_path.empty() || query_path.empty()) {
+        std::cout << "Usage: FireBench --base <base.fvecs|npy> --query <query.fvecs|npy> [--gt <gt.ivecs>] ...\n";
+        return 1;
+    }
+    if (ks.empty() || batches.empty()) {
+        std::cout << "--k and --batch need at least one value\n";
+        return 1;
+    }
+    int max_k = *std::max_element(ks.begin(), ks.end());
+    if (*std::min_element(ks.begin(), ks.end()) <= 0 || max_k > GPU_MAX_K) {
+        std::cout << "k must be between 1 and " << GPU_MAX_K << "\n";
+        return 1;
+    }
+
+    int devices = GpuIndex::device_count();
+    if (modes.empty()) modes = devices > 0 ? std::vector<std::string>{ "gpu" } : std::vector<std::string>{ "cpu" };
+
+    VectorSet<float> base, queries;
+    try {
+        base = load_vectors(base_path, nb);
+        queries = load_vectors(query_path, nq);
+    } catch (const std::exception& e) {
+        std::cout << "Could not load dataset: " << e.what() << "\n";
+        return 1;
+    }
+    if (base.dim != queries.dim || queries.rows == 0) {
+        std::cout << "Base and query sets differ in dimension\n";
+        return 1;
+    }
+    size_t dim = base.dim;
+    std::cout << "[BENCH] " << base.rows << " base vectors, " << queries.rows << " queries, dim " << dim << "\n";
+
+    // a fresh database, user id = base row
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::string db = dir + "/bench";
+    WalOptions wal;
+    wal.policy = SYNC_INTERVAL;
+    IdSlab ids(db + ".wal", wal);
+    MatrixSlab slab(db + ".slab", dim, metric);
+
+    auto t0 = Clock::now();
+    slab.reserve(base.rows);
+    std::vector<uint64_t> uids(IMPORT_CHUNK_ROWS);
+    for (size_t done = 0; done < base.rows; done += IMPORT_CHUNK_ROWS) {
+        size_t n = std::min(IMPORT_CHUNK_ROWS, base.rows - done);
+        for (size_t i = 0; i < n; i++) uids[i] = done + i;
+        slab.add_vectors(base.row(done), n);
+        ids.insert_batch(uids.data(), n, done);
+    }
+    ids.sync();
+    double import_s = seconds_since(t0);
+    std::cout << "[BENCH] Imported in " << import_s << "s (" << (size_t)(base.rows / import_s) << " vectors/s, "
+              << std::setprecision(4) << base.rows * dim * sizeof(float) / import_s / (1 << 20) << " MB/s)\n"
+              << std::defaultfloat;
+
+    // ground truth rows, max_k per query
+    VectorSet<int32_t> truth;
+    if (!gt_path.empty() && nb == 0) {
+        truth = load_vecs<int32_t>(gt_path, queries.rows);
+        if (truth.rows < queries.rows) {
+            std::cout << "Ground truth has fewer rows than the query set\n";
+            return 1;
+        }
+    } else {
+        if (!gt_path.empty()) std::cout << "[BENCH] --nb truncates the base set, recomputing ground truth\n";
+        std::unique_ptr<GpuIndex> exact_gpu;
+        std::unique_ptr<CpuIndex> exact_cpu;
+        SearchFn exact;
+        if (devices > 0) {
+            size_t resident = GpuIndex::resident_capacity(dim, base.rows, BENCH_MAX_BATCH);
+            exact_gpu = std::make_unique<GpuIndex>(dim, resident);
+            exact_gpu->attach_slab(slab);
+            exact_gpu->load_data(slab);
+            exact = [&](const float* q, int n, int k, SearchResult* out) { exact_gpu->search_rows(q, n, k, out); };
+        } else {
+            exact_cpu = std::make_unique<CpuIndex>(slab);
+            exact = [&](const float* q, int n, int k, SearchResult* out) { exact_cpu->search_rows(q, n, k, out); };
+        }
+
+        t0 = Clock::now();
+        std::vector<SearchResult> out(queries.rows * max_k);
+        for (size_t i = 0; i < queries.rows; i += BENCH_MAX_BATCH) {
+            int n = std::min<size_t>(BENCH_MAX_BATCH, queries.rows - i);
+            exact(queries.row(i), n, max_k, out.data() + i * max_k);
+        }
+        truth.rows = queries.rows;
+        truth.dim = max_k;
+        truth.data.resize(out.size());
+        for (size_t i = 0; i < out.size(); i++) truth.data[i] = out[i].id == EMPTY_ID ? -1 : (int32_t)out[i].id;
+        std::cout << "[BENCH] Exact ground truth in " << seconds_since(t0) << "s\n";
+    }
+
+    std::ofstream csv;
+    if (!csv_path.empty()) {
+        csv.open(csv_path);
+        csv << "mode,batch,k,nprobe,qps,p50_ms,p99_ms,recall\n";
+    }
+
+    for (const std::string& mode : modes) {
+        auto parts = split(mode, ':');
+        std::string name = parts.empty() ? "" : parts[0];
+        int param = parts.size() > 1 ? std::stoi(parts[1]) : 0;
+
+        bool needs_gpu = name != "cpu";
+        bool l2_only = name == "sq8" || name == "pq" || name == "ivf";
+        if (needs_gpu && devices == 0) {
+            std::cout << "[BENCH] Skipping " << mode << ", no GPU\n";
+            continue;
+        }
+        if (l2_only && metric != METRIC_L2) {
+            std::cout << "[BENCH] Skipping " << mode << ", it needs the l2 metric\n";
+            continue;
+        }
+
+        // every mode builds its index from the same slab and frees it after its sweep
+        std::unique_ptr<GpuIndex> gpu;
+        std::unique_ptr<CpuIndex> cpu;
+        std::unique_ptr<ShardedIndex> sharded;
+        std::unique_ptr<CodeSlab> codes;
+        std::unique_ptr<QuantIndex> qgpu;
+        std::unique_ptr<IvfIndex> ivf;
+        SearchFn search;
+        try {
+            t0 = Clock::now();
+            if (name == "cpu") {
+                cpu = std::make_unique<CpuIndex>(slab);
+                cpu->attach_ids(ids);
+                search = [&](const float* q, int n, int k, SearchResult* out) { cpu->search(q, n, k, out); };
+            } else if (name == "gpu" || name == "fp16" || name == "bf16") {
+                StoragePrecision storage = name == "fp16" ? STORE_FP16 : name == "bf16" ? STORE_BF16 : STORE_FP32;
+                size_t resident = GpuIndex::resident_capacity(dim, base.rows, BENCH_MAX_BATCH, storage);
+                gpu = std::make_unique<GpuIndex>(dim, resident, storage);
+                gpu->set_rerank_factor(rerank);
+                gpu->attach_slab(slab);
+                gpu->attach_ids(ids);
+                gpu->load_data(slab);
+                search = [&](const float* q, int n, int k, SearchResult* out) { gpu->search(q, n, k, out); };
+            } else if (name == "sharded") {
+                sharded = std::make_unique<ShardedIndex>(slab, devices, base.rows, BENCH_MAX_BATCH);
+                sharded->set_rerank_factor(rerank);
+                sharded->attach_ids(ids);
+                sharded->load_data();
+                search = wrap_vector_search(dim, [&](const std::vector<std::vector<float>>& q, int k) {
+                    return sharded->search(q, k);
+                });
+            } else if (name == "sq8" || name == "pq") {
+                std::filesystem::remove(db + ".codes");
+                codes = std::make_unique<CodeSlab>(db + ".codes");
+                codes->train(name == "sq8" ? QUANT_SQ8 : QUANT_PQ, param, slab);
+                qgpu = std::make_unique<QuantIndex>(
+                    QuantIndex::resident_capacity(codes->code_size(), base.rows, BENCH_MAX_BATCH), *codes);
+                if (rerank > 0) qgpu->set_rerank_factor(rerank);
+                qgpu->attach_slab(slab);
+                qgpu->attach_ids(ids);
+                qgpu->load_data(slab, *codes);
+                search = wrap_vector_search(dim, [&](const std::vector<std::vector<float>>& q, int k) {
+                    return qgpu->search(q, k);
+                });
+            } else if (name == "ivf") {
+                std::filesystem::remove(db + ".ivf");
+                ivf = std::make_unique<IvfIndex>(db + ".ivf", dim, param > 0 ? param : 1024);
+                ivf->attach_ids(ids);
+                ivf->train(slab);
+                ivf->load_data(slab);
+                search = wrap_vector_search(dim, [&](const std::vector<std::vector<float>>& q, int k) {
+                    return ivf->search(q, k);
+                });
+            } else {
+                std::cout << "[BENCH] Unknown mode '" << mode << "'\n";
+                continue;
+            }
+            std::cout << "[BENCH] " << mode << " built in " << seconds_since(t0) << "s\n";
+            std::cout << std::left << std::setw(12) << "mode" << std::right << std::setw(7) << "batch"
+                      << std::setw(6) << "k" << std::setw(8) << "nprobe" << std::setw(12) << "QPS"
+                      << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms" << std::setw(9) << "recall" << "\n";
+
+            std::vector<int> probes = ivf ? nprobes : std::vector<int>{ 0 };
+            for (int nprobe : probes) {
+                if (ivf) ivf->set_nprobe(nprobe);
+                for (int batch : batches) {
+                    for (int k : ks) {
+                        BenchResult r = measure(search, queries, std::max(batch, 1), k, truth);
+                        r.mode = mode;
+                        r.nprobe = ivf ? ivf->get_nprobe() : 0;
+                        print_result(r, csv);
+                    }
+                }
+            }
+        } catch (const std::exception& e) {
+            std::cout << "[BENCH] " << mode << " failed: " << e.what() << "\n";
+        }
+    }
+    return 0;
+}
@@ -8,53 +8,35 @@
 #include <random>
 #include <algorithm>
 #include <cstring>
-#include <fstream>
-#include <regex>
+#include <memory>
+#include <future>
+#include <atomic>
+#include <csignal>
 
 #include "src/core/slab.h"
+#include "src/core/attr.h"
+#include "src/core/dataset.h"
 #include "src/core/gpu.h"
+#include "src/core/quant.h"
+#include "src/core/ivf.h"
+#include "src/core/cpu.h"
+#include "src/core/shard.h"
+#include "src/core/compact.h"
+#include "src/core/graph.h"
+#include "src/core/pca.h"
+#include "src/core/scheduler.h"
+#include "src/core/server.h"
 
 int GLOBAL_DIM = 0;
 const int MAX_CAPACITY = 1000000;
 const int GPU_BATCH_LIMIT = 100;
+const size_t IMPORT_CHUNK_ROWS = 65536;
+// compact once more than this share of the slab rows are deleted
+const double COMPACT_DEAD_FRACTION = 0.25;
 
-struct NpyHeader {
-    int rows;
-    int cols;
-    size_t header_size;
-    bool is_float32;
-};
-
-NpyHeader parse_npy(const std::string& filename) {
-    std::ifstream file(filename, std::ios::binary);
-    if (!file.is_open()) throw std::runtime_error("Could not open file");
-
-    char magic[6];
-    file.read(magic, 6);
-    if (std::strncmp(magic, "\x93NUMPY", 6) != 0)
-        throw std::runtime_error("Invalid NPY file");
-
-    file.seekg(8);
-    uint16_t header_len;
-    file.read(reinterpret_cast<char*>(&header_len), 2);
-
-    std::string header(header_len, ' ');
-    file.read(&header[0], header_len);
-
-    NpyHeader info{0, 0, 10 + header_len, false};
-
-    if (header.find("<f4") != std::string::npos ||
-        header.find("'f4'") != std::string::npos)
-        info.is_float32 = true;
-
-    std::regex r(R"(shape['"]?:\s*\(\s*(\d+)\s*,\s*(\d+)\s*\))");
-    std::smatch m;
-    if (!std::regex_search(header, m, r))
-        throw std::runtime_error("Could not parse shape");
-
-    info.rows = std::stoi(m[1]);
-    info.cols = std::stoi(m[2]);
-    return info;
+QueryServer* active_server = nullptr;
+void stop_server(int) {
+    if (active_server) active_server->stop();
 }
 
 std::vector<float> generate_random_vector(int dim) {
@@ -75,38 +57,363 @@ void print_help() {
         "  put <id> <v...>   : Add custom vector\n"
         "  search            : Search with random query\n"
         "  find <id>         : Find neighbors\n"
+        "  del <id>          : Delete a vector\n"
+        "  attr <name> <t>   : Add an attribute column, t is int32, int64 or float\n"
+        "  set <id> <a> <v>  : Set attribute a of a vector\n"
+        "  filter <expr>     : Search with random query among rows matching e.g. tenant=3,price<9.5\n"
+        "  compact           : Drop deleted rows from disk and GPU\n"
+        "  knn <k>           : Write the k nearest neighbors of every row to <db>.knn\n"
         "  batch <num>       : Benchmark batch search\n"
+        "  load <c> <num> [w]: Benchmark num single queries from c threads, appending w rows meanwhile\n"
+        "  nprobe <n>        : IVF lists scanned per query\n"
+        "  stats [reset]     : Print (or zero) the counters and stage timings\n"
+        "  timers <on|off>   : Time the GPU search stages with cudaEvents\n"
+        "  sync              : Flush the id log to disk\n"
+        "  checkpoint        : Snapshot ids and truncate the log\n"
         "  exit              : Quit\n";
 }
 
-int main() {
+int main(int argc, char** argv) {
     std::cout << "FireDB\n";
 
+    // --fp16 / --bf16 store resident rows in half precision, --rerank N
+    // re-scores N * k candidates in FP32 against the slab. --sq8 / --pq M
+    // search compressed codes instead of the raw vectors. --ivf N scans only
+    // the --nprobe nearest of N inverted lists. --max-wait US bounds how long
+    // a concurrent single query waits for others to fill its batch. --serve
+    // PORT answers the binary protocol in server.h instead of running the
+    // REPL, --db NAME skips the database prompt. --metric l2|ip|cosine picks
+    // the metric of a new database. --pca D searches a D dimensional PCA
+    // projection and --pca-rerank N re-scores N * k of its candidates in
+    // full dimension. --timers starts with per-stage search timing on.
+    StoragePrecision storage = STORE_FP32;
+    int rerank = 0;
+    QuantType quant = QUANT_NONE;
+    uint32_t pq_m = 0;
+    size_t ivf_lists = 0;
+    int nprobe = 8;
+    long max_wait_us = 500;
+    int serve_port = 0;
     std::string db_name;
-    std::getline(std::cin, db_name);
+    Metric metric = METRIC_L2;
+    size_t pca_dim = 0;
+    int pca_rerank = 4;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--fp16") storage = STORE_FP16;
+        else if (arg == "--bf16") storage = STORE_BF16;
+        else if (arg == "--rerank" && i + 1 < argc) rerank = std::atoi(argv[++i]);
+        else if (arg == "--sq8") quant = QUANT_SQ8;
+        else if (arg == "--pq" && i + 1 < argc) {
+            quant = QUANT_PQ;
+            pq_m = std::atoi(argv[++i]);
+        }
+        else if (arg == "--ivf" && i + 1 < argc) ivf_lists = std::atoll(argv[++i]);
+        else if (arg == "--nprobe" && i + 1 < argc) nprobe = std::atoi(argv[++i]);
+        else if (arg == "--max-wait" && i + 1 < argc) max_wait_us = std::atol(argv[++i]);
+        else if (arg == "--serve" && i + 1 < argc) serve_port = std::atoi(argv[++i]);
+        else if (arg == "--db" && i + 1 < argc) db_name = argv[++i];
+        else if (arg == "--pca" && i + 1 < argc) pca_dim = std::atoll(argv[++i]);
+        else if (arg == "--pca-rerank" && i + 1 < argc) pca_rerank = std::atoi(argv[++i]);
+        else if (arg == "--timers") metrics().timers = true;
+        else if (arg == "--metric" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "ip") metric = METRIC_IP;
+            else if (name == "cosine") metric = METRIC_COSINE;
+            else if (name != "l2") std::cout << "Unknown metric '" << name << "', using l2\n";
+        }
+    }
+
+    if (db_name.empty()) std::getline(std::cin, db_name);
     if (db_name.empty()) db_name = "main";
 
     std::string vec_file = db_name + ".slab";
     std::string id_file = db_name + ".wal";
 
+    // an existing database keeps the metric it was created with
+    static const char* metric_names[] = { "l2", "ip", "cosine" };
     if (std::filesystem::exists(vec_file)) {
         MatrixSlab t(vec_file, 0);
         GLOBAL_DIM = t.get_dim();
-        std::cout << "Loading '" << db_name << "' (Dim: " << GLOBAL_DIM << ")\n";
+        metric = t.get_metric();
+        std::cout << "Loading '" << db_name << "' (Dim: " << GLOBAL_DIM << ", Metric: "
+                  << metric_names[metric] << ")\n";
     } else {
         GLOBAL_DIM = 128;
-        std::cout << "Creating '" << db_name << "' (Dim: " << GLOBAL_DIM << ")\n";
+        std::cout << "Creating '" << db_name << "' (Dim: " << GLOBAL_DIM << ", Metric: "
+                  << metric_names[metric] << ")\n";
     }
 
-    IdSlab id_db(id_file);
-    MatrixSlab mat_db(vec_file, GLOBAL_DIM);
+    // Group commit, a crash loses at most the last few milliseconds of ids
+    WalOptions wal;
+    wal.policy = SYNC_INTERVAL;
+    IdSlab id_db(id_file, wal);
+    MatrixSlab mat_db(vec_file, GLOBAL_DIM, metric);
+    id_db.finish_compaction(mat_db.get_generation());
+    AttrStore attrs(db_name);
+    attrs.finish_compaction(mat_db.get_generation());
+    CodeSlab codes(db_name + ".codes");
+    if (codes.trained()) quant = codes.get_type();
+    std::string ivf_file = db_name + ".ivf";
+    bool use_ivf = ivf_lists > 0 || std::filesystem::exists(ivf_file);
+    // codes and lists are trained and searched in L2 only
+    if (metric != METRIC_L2 && (quant != QUANT_NONE || use_ivf)) {
+        std::cout << "Quantization and IVF need the l2 metric, searching exactly\n";
+        quant = QUANT_NONE;
+        use_ivf = false;
+    }
+    bool approximate = quant != QUANT_NONE || use_ivf;
+    int devices = GpuIndex::device_count();
+
+    // The indexes search the projected copy of the slab once a projection
+    // exists. It is trained on the rows present at startup.
+    std::string pca_file = db_name + ".pca";
+    std::unique_ptr<Projection> projection;
+    std::unique_ptr<MatrixSlab> reduced;
+    if (pca_dim > 0 || std::filesystem::exists(pca_file)) {
+        if (metric != METRIC_L2) {
+            std::cout << "PCA needs the l2 metric, searching all dimensions\n";
+        } else {
+            try {
+                if (!std::filesystem::exists(pca_file)) {
+                    if (devices == 0) throw std::runtime_error("training needs a GPU");
+                    train_pca(mat_db, pca_dim, pca_file);
+                }
+                projection = std::make_unique<Projection>(pca_file);
+                if (projection->get_in_dim() != (size_t)GLOBAL_DIM) throw std::runtime_error("dimension mismatch");
+                reduced = open_reduced(mat_db, *projection, db_name + ".pca.slab", devices > 0);
+                std::cout << "[PCA] Searching " << projection->get_out_dim() << " of " << GLOBAL_DIM
+                          << " dimensions\n";
+            } catch (const std::exception& e) {
+                std::cout << "PCA unavailable: " << e.what() << "\n";
+                reduced.reset();
+                projection.reset();
+            }
+        }
+    }
+    MatrixSlab& index_db = reduced ? *reduced : mat_db;
+    int index_dim = index_db.get_dim();
+
+    // With codes or lists the VRAM goes to them, the float index only
+    // streams until there is enough data to train them
+    // Several devices split the rows between them
+    std::unique_ptr<GpuIndex> gpu;
+    std::unique_ptr<ShardedIndex> sharded;
+    size_t resident = 0;
+    if (devices > 1 && !approximate) {
+        std::cout << "[GPU] Sharding over " << devices << " devices...\n";
+        sharded = std::make_unique<ShardedIndex>(index_db, devices, MAX_CAPACITY, GPU_BATCH_LIMIT, storage);
+        sharded->set_rerank_factor(rerank);
+        sharded->attach_ids(id_db);
+        sharded->attach_attrs(attrs);
+        if (index_db.get_count() > 0) sharded->load_data();
+    } else if (devices > 0) {
+        std::cout << "[GPU] Allocating Index...\n";
+        resident = approximate
+            ? 0 : GpuIndex::resident_capacity(index_dim, MAX_CAPACITY, GPU_BATCH_LIMIT, storage);
+        gpu = std::make_unique<GpuIndex>(index_dim, resident, storage);
+        gpu->set_rerank_factor(rerank);
+        gpu->attach_slab(index_db);
+        gpu->attach_ids(id_db);
+        gpu->attach_attrs(attrs);
+        if (!approximate && index_db.get_count() > resident) {
+            std::cout << "[GPU] " << resident << " vectors resident, the rest is streamed from disk\n";
+        }
 
-    std::cout << "[GPU] Allocating Index...\n";
-    GpuIndex gpu(GLOBAL_DIM, MAX_CAPACITY);
+        if (!approximate && index_db.get_count() > 0) {
+            std::cout << "[GPU] Uploading " << index_db.get_count() << " vectors...\n";
+            gpu->load_data(index_db);
+        }
+    }
 
-    if (mat_db.get_count() > 0) {
-        std::cout << "[GPU] Uploading " << mat_db.get_count() << " vectors...\n";
-        gpu.load_data(mat_db);
+    // No device, or the resident copy could not be allocated: search the
+    // slab on the host instead of streaming everything over PCIe
+    std::unique_ptr<CpuIndex> cpu;
+    if ((!gpu && !sharded) || (gpu && resident > 0 && gpu->get_capacity() == 0)) {
+        cpu = std::make_unique<CpuIndex>(index_db);
+        cpu->attach_ids(id_db);
+        cpu->attach_attrs(attrs);
+        std::cout << "[CPU] Searching on " << std::thread::hardware_concurrency() << " threads\n";
+    }
+
+    std::unique_ptr<QuantIndex> qgpu;
+    auto start_quant = [&]() {
+        if (quant == QUANT_NONE || qgpu || devices == 0) return;
+        try {
+            if (!codes.trained()) {
+                std::cout << "[GPU] Training codebook on " << index_db.get_count() << " vectors...\n";
+                codes.train(quant, pq_m, index_db);
+            }
+            size_t capacity = QuantIndex::resident_capacity(codes.code_size(), MAX_CAPACITY, GPU_BATCH_LIMIT);
+            qgpu = std::make_unique<QuantIndex>(capacity, codes);
+            if (rerank > 0) qgpu->set_rerank_factor(rerank);
+            qgpu->attach_slab(index_db);
+            qgpu->attach_ids(id_db);
+            qgpu->load_data(index_db, codes);
+        } catch (const std::exception& e) {
+            std::cout << "Quantization unavailable: " << e.what() << "\n";
+            qgpu.reset();
+        }
+    };
+    if (index_db.get_count() > 0) start_quant();
+
+    std::unique_ptr<IvfIndex> ivf;
+    auto start_ivf = [&]() {
+        if (!use_ivf || devices == 0) return;
+        try {
+            if (!ivf) {
+                ivf = std::make_unique<IvfIndex>(ivf_file, index_dim, ivf_lists);
+                ivf->set_nprobe(nprobe);
+                ivf->attach_ids(id_db);
+                if (ivf->trained()) ivf->load_data(index_db);
+            }
+            if (!ivf->trained() && index_db.get_count() >= ivf->get_nlist()) {
+                std::cout << "[IVF] Training " << ivf->get_nlist() << " centroids...\n";
+                ivf->train(index_db);
+                ivf->set_nprobe(nprobe);
+                ivf->load_data(index_db);
+            }
+        } catch (const std::exception& e) {
+            std::cout << "IVF unavailable: " << e.what() << "\n";
+            ivf.reset();
+            use_ivf = false;
+        }
+    };
+    start_ivf();
+
+    // keeps the shards, codes and lists in step with the slab after an append.
+    // Callers pass the stored rows, which cosine has normalized (or
+    // projected, with PCA).
+    auto add_to_indexes = [&](const float* vecs, size_t n, int64_t row) {
+        if (sharded) sharded->add_vectors(vecs, n, row, index_db.get_norms_ptr() + row);
+        if (qgpu) qgpu->add_vectors(vecs, n, codes);
+        if (ivf) ivf->add_vectors(vecs, n, row);
+    };
+    // every single-row write goes through here, on the REPL thread
+    auto append_one = [&](const float* v, uint64_t uid) {
+        int64_t row = mat_db.get_count();
+        mat_db.add_vector(v);
+        id_db.insert(uid, row);
+        const float* stored = mat_db.get_data_ptr() + row * GLOBAL_DIM;
+        if (reduced) {
+            std::vector<float> y(index_dim);
+            projection->project(stored, y.data());
+            reduced->add_vector(y.data());
+            stored = reduced->get_data_ptr() + row * index_dim;
+        }
+        if (gpu) gpu->add_single_vector(stored, index_db.get_norms_ptr() + row);
+        add_to_indexes(stored, 1, row);
+    };
+    auto search_index = [&](const std::vector<std::vector<float>>& qs, int k) {
+        if (ivf && ivf->trained()) return ivf->search(qs, k);
+        if (qgpu) return qgpu->search(qs, k);
+        if (sharded) return sharded->search(qs, k);
+        return cpu ? cpu->search(qs, k) : gpu->search(qs, k);
+    };
+    auto project_queries = [&](const std::vector<std::vector<float>>& qs) {
+        std::vector<std::vector<float>> out(qs.size(), std::vector<float>(index_dim));
+        for (size_t i = 0; i < qs.size(); i++) projection->project(qs[i].data(), out[i].data());
+        return out;
+    };
+    // With PCA an exact index returns pca_rerank * k candidate rows, which are
+    // scored again against the full vectors in the slab
+    auto search = [&](const std::vector<std::vector<float>>& qs, int k) {
+        if (!projection) return search_index(qs, k);
+        auto ps = project_queries(qs);
+        bool exact = !qgpu && !(ivf && ivf->trained());
+        if (!exact || pca_rerank <= 1 || k <= 0) return search_index(ps, k);
+
+        int fetch = std::min(GPU_MAX_K, k * pca_rerank);
+        std::vector<float> flat;
+        std::vector<SearchResult> found(qs.size() * fetch);
+        flatten_queries(ps, index_dim, flat);
+        if (cpu) cpu->search_rows(flat.data(), ps.size(), fetch, found.data());
+        else if (sharded) sharded->search_rows(flat.data(), ps.size(), fetch, found.data());
+        else gpu->search_rows(flat.data(), ps.size(), fetch, found.data());
+
+        std::vector<uint64_t> rows(found.size());
+        for (size_t i = 0; i < found.size(); i++) rows[i] = found[i].id;
+        std::vector<std::vector<SearchResult>> out;
+        rerank_exact(mat_db, &id_db, qs, rows, fetch, k, out);
+        return out;
+    };
+    auto search_one = [&](const std::vector<float>& q, int k) { return search({q}, k)[0]; };
+    // filters are applied by the exact indexes only, an approximate setup
+    // still has the streaming GPU index for them
+    auto search_filtered = [&](const std::vector<std::vector<float>>& qs, int k, const AttrFilter& filter) {
+        auto ps = projection ? project_queries(qs) : qs;
+        if (sharded) return sharded->search(ps, k, &filter);
+        return cpu ? cpu->search(ps, k, &filter) : gpu->search(ps, k, &filter);
+    };
+    BatchScheduler scheduler(search, GPU_BATCH_LIMIT, std::chrono::microseconds(max_wait_us), GPU_MAX_K);
+    auto compact_all = [&]() {
+        return compact_database(mat_db, id_db, { gpu.get(), &codes, qgpu.get(), ivf.get(), sharded.get(), &attrs,
+                                                 reduced.get(), projection.get() });
+    };
+    auto metrics_text = []() {
+        std::ostringstream os;
+        render_metrics(os);
+        render_device_metrics(os);
+        return os.str();
+    };
+
+    if (serve_port > 0) {
+        // the quantized and IVF indexes cannot take appends mid-search, so
+        // with them every write waits for a gap between batches
+        bool exclusive_writes = qgpu || (ivf && ivf->trained());
+        // A database too small to train the requested quantized or IVF index
+        // gets it between two batches once the writes have supplied a full
+        // training sample (one row per list for IVF). A failed start is
+        // reported by start_quant() / start_ivf() and not retried.
+        bool quant_waiting = quant != QUANT_NONE && !qgpu && devices > 0;
+        bool ivf_waiting = use_ivf && ivf && !ivf->trained();
+        if (quant_waiting) {
+            std::cout << "[Server] Quantized index starts at " << QUANT_TRAIN_SAMPLE << " rows\n";
+        }
+        if (ivf_waiting) std::cout << "[Server] IVF index starts at " << ivf->get_nlist() << " rows\n";
+        auto start_waiting = [&]() {
+            size_t rows = index_db.get_count();
+            if (quant_waiting && rows >= QUANT_TRAIN_SAMPLE) {
+                start_quant();
+                quant_waiting = false;
+            }
+            if (ivf_waiting && rows >= ivf->get_nlist()) {
+                start_ivf();
+                ivf_waiting = false;
+            }
+            exclusive_writes = qgpu || (ivf && ivf->trained());
+        };
+        ServerHandlers handlers;
+        handlers.scheduler = &scheduler;
+        handlers.put = [&](uint64_t uid, const float* v) {
+            if (id_db.get_row_from_user(uid) != -1) return false;
+            if (exclusive_writes) scheduler.exclusive([&] { append_one(v, uid); });
+            else append_one(v, uid);
+            size_t rows = index_db.get_count();
+            if ((quant_waiting && rows >= QUANT_TRAIN_SAMPLE) || (ivf_waiting && rows >= ivf->get_nlist())) {
+                scheduler.exclusive(start_waiting);
+            }
+            return true;
+        };
+        handlers.remove = [&](const uint64_t* uids, size_t n) {
+            size_t removed = id_db.remove_batch(uids, n);
+            size_t dead = mat_db.get_count() - id_db.size();
+            if (dead > COMPACT_DEAD_FRACTION * mat_db.get_count()) {
+                scheduler.exclusive([&] { std::cout << "Compacted " << compact_all() << " rows\n"; });
+            }
+            return removed;
+        };
+        handlers.count = [&]() { return mat_db.get_count(); };
+        handlers.stats = metrics_text;
+
+        QueryServer server(handlers, GLOBAL_DIM, serve_port);
+        active_server = &server;
+        std::signal(SIGINT, stop_server);
+        std::signal(SIGTERM, stop_server);
+        std::cout << "Serving on port " << serve_port << "\n";
+        server.run();
+        active_server = nullptr;
+        return 0;
     }
 
     std::cout << "Ready.\n";
@@ -126,6 +433,137 @@ int main() {
         else if (cmd == "status") {
             std::cout << "Vectors: " << mat_db.get_count() << "\n"
                       << "Dim:     " << GLOBAL_DIM << "\n";
+            if (projection) std::cout << "PCA:     " << index_dim << "\n";
+        }
+
+        else if (cmd == "sync") {
+            id_db.sync();
+        }
+
+        else if (cmd == "checkpoint") {
+            id_db.checkpoint();
+        }
+
+        else if (cmd == "del") {
+            uint64_t uid;
+            if (!(ss >> uid)) continue;
+            id_db.remove(uid);
+
+            size_t dead = mat_db.get_count() - id_db.size();
+            if (dead > COMPACT_DEAD_FRACTION * mat_db.get_count()) {
+                std::cout << "Compacted " << compact_all() << " rows\n";
+            }
+        }
+
+        else if (cmd == "attr") {
+            std::string name, type;
+            if (!(ss >> name >> type)) {
+                std::cout << "Usage: attr <name> <int32|int64|float>\n";
+                continue;
+            }
+            AttrType t = ATTR_INT64;
+            if (type == "int32") t = ATTR_INT32;
+            else if (type == "float") t = ATTR_FLOAT32;
+            else if (type != "int64") {
+                std::cout << "Unknown attribute type.\n";
+                continue;
+            }
+            try {
+                attrs.add_column(name, t, mat_db.get_generation());
+            } catch (const std::exception& e) {
+                std::cout << "Error: " << e.what() << "\n";
+            }
+        }
+
+        else if (cmd == "set") {
+            uint64_t uid;
+            std::string name, value;
+            if (!(ss >> uid >> name >> value)) continue;
+            int64_t row = id_db.get_row_from_user(uid);
+            int c = attrs.find(name);
+            if (row == -1 || c == -1) {
+                std::cout << "Unknown id or attribute.\n";
+                continue;
+            }
+            try {
+                AttrColumn& col = attrs.column(c);
+                if (col.get_type() == ATTR_FLOAT32) col.set_float(row, std::stof(value));
+                else col.set_int(row, std::stoll(value));
+            } catch (const std::logic_error&) {
+                std::cout << "Bad value.\n";
+            }
+        }
+
+        else if (cmd == "filter") {
+            std::string expr;
+            ss >> expr;
+            try {
+                AttrFilter filter = attrs.parse_filter(expr);
+                auto r = search_filtered({ generate_random_vector(GLOBAL_DIM) }, 5, filter)[0];
+                for (auto& x : r)
+                    std::cout << "Id " << x.id << " | Dist " << x.score << "\n";
+            } catch (const std::exception& e) {
+                std::cout << "Error: " << e.what() << "\n";
+            }
+        }
+
+        else if (cmd == "knn") {
+            int k = 0;
+            ss >> k;
+            if (k <= 0 || k + 1 > GPU_MAX_K) {
+                std::cout << "Usage: knn <k>, k below " << GPU_MAX_K << "\n";
+                continue;
+            }
+            // exact row search over the whole slab (its PCA copy, if any), whatever
+            // answers queries
+            auto t0 = std::chrono::high_resolution_clock::now();
+            try {
+                size_t nnz;
+                std::string graph_file = db_name + ".knn";
+                if (cpu) {
+                    nnz = build_knn_graph(index_db, &id_db, k, GPU_BATCH_LIMIT, graph_file,
+                        [&](const float* q, size_t n, int kk, SearchResult* out) { cpu->search_rows(q, n, kk, out); });
+                } else if (sharded) {
+                    nnz = build_knn_graph(index_db, &id_db, k, sharded->get_max_batch(), graph_file,
+                        [&](const float* q, size_t n, int kk, SearchResult* out) { sharded->search_rows(q, n, kk, out); });
+                } else {
+                    nnz = build_knn_graph(index_db, &id_db, k, gpu->get_max_batch(), graph_file,
+                        [&](const float* q, size_t n, int kk, SearchResult* out) { gpu->search_rows(q, n, kk, out); });
+                }
+                auto t1 = std::chrono::high_resolution_clock::now();
+                std::cout << "Wrote " << nnz << " edges to " << graph_file << " in "
+                          << std::chrono::duration<double>(t1 - t0).count() << "s\n";
+            } catch (const std::exception& e) {
+                std::cout << "KNN graph failed: " << e.what() << "\n";
+            }
+        }
+
+        else if (cmd == "nprobe") {
+            int n;
+            if (!(ss >> n) || !ivf) continue;
+            ivf->set_nprobe(n);
+            std::cout << "nprobe = " << ivf->get_nprobe() << "\n";
+        }
+
+        else if (cmd == "compact") {
+            std::cout << "Compacted " << compact_all() << " rows\n";
+        }
+
+        else if (cmd == "stats") {
+            std::string arg;
+            if (ss >> arg && arg == "reset") {
+                metrics().reset();
+                std::cout << "Counters reset\n";
+            } else {
+                std::cout << metrics_text();
+            }
+        }
+
+        else if (cmd == "timers") {
+            std::string arg;
+            if (!(ss >> arg)) continue;
+            metrics().timers = arg == "on";
+            std::cout << "Stage timers " << (metrics().timing() ? "on" : "off") << "\n";
         }
 
         else if (cmd == "import") {
@@ -148,24 +586,47 @@ int main() {
                     continue;
                 }
 
-                std::ifstream f(path, std::ios::binary);
-                f.seekg(h.header_size);
+                MappedFile src(path);
+                size_t row_bytes = GLOBAL_DIM * sizeof(float);
+                if (src.size() < h.header_size + h.rows * row_bytes) {
+                    std::cout << "Error: NPY file is truncated.\n";
+                    continue;
+                }
+                const float* vecs = reinterpret_cast<const float*>(src.data() + h.header_size);
 
-                std::vector<float> buf(GLOBAL_DIM);
+                size_t chunk = std::min<size_t>(IMPORT_CHUNK_ROWS, h.rows);
+                std::vector<uint64_t> uids(chunk);
                 uint64_t uid = 100000 + mat_db.get_count();
 
                 auto t0 = std::chrono::high_resolution_clock::now();
-                for (int i = 0; i < h.rows; i++) {
-                    f.read(reinterpret_cast<char*>(buf.data()),
-                           GLOBAL_DIM * sizeof(float));
-                    if (!f) break;
+                mat_db.reserve(mat_db.get_count() + h.rows);
+                std::vector<float> projected;
+                if (reduced) {
+                    reduced->reserve(reduced->get_count() + h.rows);
+                    projected.resize(chunk * index_dim);
+                }
+                for (size_t done = 0; done < (size_t)h.rows; done += chunk) {
+                    size_t n = std::min(chunk, h.rows - done);
+                    const float* block = vecs + done * GLOBAL_DIM;
 
                     int64_t row = mat_db.get_count();
-                    mat_db.add_vector(buf.data());
-                    id_db.insert(uid++, row);
-                    gpu.add_single_vector(buf.data());
+                    for (size_t i = 0; i < n; i++) uids[i] = uid++;
+                    mat_db.add_vectors(block, n);
+                    id_db.insert_batch(uids.data(), n, row);
+                    const float* stored = mat_db.get_data_ptr() + row * GLOBAL_DIM;
+                    if (reduced) {
+                        projection->project_batch(stored, n, projected.data(), devices > 0);
+                        reduced->add_vectors(projected.data(), n);
+                        stored = reduced->get_data_ptr() + row * index_dim;
+                    }
+                    if (gpu) gpu->add_vectors_registered(stored, n, index_db.get_norms_ptr() + row);
+                    add_to_indexes(stored, n, row);
+
+                    src.release(h.header_size + done * row_bytes, n * row_bytes);
                 }
                 auto t1 = std::chrono::high_resolution_clock::now();
+                start_quant();
+                start_ivf();
                 std::cout << "Imported " << h.rows << " vectors in "
                           << std::chrono::duration<double>(t1 - t0).count()
                           << "s\n";
@@ -180,10 +641,7 @@ int main() {
             if (id_db.get_row_from_user(uid) != -1) continue;
 
             auto v = generate_random_vector(GLOBAL_DIM);
-            int64_t row = mat_db.get_count();
-            mat_db.add_vector(v.data());
-            id_db.insert(uid, row);
-            gpu.add_single_vector(v.data());
+            append_one(v.data(), uid);
         }
 
         else if (cmd == "put") {
@@ -196,11 +654,7 @@ int main() {
 
             if (v.size() != (size_t)GLOBAL_DIM) continue;
             if (id_db.get_row_from_user(uid) != -1) continue;
-
-            int64_t row = mat_db.get_count();
-            mat_db.add_vector(v.data());
-            id_db.insert(uid, row);
-            gpu.add_single_vector(v.data());
+            append_one(v.data(), uid);
         }
 
         else if (cmd == "gen") {
@@ -210,18 +664,17 @@ int main() {
 
             for (int i = 0; i < n; i++) {
                 auto v = generate_random_vector(GLOBAL_DIM);
-                int64_t row = mat_db.get_count();
-                mat_db.add_vector(v.data());
-                id_db.insert(uid++, row);
-                gpu.add_single_vector(v.data());
+                append_one(v.data(), uid++);
             }
+            start_quant();
+            start_ivf();
         }
 
         else if (cmd == "search") {
             auto q = generate_random_vector(GLOBAL_DIM);
-            auto r = gpu.search_one(q, 5);
+            auto r = search_one(q, 5);
             for (auto& x : r)
-                std::cout << "Row " << x.id << " | Dist " << x.score << "\n";
+                std::cout << "Id " << x.id << " | Dist " << x.score << "\n";
         }
 
         else if (cmd == "find") {
@@ -235,10 +688,10 @@ int main() {
                         mat_db.get_data_ptr() + row * GLOBAL_DIM,
                         GLOBAL_DIM * sizeof(float));
 
-            auto r = gpu.search_one(q, 5);
+            auto r = search_one(q, 5);
             for (auto& x : r)
-                if (x.id != row)
-                    std::cout << "Neighbor row " << x.id
+                if (x.id != uid)
+                    std::cout << "Neighbor " << x.id
                               << " | Dist " << x.score << "\n";
         }
 
@@ -246,25 +699,82 @@ int main() {
             int n;
             ss >> n;
 
-            std::vector<std::vector<float>> qs(n);
-            for (auto& q : qs) q = generate_random_vector(GLOBAL_DIM);
+            // one contiguous query matrix and result buffer for the whole run;
+            // the exact backends read and write them in place
+            std::vector<float> qs((size_t)std::max(n, 0) * GLOBAL_DIM);
+            for (int i = 0; i < n; i++) {
+                auto q = generate_random_vector(GLOBAL_DIM);
+                std::copy(q.begin(), q.end(), qs.begin() + (size_t)i * GLOBAL_DIM);
+            }
+            std::vector<SearchResult> out((size_t)std::max(n, 0) * 5);
+
+            // the single-device GPU path keeps two batches in flight
+            bool exact = !sharded && !qgpu && !(ivf && ivf->trained()) && !projection;
+            std::vector<std::future<void>> inflight;
 
             auto t0 = std::chrono::high_resolution_clock::now();
             for (int i = 0; i < n; i += GPU_BATCH_LIMIT) {
                 int c = std::min(GPU_BATCH_LIMIT, n - i);
-                gpu.search(
-                    std::vector<std::vector<float>>(
-                        qs.begin() + i,
-                        qs.begin() + i + c
-                    ),
-                    5
-                );
+                const float* chunk = qs.data() + (size_t)i * GLOBAL_DIM;
+                SearchResult* res = out.data() + (size_t)i * 5;
+                if (exact && cpu) cpu->search(chunk, c, 5, res);
+                else if (exact && gpu) inflight.push_back(gpu->search_async(chunk, c, 5, res));
+                else {
+                    std::vector<std::vector<float>> batch(c);
+                    for (int j = 0; j < c; j++) batch[j].assign(chunk + j * GLOBAL_DIM, chunk + (j + 1) * GLOBAL_DIM);
+                    search(batch, 5);
+                }
             }
+            for (auto& f : inflight) f.get();
             auto t1 = std::chrono::high_resolution_clock::now();
             double s = std::chrono::duration<double>(t1 - t0).count();
             std::cout << "QPS: " << int(n / s) << "\n";
         }
 
+        else if (cmd == "load") {
+            int clients = 0, n = 0, writes = 0;
+            ss >> clients >> n >> writes;
+            if (clients <= 0 || n <= 0) {
+                std::cout << "Usage: load <clients> <num> [writes]\n";
+                continue;
+            }
+            // the quantized and IVF indexes are not safe to append to mid-search
+            if (writes > 0 && (qgpu || (ivf && ivf->trained()))) {
+                std::cout << "Concurrent writes need an exact index.\n";
+                writes = 0;
+            }
+
+            std::vector<std::vector<float>> qs(n);
+            for (auto& q : qs) q = generate_random_vector(GLOBAL_DIM);
+
+            // every client sends single queries, the scheduler batches them
+            auto t0 = std::chrono::high_resolution_clock::now();
+            std::atomic<int> running{ clients };
+            std::vector<std::thread> threads;
+            for (int c = 0; c < clients; c++) {
+                threads.emplace_back([&, c] {
+                    for (int i = c; i < n; i += clients) scheduler.search_one(qs[i], 5);
+                    running--;
+                });
+            }
+
+            // this thread stays the single writer while the clients run
+            int added = 0;
+            uint64_t uid = 100000 + mat_db.get_count();
+            while (added < writes && running > 0) {
+                auto v = generate_random_vector(GLOBAL_DIM);
+                append_one(v.data(), uid++);
+                added++;
+            }
+            for (auto& t : threads) t.join();
+            auto t1 = std::chrono::high_resolution_clock::now();
+            double s = std::chrono::duration<double>(t1 - t0).count();
+            std::cout << "QPS: " << int(n / s) << " | avg batch " << std::fixed << std::setprecision(1)
+                      << scheduler.average_batch() << std::defaultfloat;
+            if (writes > 0) std::cout << " | " << added << " rows added meanwhile";
+            std::cout << "\n";
+        }
+
         else {
             std::cout << "Unknown command.\n";
         }
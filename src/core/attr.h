@@ -0,0 +1,496 @@
+#pragma once
+#ifndef FIREDB_ATTR_H
+#define FIREDB_ATTR_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <deque>
+#include <atomic>
+#include <stdexcept>
+#include <filesystem>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "slab.h"
+
+// The predicate helpers below are shared by the host scan and the GPU mask
+// kernel.
+#ifdef __CUDACC__
+#define FIREDB_HOST_DEVICE __host__ __device__
+#else
+#define FIREDB_HOST_DEVICE
+#endif
+
+enum AttrType : uint32_t {
+    ATTR_INT32 = 0,
+    ATTR_INT64 = 1,
+    ATTR_FLOAT32 = 2
+};
+
+enum AttrOp : uint32_t {
+    ATTR_EQ = 0,
+    ATTR_NE = 1,
+    ATTR_LT = 2,
+    ATTR_LE = 3,
+    ATTR_GT = 4,
+    ATTR_GE = 5
+};
+
+constexpr size_t ATTR_NAME_BYTES = 32;
+constexpr size_t ATTR_MAX_CLAUSES = 8;
+
+// Address space one column reserves, as MatrixSlab does: growth maps the new
+// tail in place, so readers never see the values move. 8G int64 rows.
+constexpr size_t ATTR_RESERVE_BYTES = 1ull << 36;
+
+inline size_t attr_width(AttrType type) { return type == ATTR_INT64 ? 8 : 4; }
+
+// A column file is this header followed by capacity values of the column's
+// type, one per slab row. Rows never written read as 0.
+struct ColumnHeader {
+    uint32_t magic = 0x41545452;
+    uint32_t type = ATTR_INT64;
+    uint64_t count = 0;        // rows up to the highest one written
+    uint64_t capacity = 0;
+    uint64_t generation = 0;   // slab generation the rows are numbered for
+    char name[ATTR_NAME_BYTES] = {};
+};
+
+// "column op value". Integer columns compare against ivalue, float columns
+// against fvalue; parse_filter() fills in both.
+struct AttrClause {
+    uint32_t column = 0;
+    AttrOp op = ATTR_EQ;
+    int64_t ivalue = 0;
+    float fvalue = 0.0f;
+};
+
+// Clauses are ANDed. An empty filter matches every row.
+struct AttrFilter {
+    std::vector<AttrClause> clauses;
+
+    bool empty() const { return clauses.empty(); }
+};
+
+template <typename T>
+FIREDB_HOST_DEVICE inline bool attr_compare(AttrOp op, T value, T literal) {
+    switch (op) {
+        case ATTR_EQ: return value == literal;
+        case ATTR_NE: return value != literal;
+        case ATTR_LT: return value < literal;
+        case ATTR_LE: return value <= literal;
+        case ATTR_GT: return value > literal;
+        case ATTR_GE: return value >= literal;
+    }
+    return false;
+}
+
+// Value of `row` in a column of `rows` values, 0 past the end.
+FIREDB_HOST_DEVICE inline bool attr_clause_matches(AttrType type, const void* values, uint64_t rows, uint64_t row,
+                                                   AttrOp op, int64_t ivalue, float fvalue) {
+    bool stored = row < rows;
+    switch (type) {
+        case ATTR_INT32:
+            return attr_compare<int64_t>(op, stored ? static_cast<const int32_t*>(values)[row] : 0, ivalue);
+        case ATTR_INT64:
+            return attr_compare<int64_t>(op, stored ? static_cast<const int64_t*>(values)[row] : 0, ivalue);
+        case ATTR_FLOAT32:
+            return attr_compare<float>(op, stored ? static_cast<const float*>(values)[row] : 0.0f, fvalue);
+    }
+    return false;
+}
+
+// One typed, mmap'd column of per-row attributes. Concurrency follows
+// MatrixSlab: one writer sets values while readers scan; values are stored
+// atomically and a grown count is published with a release store. Every
+// tracker (see add_tracker()) sees the rows changed since its last
+// take_dirty(), which is how the GPU mirrors stay current.
+class AttrColumn {
+    private:
+        std::string fpath;
+        int fd = -1;
+        char* reserved = nullptr;
+        size_t reserved_bytes = 0;
+        size_t mapped_bytes = 0;
+        ColumnHeader* header = nullptr;
+        char* values = nullptr;
+        std::deque<std::atomic<size_t>> dirty;
+
+        const size_t INITIAL_CAPACITY = 1000;
+
+        static size_t round_to_page(size_t bytes) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            return (bytes + page - 1) / page * page;
+        }
+
+        size_t file_bytes_for(size_t capacity) const {
+            return sizeof(ColumnHeader) + capacity * attr_width(get_type());
+        }
+
+        void map_file(size_t bytes) {
+            if (!reserved) {
+                size_t wanted = std::max(ATTR_RESERVE_BYTES, round_to_page(bytes) * 2);
+                void* range = mmap(nullptr, wanted, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if (range == MAP_FAILED) {
+                    throw std::runtime_error("mmap failed");
+                }
+                reserved = static_cast<char*>(range);
+                reserved_bytes = wanted;
+            }
+            size_t end = round_to_page(bytes);
+            if (end > reserved_bytes) {
+                throw std::runtime_error("attribute column outgrew its reservation");
+            }
+            if (end > mapped_bytes) {
+                void* ptr = mmap(reserved + mapped_bytes, end - mapped_bytes, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_FIXED, fd, mapped_bytes);
+                if (ptr == MAP_FAILED) {
+                    throw std::runtime_error("mmap failed");
+                }
+                mapped_bytes = end;
+            }
+            // unchanged after the first map, readers take no lock
+            if (header != reinterpret_cast<ColumnHeader*>(reserved)) {
+                header = reinterpret_cast<ColumnHeader*>(reserved);
+                values = reserved + sizeof(ColumnHeader);
+            }
+        }
+
+        void release_mapping() {
+            if (reserved) munmap(reserved, reserved_bytes);
+            reserved = nullptr;
+            reserved_bytes = 0;
+            mapped_bytes = 0;
+            header = nullptr;
+            values = nullptr;
+        }
+
+        void open_file() {
+            fd = open(fpath.c_str(), O_RDWR);
+            if (fd == -1) {
+                throw std::runtime_error("could not open attribute column");
+            }
+            struct stat st;
+            fstat(fd, &st);
+            if ((size_t)st.st_size < sizeof(ColumnHeader)) {
+                throw std::runtime_error("attribute column is truncated");
+            }
+            map_file(st.st_size);
+        }
+
+        void reserve(size_t rows) {
+            if (rows <= header->capacity) return;
+            size_t new_capacity = std::max<size_t>(header->capacity, INITIAL_CAPACITY);
+            while (new_capacity < rows) new_capacity *= 2;
+            size_t bytes = file_bytes_for(new_capacity);
+            if (ftruncate(fd, bytes) == -1) {
+                throw std::runtime_error("ftruncate failed");
+            }
+            map_file(bytes);
+            header->capacity = new_capacity;
+        }
+
+        // Stores the raw value bits of `row`, then publishes a grown count and
+        // marks the row for every tracker.
+        void store(size_t row, uint64_t bits) {
+            size_t rows = get_count();
+            if (row >= rows) reserve(row + 1);
+            if (get_type() == ATTR_INT64) {
+                __atomic_store_n(reinterpret_cast<uint64_t*>(values) + row, bits, __ATOMIC_RELAXED);
+            } else {
+                __atomic_store_n(reinterpret_cast<uint32_t*>(values) + row, (uint32_t)bits, __ATOMIC_RELAXED);
+            }
+            if (row >= rows) __atomic_store_n(&header->count, row + 1, __ATOMIC_RELEASE);
+            for (auto& d : dirty) {
+                size_t cur = d.load(std::memory_order_relaxed);
+                while (!d.compare_exchange_weak(cur, std::min(cur, row), std::memory_order_acq_rel)) {}
+            }
+        }
+
+    public:
+        // Opens the column at `path_file`, creating it with `name` and `type`
+        // when the file does not exist.
+        AttrColumn(const std::string& path_file, const std::string& name, AttrType type, uint64_t generation)
+            : fpath(path_file) {
+            if (!std::filesystem::exists(fpath)) {
+                if (name.size() >= ATTR_NAME_BYTES) {
+                    throw std::runtime_error("attribute name is too long");
+                }
+                ColumnHeader h;
+                h.type = type;
+                h.capacity = INITIAL_CAPACITY;
+                h.generation = generation;
+                std::memcpy(h.name, name.data(), name.size());
+
+                int out = open(fpath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+                if (out == -1) {
+                    throw std::runtime_error("could not create attribute column");
+                }
+                if (ftruncate(out, sizeof(ColumnHeader) + h.capacity * attr_width(type)) == -1) {
+                    close(out);
+                    throw std::runtime_error("ftruncate failed");
+                }
+                MatrixSlab::pwrite_all(out, reinterpret_cast<const char*>(&h), sizeof(h), 0);
+                close(out);
+            }
+            open_file();
+        }
+        AttrColumn(const AttrColumn&) = delete;
+        AttrColumn& operator=(const AttrColumn&) = delete;
+
+        ~AttrColumn() {
+            release_mapping();
+            if (fd != -1) close(fd);
+        }
+
+        std::string get_name() const { return std::string(header->name, strnlen(header->name, ATTR_NAME_BYTES)); }
+        AttrType get_type() const { return static_cast<AttrType>(header->type); }
+        uint64_t get_generation() const { return header->generation; }
+        size_t get_count() const { return __atomic_load_n(&header->count, __ATOMIC_ACQUIRE); }
+        const void* data() const { return values; }
+
+        // Values are converted to the column's type.
+        void set_int(size_t row, int64_t v) {
+            if (get_type() == ATTR_FLOAT32) {
+                set_float(row, (float)v);
+                return;
+            }
+            store(row, get_type() == ATTR_INT32 ? (uint32_t)(int32_t)v : (uint64_t)v);
+        }
+
+        void set_float(size_t row, float v) {
+            if (get_type() != ATTR_FLOAT32) {
+                set_int(row, (int64_t)v);
+                return;
+            }
+            uint32_t bits;
+            std::memcpy(&bits, &v, sizeof(bits));
+            store(row, bits);
+        }
+
+        bool matches(size_t row, const AttrClause& c) const {
+            size_t rows = get_count();
+            if (row >= rows) return attr_clause_matches(get_type(), values, 0, row, c.op, c.ivalue, c.fvalue);
+            // a single atomic load of the value, then the shared comparison
+            uint64_t raw = get_type() == ATTR_INT64
+                ? __atomic_load_n(reinterpret_cast<const uint64_t*>(values) + row, __ATOMIC_RELAXED)
+                : __atomic_load_n(reinterpret_cast<const uint32_t*>(values) + row, __ATOMIC_RELAXED);
+            return attr_clause_matches(get_type(), &raw, 1, 0, c.op, c.ivalue, c.fvalue);
+        }
+
+        size_t add_tracker() {
+            dirty.emplace_back(0);
+            return dirty.size() - 1;
+        }
+
+        // [begin, end) of the values changed since the tracker's previous
+        // call, with IdSlab::take_dirty_row_users() semantics.
+        std::pair<size_t, size_t> take_dirty(size_t tracker) {
+            size_t rows = get_count();
+            size_t from = dirty[tracker].exchange(rows, std::memory_order_acquire);
+            return { std::min(from, rows), rows };
+        }
+
+        // Writes the values of `live` (old rows, ascending) to <column>.compact
+        // tagged with the new slab generation. Nothing changes until
+        // finish_compaction().
+        void write_compacted(const std::vector<uint64_t>& live, uint64_t generation) {
+            size_t width = attr_width(get_type());
+            ColumnHeader h = *header;
+            h.count = std::lower_bound(live.begin(), live.end(), (uint64_t)get_count()) - live.begin();
+            h.capacity = std::max<size_t>(INITIAL_CAPACITY, h.count);
+            h.generation = generation;
+
+            std::vector<char> packed(h.count * width);
+            for (size_t i = 0; i < h.count; i++) std::memcpy(&packed[i * width], values + live[i] * width, width);
+
+            std::string tmp_path = fpath + ".compact";
+            int out = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (out == -1) {
+                throw std::runtime_error("could not create compacted attribute column");
+            }
+            if (ftruncate(out, sizeof(ColumnHeader) + h.capacity * width) == -1) {
+                close(out);
+                throw std::runtime_error("ftruncate failed");
+            }
+            MatrixSlab::pwrite_all(out, reinterpret_cast<const char*>(&h), sizeof(h), 0);
+            MatrixSlab::pwrite_all(out, packed.data(), packed.size(), sizeof(h));
+            fsync(out);
+            close(out);
+        }
+
+        // Installs a pending <column>.compact whose generation matches the
+        // slab, drops any other. Only while no reader is active.
+        void finish_compaction(uint64_t slab_generation) {
+            std::string tmp_path = fpath + ".compact";
+            int in = open(tmp_path.c_str(), O_RDONLY);
+            if (in == -1) return;
+
+            ColumnHeader h;
+            ssize_t got = read(in, &h, sizeof(h));
+            close(in);
+            if (got != (ssize_t)sizeof(h) || h.generation != slab_generation) {
+                std::filesystem::remove(tmp_path);
+                return;
+            }
+            if (rename(tmp_path.c_str(), fpath.c_str()) == -1) {
+                throw std::runtime_error("could not install compacted attribute column");
+            }
+            release_mapping();
+            close(fd);
+            open_file();
+            for (auto& d : dirty) d.store(0);
+        }
+};
+
+// The attribute columns of one database, <db>.attr.<name>, indexed by slab
+// row. Columns are added at runtime and found again by name at startup.
+class AttrStore {
+    private:
+        std::string prefix;
+        std::vector<std::unique_ptr<AttrColumn>> cols;
+        size_t trackers = 0;
+
+        std::string path_for(const std::string& name) const { return prefix + ".attr." + name; }
+
+        static bool valid_name(const std::string& name) {
+            if (name.empty() || name.size() >= ATTR_NAME_BYTES) return false;
+            for (char c : name) {
+                if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_') return false;
+            }
+            return true;
+        }
+
+    public:
+        explicit AttrStore(const std::string& db_prefix) : prefix(db_prefix) {
+            std::filesystem::path base(prefix);
+            std::filesystem::path dir = base.has_parent_path() ? base.parent_path() : std::filesystem::path(".");
+            std::string stem = base.filename().string() + ".attr.";
+            if (!std::filesystem::exists(dir)) return;
+
+            for (auto& entry : std::filesystem::directory_iterator(dir)) {
+                std::string file = entry.path().filename().string();
+                if (file.compare(0, stem.size(), stem) != 0) continue;
+                std::string name = file.substr(stem.size());
+                if (!valid_name(name)) continue;   // includes *.compact leftovers
+                cols.push_back(std::make_unique<AttrColumn>(path_for(name), name, ATTR_INT64, 0));
+            }
+            std::sort(cols.begin(), cols.end(), [](const auto& a, const auto& b) { return a->get_name() < b->get_name(); });
+        }
+
+        size_t size() const { return cols.size(); }
+        AttrColumn& column(size_t c) { return *cols[c]; }
+        const AttrColumn& column(size_t c) const { return *cols[c]; }
+
+        // Index of the column called `name`, or -1.
+        int find(const std::string& name) const {
+            for (size_t c = 0; c < cols.size(); c++) {
+                if (cols[c]->get_name() == name) return c;
+            }
+            return -1;
+        }
+
+        // Creates a column numbered for the given slab generation. Called by
+        // the writer while no filtered search is running.
+        AttrColumn& add_column(const std::string& name, AttrType type, uint64_t generation) {
+            if (!valid_name(name)) {
+                throw std::runtime_error("attribute names are 1-31 letters, digits or '_'");
+            }
+            if (find(name) != -1) {
+                throw std::runtime_error("attribute already exists");
+            }
+            cols.push_back(std::make_unique<AttrColumn>(path_for(name), name, type, generation));
+            for (size_t t = 0; t < trackers; t++) cols.back()->add_tracker();
+            return *cols.back();
+        }
+
+        // A dirty tracker on every column, present and future, for one
+        // device mirror. Register before the writer starts.
+        size_t add_tracker() {
+            for (auto& c : cols) c->add_tracker();
+            return trackers++;
+        }
+
+        // "tenant=3,price<9.5", operators = == != < <= > >=.
+        AttrFilter parse_filter(const std::string& text) const {
+            AttrFilter filter;
+            size_t at = 0;
+            while (at < text.size()) {
+                size_t end = text.find(',', at);
+                if (end == std::string::npos) end = text.size();
+                std::string clause = text.substr(at, end - at);
+                at = end + 1;
+                if (clause.empty()) continue;
+
+                size_t op_at = clause.find_first_of("=!<>");
+                if (op_at == std::string::npos || op_at == 0) {
+                    throw std::runtime_error("bad filter clause '" + clause + "'");
+                }
+                size_t op_len = op_at + 1 < clause.size() && clause[op_at + 1] == '=' ? 2 : 1;
+                std::string op = clause.substr(op_at, op_len);
+                std::string value = clause.substr(op_at + op_len);
+
+                AttrClause c;
+                int column = find(clause.substr(0, op_at));
+                if (column == -1) {
+                    throw std::runtime_error("unknown attribute '" + clause.substr(0, op_at) + "'");
+                }
+                c.column = column;
+                if (op == "=" || op == "==") c.op = ATTR_EQ;
+                else if (op == "!=") c.op = ATTR_NE;
+                else if (op == "<") c.op = ATTR_LT;
+                else if (op == "<=") c.op = ATTR_LE;
+                else if (op == ">") c.op = ATTR_GT;
+                else if (op == ">=") c.op = ATTR_GE;
+                else throw std::runtime_error("bad filter operator '" + op + "'");
+
+                try {
+                    size_t used = 0;
+                    if (cols[column]->get_type() == ATTR_FLOAT32) {
+                        c.fvalue = std::stof(value, &used);
+                    } else {
+                        c.ivalue = std::stoll(value, &used);
+                    }
+                    if (used != value.size()) throw std::invalid_argument(value);
+                } catch (const std::logic_error&) {
+                    throw std::runtime_error("bad filter value '" + value + "'");
+                }
+                filter.clauses.push_back(c);
+            }
+            if (filter.clauses.size() > ATTR_MAX_CLAUSES) {
+                throw std::runtime_error("too many filter clauses");
+            }
+            return filter;
+        }
+
+        // Whether slab row `row` passes every clause.
+        bool matches(const AttrFilter& filter, size_t row) const {
+            for (const auto& c : filter.clauses) {
+                if (!cols[c.column]->matches(row, c)) return false;
+            }
+            return true;
+        }
+
+        // Two-phase like IdSlab: prepare before the slab is installed, finish
+        // after it (and at startup, which rolls a pending compaction forward).
+        void prepare_compaction(const std::vector<uint64_t>& live, uint64_t generation) {
+            for (auto& c : cols) c->write_compacted(live, generation);
+        }
+
+        void finish_compaction(uint64_t slab_generation) {
+            for (auto& c : cols) {
+                c->finish_compaction(slab_generation);
+                if (c->get_generation() != slab_generation) {
+                    throw std::runtime_error("attribute column '" + c->get_name() + "' does not match the slab");
+                }
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,64 @@
+#pragma once
+#ifndef FIREDB_COMPACT_H
+#define FIREDB_COMPACT_H
+
+#include <vector>
+#include "slab.h"
+#include "attr.h"
+#include "gpu.h"
+#include "quant.h"
+#include "ivf.h"
+#include "shard.h"
+#include "pca.h"
+
+// Everything that has to follow a compaction. Any of them may be null.
+struct CompactTargets {
+    GpuIndex* gpu = nullptr;
+    CodeSlab* codes = nullptr;
+    QuantIndex* quant = nullptr;
+    IvfIndex* ivf = nullptr;
+    ShardedIndex* sharded = nullptr;
+    AttrStore* attrs = nullptr;
+    MatrixSlab* reduced = nullptr;      // PCA copy the indexes search, with its projection
+    Projection* projection = nullptr;
+};
+
+// Rewrites the slab without rows that lost their user id, renumbers the id
+// maps to match and shrinks the GPU copy (if any) in place. Commit order is
+// slab file first, id snapshot and attribute columns second;
+// finish_compaction() at startup rolls a half finished compaction forward.
+// A PCA copy follows; open_reduced() rebuilds it if a crash leaves it behind,
+// and the indexes compact against it. Codes are compacted last, stale codes
+// are re-encoded on load; IVF lists and shards are rebuilt. Returns the
+// number of rows dropped.
+inline size_t compact_database(MatrixSlab& slab, IdSlab& ids, const CompactTargets& targets) {
+    size_t rows = slab.get_count();
+    std::vector<uint64_t> live = ids.live_rows(rows);
+    if (live.size() == rows) return 0;
+
+    uint64_t generation = slab.write_compacted(live);
+    ids.prepare_compaction(live, generation);
+    if (targets.attrs) targets.attrs->prepare_compaction(live, generation);
+    slab.install_compacted();
+    ids.finish_compaction(generation);
+    if (targets.attrs) targets.attrs->finish_compaction(generation);
+    if (targets.reduced) {
+        targets.reduced->write_compacted(live);
+        targets.reduced->install_compacted();
+        targets.projection->set_generation(slab.get_generation());
+    }
+
+    MatrixSlab& index_slab = targets.reduced ? *targets.reduced : slab;
+    if (targets.gpu) targets.gpu->compact(live, index_slab);
+    if (targets.quant) {
+        targets.quant->compact(live, index_slab, *targets.codes);
+    } else if (targets.codes && targets.codes->trained()) {
+        targets.codes->compact(live, index_slab.get_generation());
+    }
+    if (targets.ivf && targets.ivf->trained()) targets.ivf->load_data(index_slab);
+    if (targets.sharded) targets.sharded->compact();
+
+    return rows - live.size();
+}
+
+#endif
@@ -0,0 +1,204 @@
+#pragma once
+#ifndef FIREDB_CPU_H
+#define FIREDB_CPU_H
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include "slab.h"
+#include "attr.h"
+#include "simd.h"
+#include "thread_pool.h"
+#include "search_result.h"
+
+// Exact search on the host, straight over the mmap'd slab, for machines
+// without a usable GPU. Same search/search_one interface as GpuIndex.
+//
+// Every worker owns one contiguous range of rows and one bounded max-heap
+// per query. Rows are walked CPU_ROW_BLOCK at a time and each block is scored
+// against every query before moving on, so a block is read from memory once
+// per batch instead of once per query. Distances use the slab's stored norms:
+// |x|^2 + |q|^2 - 2 x.q, leaving one dot product per (row, query). Inner
+// product and cosine slabs score -x.q, cosine against a normalized query.
+// A filter is checked per row before anything is scored.
+//
+// Searches may run on any thread while one writer appends to the slab. Each
+// search covers the rows committed when it started; concurrent searches take
+// turns on the worker pool.
+constexpr size_t CPU_ROW_BLOCK = 64;
+
+class CpuIndex {
+private:
+    const MatrixSlab& slab;
+    const IdSlab* ids = nullptr;
+    const AttrStore* attrs = nullptr;
+    ThreadPool pool;
+    std::mutex search_mutex;
+
+    using Candidate = std::pair<float, uint64_t>;
+
+    // State of the search in progress, read by the workers in scan_rows().
+    const float* data = nullptr;
+    const float* norms = nullptr;
+    const float* batch = nullptr;
+    const AttrFilter* filter = nullptr;
+    size_t batch_size = 0;
+    size_t dim = 0;
+    size_t rows = 0;
+    size_t safe_k = 0;
+    size_t workers = 0;
+    size_t per_worker = 0;
+    bool l2 = true;
+    std::vector<float> q_norms;
+    std::vector<float> unit_queries;
+    std::vector<std::vector<Candidate>> heaps;
+    std::vector<Candidate> merged;
+
+    static void push_candidate(std::vector<Candidate>& heap, size_t k, float dist, uint64_t row) {
+        if (heap.size() < k) {
+            heap.push_back({ dist, row });
+            std::push_heap(heap.begin(), heap.end());
+        } else if (dist < heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = { dist, row };
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+
+    // Worker w keeps the best safe_k of its row range per query in
+    // heaps[w * batch_size + q].
+    void scan_rows(size_t w) {
+        size_t begin = w * per_worker;
+        size_t end = std::min(rows, begin + per_worker);
+        const uint64_t* row_user = ids ? ids->row_user_data() : nullptr;
+        size_t row_user_rows = ids ? ids->row_user_size() : 0;
+
+        std::vector<Candidate>* local = &heaps[w * batch_size];
+        for (size_t q = 0; q < batch_size; q++) {
+            local[q].clear();
+            local[q].reserve(safe_k);
+        }
+
+        bool live[CPU_ROW_BLOCK];
+        for (size_t block = begin; block < end; block += CPU_ROW_BLOCK) {
+            size_t n = std::min(CPU_ROW_BLOCK, end - block);
+            for (size_t i = 0; i < n; i++) {
+                size_t r = block + i;
+                live[i] = !row_user || (r < row_user_rows && __atomic_load_n(&row_user[r], __ATOMIC_RELAXED) != NO_USER);
+                if (live[i] && filter) live[i] = attrs->matches(*filter, r);
+            }
+
+            for (size_t q = 0; q < batch_size; q++) {
+                const float* query = batch + q * dim;
+                for (size_t i = 0; i < n; i++) {
+                    if (!live[i]) continue;
+                    size_t r = block + i;
+                    float dot = dot_f32(data + r * dim, query, dim);
+                    float dist = l2 ? norms[r] + q_norms[q] - 2.0f * dot : -dot;
+                    push_candidate(local[q], safe_k, dist, r);
+                }
+            }
+        }
+    }
+
+public:
+    explicit CpuIndex(const MatrixSlab& source, size_t threads = std::thread::hardware_concurrency())
+        : slab(source), pool(threads) {}
+
+    // Makes search return user ids and skip rows without a live user.
+    void attach_ids(const IdSlab& source) { ids = &source; }
+
+    // Lets search take an AttrFilter over the columns of `source`.
+    void attach_attrs(const AttrStore& source) { attrs = &source; }
+
+    // Span API: num_queries row-major queries in, k slots per query out (see
+    // pad_results). Scratch is kept between calls, so a warm index allocates
+    // nothing. A filter limits the search to the rows it matches.
+    void search(const float* queries, size_t num_queries, int k, SearchResult* out,
+                const AttrFilter* row_filter = nullptr) {
+        run_search(queries, num_queries, k, out, row_filter, true);
+    }
+
+    // search() with slab rows in the results instead of user ids. Rows
+    // without a live user are still skipped. For bulk jobs indexed by row.
+    void search_rows(const float* queries, size_t num_queries, int k, SearchResult* out) {
+        run_search(queries, num_queries, k, out, nullptr, false);
+    }
+
+    std::vector<std::vector<SearchResult>> search(const std::vector<std::vector<float>>& queries, int k,
+                                                  const AttrFilter* row_filter = nullptr) {
+        if (queries.empty()) return {};
+        thread_local std::vector<float> flat;
+        thread_local std::vector<SearchResult> out;
+        flatten_queries(queries, slab.get_dim(), flat);
+        out.resize(queries.size() * std::max(k, 0));
+        search(flat.data(), queries.size(), k, out.data(), row_filter);
+        return unpack_results(out.data(), queries.size(), std::max(k, 0));
+    }
+
+    std::vector<SearchResult> search_one(const std::vector<float>& query, int k) {
+        return search({query}, k)[0];
+    }
+
+private:
+    void run_search(const float* queries, size_t num_queries, int k, SearchResult* out,
+                    const AttrFilter* row_filter, bool translate) {
+        if (num_queries == 0) return;
+        if (row_filter && !row_filter->empty() && !attrs) {
+            throw std::runtime_error("filtered search needs attach_attrs()");
+        }
+        size_t slots = std::max(k, 0);
+        pad_results(out, num_queries * slots);
+
+        std::lock_guard<std::mutex> lock(search_mutex);
+        auto view = slab.read_lock();
+        rows = slab.get_count();
+        data = slab.get_data_ptr();
+        norms = slab.get_norms_ptr();
+        safe_k = std::min(slots, rows);
+        if (safe_k == 0) return;
+
+        dim = slab.get_dim();
+        l2 = slab.get_metric() == METRIC_L2;
+        batch = queries;
+        filter = row_filter && !row_filter->empty() ? row_filter : nullptr;
+        batch_size = num_queries;
+        if (slab.get_metric() == METRIC_COSINE) {
+            unit_queries.assign(queries, queries + num_queries * dim);
+            for (size_t q = 0; q < num_queries; q++) normalize_vector(unit_queries.data() + q * dim, dim);
+            batch = unit_queries.data();
+        }
+        q_norms.resize(num_queries);
+        for (size_t q = 0; l2 && q < num_queries; q++) {
+            q_norms[q] = dot_f32(queries + q * dim, queries + q * dim, dim);
+        }
+
+        workers = std::min(pool.size(), (rows + CPU_ROW_BLOCK - 1) / CPU_ROW_BLOCK);
+        per_worker = (rows + workers - 1) / workers;
+        if (heaps.size() < workers * num_queries) heaps.resize(workers * num_queries);
+
+        // the task only captures `this`, so std::function stores it inline
+        pool.parallel_for(workers, [this](size_t w) { scan_rows(w); });
+
+        for (size_t q = 0; q < num_queries; q++) {
+            merged.clear();
+            for (size_t w = 0; w < workers; w++) {
+                const auto& h = heaps[w * num_queries + q];
+                merged.insert(merged.end(), h.begin(), h.end());
+            }
+            size_t keep = std::min(safe_k, merged.size());
+            std::partial_sort(merged.begin(), merged.begin() + keep, merged.end());
+            size_t n = 0;
+            for (size_t i = 0; i < keep; i++) {
+                // a row removed since the scan is dropped
+                uint64_t row = merged[i].second;
+                uint64_t user = ids ? ids->get_user_from_row(row) : row;
+                if (user != NO_USER) out[q * slots + n++] = { translate ? user : row, merged[i].first };
+            }
+        }
+    }
+};
+
+#endif
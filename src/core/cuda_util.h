@@ -0,0 +1,141 @@
+#pragma once
+#ifndef FIREDB_CUDA_UTIL_H
+#define FIREDB_CUDA_UTIL_H
+
+#include <cuda_runtime.h>
+#include <cublas_v2.h>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <stdexcept>
+#include "metrics.h"
+
+// NVTX 3 is header only and ships with the CUDA toolkit. Its ranges cost a
+// function pointer check when no profiler is attached.
+#if __has_include(<nvtx3/nvToolsExt.h>)
+#include <nvtx3/nvToolsExt.h>
+#define FIREDB_HAS_NVTX 1
+#endif
+
+// Status checks for CUDA runtime and cuBLAS calls. A failure is counted and
+// thrown as std::runtime_error naming the call and its location. Cleanup
+// paths (frees, destroys, destructors) stay unchecked so they never throw.
+#define CUDA_CHECK(call) check_cuda((call), #call, __FILE__, __LINE__)
+#define CUBLAS_CHECK(call) check_cublas((call), #call, __FILE__, __LINE__)
+// After a kernel launch: reports launch configuration errors without syncing.
+#define CUDA_CHECK_LAUNCH() check_cuda(cudaGetLastError(), "kernel launch", __FILE__, __LINE__)
+
+inline void check_cuda(cudaError_t status, const char* call, const char* file, int line) {
+    if (status == cudaSuccess) return;
+    metrics().add(metrics().cuda_errors, 1);
+    throw std::runtime_error(std::string(file) + ":" + std::to_string(line) + ": " + call + ": " +
+                             cudaGetErrorString(status));
+}
+
+inline void check_cublas(cublasStatus_t status, const char* call, const char* file, int line) {
+    if (status == CUBLAS_STATUS_SUCCESS) return;
+    metrics().add(metrics().cuda_errors, 1);
+    throw std::runtime_error(std::string(file) + ":" + std::to_string(line) + ": " + call +
+                             ": cuBLAS status " + std::to_string((int)status));
+}
+
+// Named range on the Nsight Systems timeline for the lifetime of the scope.
+class NvtxRange {
+    public:
+        explicit NvtxRange(const char* name) {
+#ifdef FIREDB_HAS_NVTX
+            nvtxRangePushA(name);
+#else
+            (void)name;
+#endif
+        }
+        ~NvtxRange() {
+#ifdef FIREDB_HAS_NVTX
+            nvtxRangePop();
+#endif
+        }
+        NvtxRange(const NvtxRange&) = delete;
+        NvtxRange& operator=(const NvtxRange&) = delete;
+};
+
+// cudaEvent pairs around the GPU stages of one search. begin() arms it when
+// timers are on, start() / stop() record on the stream running the stage,
+// and collect() waits for the last one and adds the elapsed times to
+// metrics(). Events are pooled and reused, a timer belongs to one lane.
+class StageTimer {
+    private:
+        std::vector<cudaEvent_t> events;
+        std::vector<Stage> stages;
+        bool active = false;
+
+    public:
+        void begin() {
+            active = metrics().timing();
+            stages.clear();
+        }
+
+        // Returns the interval to pass to stop(), -1 when inactive.
+        int start(Stage stage, cudaStream_t stream) {
+            if (!active) return -1;
+            size_t at = stages.size() * 2;
+            while (events.size() < at + 2) {
+                cudaEvent_t e;
+                CUDA_CHECK(cudaEventCreate(&e));
+                events.push_back(e);
+            }
+            stages.push_back(stage);
+            CUDA_CHECK(cudaEventRecord(events[at], stream));
+            return stages.size() - 1;
+        }
+
+        void stop(int interval, cudaStream_t stream) {
+            if (interval < 0) return;
+            CUDA_CHECK(cudaEventRecord(events[interval * 2 + 1], stream));
+        }
+
+        void collect() {
+            if (!active) return;
+            // the last stop is recorded after everything else the search ran
+            if (!stages.empty()) cudaEventSynchronize(events[stages.size() * 2 - 1]);
+            for (size_t i = 0; i < stages.size(); i++) {
+                float ms = 0.0f;
+                if (cudaEventElapsedTime(&ms, events[i * 2], events[i * 2 + 1]) == cudaSuccess) {
+                    metrics().add_stage(stages[i], (uint64_t)(ms * 1e6));
+                }
+            }
+            stages.clear();
+            active = false;
+        }
+
+        void release() {
+            for (auto e : events) cudaEventDestroy(e);
+            events.clear();
+            stages.clear();
+        }
+};
+
+// VRAM gauges of every visible device, Prometheus text format.
+inline void render_device_metrics(std::ostream& os) {
+    int devices = 0;
+    if (cudaGetDeviceCount(&devices) != cudaSuccess) {
+        cudaGetLastError();
+        return;
+    }
+    int current = 0;
+    cudaGetDevice(&current);
+    os << "# HELP firedb_vram_used_bytes Device memory in use\n# TYPE firedb_vram_used_bytes gauge\n";
+    std::vector<size_t> totals(devices, 0);
+    for (int d = 0; d < devices; d++) {
+        size_t free_bytes = 0;
+        cudaSetDevice(d);
+        if (cudaMemGetInfo(&free_bytes, &totals[d]) != cudaSuccess) continue;
+        os << "firedb_vram_used_bytes{device=\"" << d << "\"} " << totals[d] - free_bytes << "\n";
+    }
+    os << "# HELP firedb_vram_total_bytes Device memory size\n# TYPE firedb_vram_total_bytes gauge\n";
+    for (int d = 0; d < devices; d++) {
+        os << "firedb_vram_total_bytes{device=\"" << d << "\"} " << totals[d] << "\n";
+    }
+    cudaSetDevice(current);
+}
+
+#endif
@@ -0,0 +1,119 @@
+#pragma once
+#ifndef FIREDB_DATASET_H
+#define FIREDB_DATASET_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <regex>
+#include <stdexcept>
+
+// Vector file readers: NumPy .npy (2-D float32) and the .fvecs / .ivecs
+// format of the SIFT and GloVe benchmark sets, where every row starts with
+// its int32 dimension.
+
+struct NpyHeader {
+    int rows;
+    int cols;
+    size_t header_size;
+    bool is_float32;
+};
+
+inline NpyHeader parse_npy(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) throw std::runtime_error("Could not open file");
+
+    char magic[6];
+    file.read(magic, 6);
+    if (std::strncmp(magic, "\x93NUMPY", 6) != 0)
+        throw std::runtime_error("Invalid NPY file");
+
+    file.seekg(8);
+    uint16_t header_len;
+    file.read(reinterpret_cast<char*>(&header_len), 2);
+
+    std::string header(header_len, ' ');
+    file.read(&header[0], header_len);
+
+    NpyHeader info{0, 0, 10 + (size_t)header_len, false};
+
+    if (header.find("<f4") != std::string::npos ||
+        header.find("'f4'") != std::string::npos)
+        info.is_float32 = true;
+
+    std::regex r(R"(shape['"]?:\s*\(\s*(\d+)\s*,\s*(\d+)\s*\))");
+    std::smatch m;
+    if (!std::regex_search(header, m, r))
+        throw std::runtime_error("Could not parse shape");
+
+    info.rows = std::stoi(m[1]);
+    info.cols = std::stoi(m[2]);
+    return info;
+}
+
+// Row-major rows x dim values held in memory.
+template <typename T>
+struct VectorSet {
+    size_t rows = 0;
+    size_t dim = 0;
+    std::vector<T> data;
+
+    const T* row(size_t r) const { return data.data() + r * dim; }
+};
+
+// Reads at most `limit` rows (0 for all) of a .fvecs / .ivecs file.
+template <typename T>
+inline VectorSet<T> load_vecs(const std::string& path, size_t limit = 0) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) throw std::runtime_error("could not open " + path);
+    size_t bytes = file.tellg();
+    file.seekg(0);
+
+    int32_t dim = 0;
+    if (!file.read(reinterpret_cast<char*>(&dim), sizeof(dim)) || dim <= 0) {
+        throw std::runtime_error("not a vecs file: " + path);
+    }
+    size_t row_bytes = sizeof(int32_t) + dim * sizeof(T);
+    if (bytes % row_bytes != 0) throw std::runtime_error("vecs file is truncated: " + path);
+
+    VectorSet<T> set;
+    set.dim = dim;
+    set.rows = bytes / row_bytes;
+    if (limit > 0) set.rows = std::min(set.rows, limit);
+    set.data.resize(set.rows * set.dim);
+
+    file.seekg(0);
+    int32_t row_dim = 0;
+    for (size_t r = 0; r < set.rows; r++) {
+        file.read(reinterpret_cast<char*>(&row_dim), sizeof(row_dim));
+        if (row_dim != dim) throw std::runtime_error("vecs rows differ in dimension: " + path);
+        file.read(reinterpret_cast<char*>(set.data.data() + r * set.dim), set.dim * sizeof(T));
+    }
+    if (!file) throw std::runtime_error("could not read " + path);
+    return set;
+}
+
+// Reads at most `limit` rows (0 for all) of a float32 .npy or .fvecs file.
+inline VectorSet<float> load_vectors(const std::string& path, size_t limit = 0) {
+    bool npy = path.size() >= 4 && path.compare(path.size() - 4, 4, ".npy") == 0;
+    if (!npy) return load_vecs<float>(path, limit);
+
+    NpyHeader h = parse_npy(path);
+    if (!h.is_float32) throw std::runtime_error("only float32 .npy files are supported");
+    VectorSet<float> set;
+    set.dim = h.cols;
+    set.rows = limit > 0 ? std::min<size_t>(h.rows, limit) : h.rows;
+    set.data.resize(set.rows * set.dim);
+
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(h.header_size);
+    if (!file.read(reinterpret_cast<char*>(set.data.data()), set.data.size() * sizeof(float))) {
+        throw std::runtime_error(".npy file is truncated: " + path);
+    }
+    return set;
+}
+
+#endif
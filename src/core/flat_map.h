@@ -0,0 +1,168 @@
+#pragma once
+#ifndef FIREDB_FLAT_MAP_H
+#define FIREDB_FLAT_MAP_H
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Open addressing uint64 -> uint64 map used for user id lookups. Keys and
+// values live in two flat arrays (linear probing, backward shift deletion, no
+// tombstones), so a lookup touches one or two cache lines instead of chasing
+// an unordered_map node. EMPTY_KEY marks free slots; a real key equal to it is
+// kept on the side.
+class FlatIdMap {
+    private:
+        static constexpr uint64_t EMPTY_KEY = ~0ull;
+        static constexpr size_t MIN_CAPACITY = 16;
+
+        std::vector<uint64_t> keys;
+        std::vector<uint64_t> values;
+        size_t mask = 0;
+        size_t count = 0;
+
+        bool has_empty_key = false;
+        uint64_t empty_key_value = 0;
+
+        static uint64_t hash(uint64_t k) {
+            // splitmix64 finalizer, user ids are often sequential
+            k ^= k >> 30;
+            k *= 0xbf58476d1ce4e5b9ull;
+            k ^= k >> 27;
+            k *= 0x94d049bb133111ebull;
+            k ^= k >> 31;
+            return k;
+        }
+
+        size_t slot_of(uint64_t key) const {
+            size_t i = hash(key) & mask;
+            while (keys[i] != key && keys[i] != EMPTY_KEY) i = (i + 1) & mask;
+            return i;
+        }
+
+        void rehash(size_t new_capacity) {
+            std::vector<uint64_t> old_keys(new_capacity, EMPTY_KEY);
+            std::vector<uint64_t> old_values(new_capacity);
+            old_keys.swap(keys);
+            old_values.swap(values);
+            mask = new_capacity - 1;
+
+            for (size_t i = 0; i < old_keys.size(); i++) {
+                if (old_keys[i] == EMPTY_KEY) continue;
+                size_t j = slot_of(old_keys[i]);
+                keys[j] = old_keys[i];
+                values[j] = old_values[i];
+            }
+        }
+
+        void grow_for(size_t n) {
+            // keep the load factor under 0.7
+            size_t needed = MIN_CAPACITY;
+            while (needed * 7 / 10 < n) needed *= 2;
+            if (needed > keys.size()) rehash(needed);
+        }
+
+    public:
+        FlatIdMap() { rehash(MIN_CAPACITY); }
+
+        size_t size() const { return count + (has_empty_key ? 1 : 0); }
+
+        void reserve(size_t n) { grow_for(n); }
+
+        void clear() {
+            keys.assign(keys.size(), EMPTY_KEY);
+            count = 0;
+            has_empty_key = false;
+        }
+
+        bool contains(uint64_t key) const {
+            if (key == EMPTY_KEY) return has_empty_key;
+            return keys[slot_of(key)] == key;
+        }
+
+        // Returns a pointer to the value, or nullptr. Invalidated by inserts.
+        const uint64_t* find(uint64_t key) const {
+            if (key == EMPTY_KEY) return has_empty_key ? &empty_key_value : nullptr;
+            size_t i = slot_of(key);
+            return keys[i] == key ? &values[i] : nullptr;
+        }
+
+        // Inserts or overwrites.
+        void assign(uint64_t key, uint64_t value) {
+            if (key == EMPTY_KEY) {
+                has_empty_key = true;
+                empty_key_value = value;
+                return;
+            }
+            grow_for(count + 1);
+            size_t i = slot_of(key);
+            if (keys[i] == EMPTY_KEY) {
+                keys[i] = key;
+                count++;
+            }
+            values[i] = value;
+        }
+
+        // Inserts only if the key is new. Returns false if it already existed.
+        bool insert(uint64_t key, uint64_t value) {
+            if (contains(key)) return false;
+            assign(key, value);
+            return true;
+        }
+
+        bool erase(uint64_t key) {
+            if (key == EMPTY_KEY) {
+                bool had = has_empty_key;
+                has_empty_key = false;
+                return had;
+            }
+
+            size_t i = slot_of(key);
+            if (keys[i] != key) return false;
+
+            // Backward shift: pull later entries of the probe run into the hole
+            // unless their home slot lies cyclically in (hole, j].
+            size_t j = i;
+            while (true) {
+                j = (j + 1) & mask;
+                if (keys[j] == EMPTY_KEY) break;
+                size_t home = hash(keys[j]) & mask;
+                bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+                if (stays) continue;
+                keys[i] = keys[j];
+                values[i] = values[j];
+                i = j;
+            }
+            keys[i] = EMPTY_KEY;
+            count--;
+            return true;
+        }
+
+        // Looks up n keys in one pass. Hashes are computed and their slots
+        // prefetched ahead of the probes so the cache misses overlap.
+        // Missing keys get `missing`.
+        void find_batch(const uint64_t* in, size_t n, uint64_t* out, uint64_t missing) const {
+            constexpr size_t AHEAD = 8;
+            for (size_t i = 0; i < n && i < AHEAD; i++) {
+                __builtin_prefetch(&keys[hash(in[i]) & mask]);
+            }
+            for (size_t i = 0; i < n; i++) {
+                if (i + AHEAD < n) {
+                    size_t s = hash(in[i + AHEAD]) & mask;
+                    __builtin_prefetch(&keys[s]);
+                    __builtin_prefetch(&values[s]);
+                }
+                const uint64_t* v = find(in[i]);
+                out[i] = v ? *v : missing;
+            }
+        }
+
+        template <typename F>
+        void for_each(F&& f) const {
+            for (size_t i = 0; i < keys.size(); i++) {
+                if (keys[i] != EMPTY_KEY) f(keys[i], values[i]);
+            }
+            if (has_empty_key) f(EMPTY_KEY, empty_key_value);
+        }
+};
+
+#endif
@@ -4,32 +4,77 @@
 
 #include <cuda_runtime.h>
 #include <cublas_v2.h>
+#include <cuda_fp16.h>
+#include <cuda_bf16.h>
 #include <vector>
 #include <algorithm>
 #include <iostream>
 #include <cmath>
+#include <cfloat>
+#include <stdexcept>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
 #include "slab.h"
+#include "attr.h"
+#include "simd.h"
+#include "search_result.h"
+#include "metrics.h"
+#include "cuda_util.h"
 
+// Largest k the device-side selection supports. Every thread keeps this many
+// candidates in local memory, so raising it costs occupancy.
+constexpr int GPU_MAX_K = 128;
+constexpr int TOPK_THREADS = 128;
 
-struct SearchResult {
-    uint64_t id;
-    float score;
+// Distance scratch per search lane. GEMM + top-k walk the rows in chunks that
+// fill it, so the scratch does not grow with the row count.
+constexpr size_t SCORE_CHUNK_BYTES = 32ull << 20;
+
+// add_single_vector() batches rows in pinned buffers of this size and sends
+// them after at most APPEND_MAX_DELAY, or sooner when a search needs them.
+constexpr size_t APPEND_BYTES = 4ull << 20;
+constexpr auto APPEND_MAX_DELAY = std::chrono::milliseconds(5);
+
+// Element type of the resident vectors. Norms, queries on the host, distances
+// and streamed tiles stay FP32 in every mode.
+enum StoragePrecision : uint8_t {
+    STORE_FP32 = 0,
+    STORE_FP16 = 1,
+    STORE_BF16 = 2
 };
 
 
+// One warp per row. Lanes read consecutive floats of the row so every load is
+// coalesced, then the partial sums are reduced with warp shuffles.
 __global__ void compute_norms_kernel(const float* data, float* norms, int rows, int cols) {
-    // BlockIdx is provided by CUDA, we do not need to pass it
-    int idx = blockIdx.x * blockDim.x + threadIdx.x;
-    if (idx >= rows) return;
+    int warp = (blockIdx.x * blockDim.x + threadIdx.x) / 32;
+    int lane = threadIdx.x & 31;
+    if (warp >= rows) return;
 
+    const float* vector = data + (size_t)warp * cols;
     float sum = 0.0f;
-    const float* vector = data + (idx * cols);
-
-    for (int i = 0; i < cols; i++) {
+    for (int i = lane; i < cols; i += 32) {
         float val = vector[i];
         sum += val * val;
     }
-    norms[idx] = sum;
+    for (int offset = 16; offset > 0; offset >>= 1) {
+        sum += __shfl_down_sync(0xffffffff, sum, offset);
+    }
+    if (lane == 0) norms[warp] = sum;
+}
+
+inline void launch_norms(const float* data, float* norms, size_t rows, size_t cols, cudaStream_t stream = 0) {
+    int threads = 256;
+    size_t blocks = (rows * 32 + threads - 1) / threads;
+    compute_norms_kernel<<<blocks, threads, 0, stream>>>(data, norms, rows, cols);
+    CUDA_CHECK_LAUNCH();
 }
 
 
@@ -49,143 +94,1628 @@ __global__ void compute_l2_dist_kernel(const float* db_norms, const float* query
 }
 
 
+// Slab row of the i-th row a shard holds. Shards take turns owning `rows`
+// consecutive slab rows; the default is the identity for a single index.
+struct RowStripe {
+    uint64_t rows = 1;
+    uint32_t shards = 1;
+    uint32_t shard = 0;
+
+    __host__ __device__ uint64_t to_global(uint64_t local) const {
+        if (shards == 1) return local;
+        return ((local / rows) * shards + shard) * rows + local % rows;
+    }
+};
+
+
+// One block per query. Each thread keeps a sorted top-k of a strided slice of
+// the query's column, then the block pulls the k smallest heads out one at a
+// time with a shared memory min reduction. Only k scores and ids are written.
+// With an id_map the written ids are id_map[row] instead of the row itself.
+// Rows whose bit is set in row_mask, or that lie past id_map_rows, are never
+// considered, so deleted rows do not take up result slots. Row numbers are
+// mapped through `stripe` before either lookup and before being written.
+__global__ void select_topk_kernel(const float* scores, int num_rows, int ld, int k,
+                                   uint64_t id_offset, const uint64_t* id_map, uint64_t id_map_rows,
+                                   const uint32_t* row_mask, float* out_scores, uint64_t* out_ids,
+                                   RowStripe stripe = RowStripe()) {
+    __shared__ float sh_score[TOPK_THREADS];
+    __shared__ int sh_owner[TOPK_THREADS];
+
+    int q = blockIdx.x;
+    int tid = threadIdx.x;
+    const float* column = scores + (size_t)q * ld;
+
+    float best_score[GPU_MAX_K];
+    int best_id[GPU_MAX_K];
+    int filled = 0;
+
+    for (int i = tid; i < num_rows; i += blockDim.x) {
+        if (row_mask) {
+            uint64_t row = stripe.to_global(id_offset + i);
+            if (row >= id_map_rows || (row_mask[row >> 5] >> (row & 31)) & 1u) continue;
+        }
+        float s = column[i];
+        if (filled == k && s >= best_score[k - 1]) continue;
+
+        int pos = filled < k ? filled++ : k - 1;
+        while (pos > 0 && best_score[pos - 1] > s) {
+            best_score[pos] = best_score[pos - 1];
+            best_id[pos] = best_id[pos - 1];
+            pos--;
+        }
+        best_score[pos] = s;
+        best_id[pos] = i;
+    }
+
+    int head = 0;
+    for (int r = 0; r < k; r++) {
+        sh_score[tid] = head < filled ? best_score[head] : FLT_MAX;
+        sh_owner[tid] = tid;
+        __syncthreads();
+
+        for (int stride = blockDim.x / 2; stride > 0; stride >>= 1) {
+            if (tid < stride && sh_score[tid + stride] < sh_score[tid]) {
+                sh_score[tid] = sh_score[tid + stride];
+                sh_owner[tid] = sh_owner[tid + stride];
+            }
+            __syncthreads();
+        }
+
+        if (tid == sh_owner[0]) {
+            bool valid = head < filled;
+            uint64_t id = EMPTY_ID;
+            if (valid) {
+                uint64_t row = stripe.to_global(id_offset + best_id[head]);
+                id = !id_map ? row : (row < id_map_rows ? id_map[row] : EMPTY_ID);
+            }
+            out_scores[q * k + r] = valid ? best_score[head] : FLT_MAX;
+            out_ids[q * k + r] = id;
+            head++;
+        }
+        __syncthreads();
+    }
+}
+
+
+// Bit r of the mask is set when row r has no live user id. One thread per
+// 32-row word, only words in [word_begin, word_end) are rebuilt.
+__global__ void build_dead_mask_kernel(const uint64_t* row_user, uint64_t rows, uint32_t* mask,
+                                       uint64_t word_begin, uint64_t word_end) {
+    uint64_t w = word_begin + blockIdx.x * (uint64_t)blockDim.x + threadIdx.x;
+    if (w >= word_end) return;
 
+    uint32_t bits = 0;
+    for (int b = 0; b < 32; b++) {
+        uint64_t r = w * 32 + b;
+        if (r >= rows || row_user[r] == EMPTY_ID) bits |= 1u << b;
+    }
+    mask[w] = bits;
+}
+
+
+// An AttrFilter as the mask kernel reads it, passed by value.
+struct DeviceClause {
+    const void* values;
+    uint64_t rows;
+    AttrType type;
+    AttrOp op;
+    int64_t ivalue;
+    float fvalue;
+};
+
+struct DeviceFilter {
+    DeviceClause clauses[ATTR_MAX_CLAUSES];
+    int num_clauses;
+};
+
+// Bit r of the mask is set when row r lies past `rows`, is set in dead_mask
+// (if given) or fails a clause. One thread per 32-row word.
+__global__ void build_filter_mask_kernel(DeviceFilter filter, const uint32_t* dead_mask, uint64_t rows,
+                                         uint32_t* mask, uint64_t words) {
+    uint64_t w = blockIdx.x * (uint64_t)blockDim.x + threadIdx.x;
+    if (w >= words) return;
+
+    uint32_t bits = dead_mask ? dead_mask[w] : 0;
+    for (int b = 0; b < 32; b++) {
+        uint64_t r = w * 32 + b;
+        if (r >= rows) {
+            bits |= 1u << b;
+            continue;
+        }
+        for (int c = 0; c < filter.num_clauses && !((bits >> b) & 1u); c++) {
+            const DeviceClause& cl = filter.clauses[c];
+            if (!attr_clause_matches(cl.type, cl.values, cl.rows, r, cl.op, cl.ivalue, cl.fvalue)) bits |= 1u << b;
+        }
+    }
+    mask[w] = bits;
+}
+
+
+template <typename T>
+__global__ void gather_rows_kernel(const T* src, const uint64_t* rows, size_t n, int cols, T* dst) {
+    size_t idx = blockIdx.x * (size_t)blockDim.x + threadIdx.x;
+    if (idx >= n * cols) return;
+
+    size_t r = idx / cols;
+    int c = idx % cols;
+    dst[idx] = src[rows[r] * cols + c];
+}
+
+
+template <typename T> __device__ inline T from_float(float v);
+template <> __device__ inline __half from_float<__half>(float v) { return __float2half_rn(v); }
+template <> __device__ inline __nv_bfloat16 from_float<__nv_bfloat16>(float v) { return __float2bfloat16_rn(v); }
+
+template <typename T>
+__global__ void convert_from_float_kernel(const float* src, T* dst, size_t n) {
+    size_t idx = blockIdx.x * (size_t)blockDim.x + threadIdx.x;
+    if (idx >= n) return;
+    dst[idx] = from_float<T>(src[idx]);
+}
+
+
+// One thread per query. Merges a block's sorted top-k into the running sorted
+// top-k, so results from several row ranges can be combined on the device.
+__global__ void merge_topk_kernel(float* run_scores, uint64_t* run_ids,
+                                  const float* new_scores, const uint64_t* new_ids,
+                                  int num_queries, int k) {
+    int q = blockIdx.x * blockDim.x + threadIdx.x;
+    if (q >= num_queries) return;
+
+    float* rs = run_scores + q * k;
+    uint64_t* ri = run_ids + q * k;
+    const float* ns = new_scores + q * k;
+    const uint64_t* ni = new_ids + q * k;
+
+    float merged_score[GPU_MAX_K];
+    uint64_t merged_id[GPU_MAX_K];
+    int a = 0, b = 0;
+    for (int r = 0; r < k; r++) {
+        if (rs[a] <= ns[b]) {
+            merged_score[r] = rs[a];
+            merged_id[r] = ri[a++];
+        } else {
+            merged_score[r] = ns[b];
+            merged_id[r] = ni[b++];
+        }
+    }
+    for (int r = 0; r < k; r++) {
+        rs[r] = merged_score[r];
+        ri[r] = merged_id[r];
+    }
+}
+
+
+
+// Fused GEMM + L2 + top-k for small batches, which never writes the distance
+// matrix to global memory. Used for FP32 rows when a batch has at most
+// FUSED_MAX_QUERIES queries; bigger batches are compute bound and go through
+// cuBLAS. Grid (splits, query tiles): a block scans rows_per_split rows for
+// FUSED_QUERIES queries, FUSED_ROWS rows at a time, one row per thread.
+constexpr int FUSED_QUERIES = 8;
+constexpr int FUSED_ROWS = 128;
+constexpr int FUSED_DIMS = 32;
+constexpr int FUSED_MAX_QUERIES = 32;
+constexpr int FUSED_SPLIT_ROWS = 4096;
+constexpr int FUSED_MAX_SPLITS = 512;
+
+// Every split writes its sorted top-k per query (score, slab row) to
+// part_scores / part_rows at ((q * splits) + split) * k, padded with FLT_MAX
+// and EMPTY_ID. Masked rows are skipped as in select_topk_kernel. Without
+// db_norms the score is the negated inner product.
+__global__ void fused_l2_topk_kernel(const float* db, const float* db_norms, int num_rows, int dim,
+                                     const float* queries, const float* q_norms, int num_queries, int k,
+                                     int rows_per_split, uint64_t id_offset,
+                                     const uint32_t* row_mask, uint64_t mask_rows, RowStripe stripe,
+                                     float* part_scores, uint64_t* part_rows) {
+    __shared__ float sh_rows[FUSED_ROWS][FUSED_DIMS + 1];
+    __shared__ float sh_q[FUSED_QUERIES][FUSED_DIMS];
+    __shared__ float sh_dist[FUSED_QUERIES][FUSED_ROWS];
+    __shared__ float sh_best[FUSED_QUERIES][GPU_MAX_K];
+    __shared__ int sh_best_row[FUSED_QUERIES][GPU_MAX_K];
+    __shared__ int sh_filled[FUSED_QUERIES];
+
+    int split = blockIdx.x;
+    int q0 = blockIdx.y * FUSED_QUERIES;
+    int tid = threadIdx.x;
+    int warp = tid / 32;
+    int lane = tid & 31;
+    int nq = min(FUSED_QUERIES, num_queries - q0);
+    int begin = split * rows_per_split;
+    int end = min(num_rows, begin + rows_per_split);
+
+    if (tid < FUSED_QUERIES) sh_filled[tid] = 0;
+    __syncthreads();
+
+    for (int tile = begin; tile < end; tile += FUSED_ROWS) {
+        int r = tile + tid;
+        float acc[FUSED_QUERIES];
+        for (int qq = 0; qq < FUSED_QUERIES; qq++) acc[qq] = 0.0f;
+
+        // dims are staged FUSED_DIMS at a time so the row loads coalesce
+        for (int d0 = 0; d0 < dim; d0 += FUSED_DIMS) {
+            for (int i = tid; i < FUSED_ROWS * FUSED_DIMS; i += FUSED_ROWS) {
+                int rr = i / FUSED_DIMS, d = d0 + i % FUSED_DIMS;
+                sh_rows[rr][i % FUSED_DIMS] = tile + rr < end && d < dim ? db[(size_t)(tile + rr) * dim + d] : 0.0f;
+            }
+            for (int i = tid; i < FUSED_QUERIES * FUSED_DIMS; i += FUSED_ROWS) {
+                int qq = i / FUSED_DIMS, d = d0 + i % FUSED_DIMS;
+                sh_q[qq][i % FUSED_DIMS] = qq < nq && d < dim ? queries[(size_t)(q0 + qq) * dim + d] : 0.0f;
+            }
+            __syncthreads();
+            for (int dd = 0; dd < FUSED_DIMS; dd++) {
+                float x = sh_rows[tid][dd];
+                for (int qq = 0; qq < FUSED_QUERIES; qq++) acc[qq] += x * sh_q[qq][dd];
+            }
+            __syncthreads();
+        }
+
+        bool live = r < end;
+        if (live && row_mask) {
+            uint64_t row = stripe.to_global(id_offset + r);
+            live = row < mask_rows && !((row_mask[row >> 5] >> (row & 31)) & 1u);
+        }
+        for (int qq = 0; qq < FUSED_QUERIES; qq++) {
+            float score = FLT_MAX;
+            if (live && qq < nq) score = db_norms ? db_norms[r] + q_norms[q0 + qq] - 2.0f * acc[qq] : -acc[qq];
+            sh_dist[qq][tid] = score;
+        }
+        __syncthreads();
+
+        // One warp per query folds the tile into its sorted running top-k.
+        // Only candidates under the current k-th score are inserted, which
+        // after the first tiles is a small fraction of the rows.
+        for (int qq = warp; qq < nq; qq += blockDim.x / 32) {
+            float* best = sh_best[qq];
+            int* best_row = sh_best_row[qq];
+            int filled = sh_filled[qq];
+            for (int c = 0; c < FUSED_ROWS; c += 32) {
+                float s = sh_dist[qq][c + lane];
+                float worst = filled == k ? best[k - 1] : FLT_MAX;
+                unsigned hits = __ballot_sync(0xffffffff, s < worst);
+                while (hits) {
+                    int src = __ffs(hits) - 1;
+                    hits &= hits - 1;
+                    float v = __shfl_sync(0xffffffff, s, src);
+                    if (filled == k && v >= best[k - 1]) continue;
+
+                    int below = 0;
+                    for (int j = lane; j < filled; j += 32) below += best[j] <= v;
+                    for (int o = 16; o > 0; o >>= 1) below += __shfl_xor_sync(0xffffffff, below, o);
+                    int n = min(filled + 1, k);
+
+                    float moved[GPU_MAX_K / 32];
+                    int moved_row[GPU_MAX_K / 32];
+                    for (int t = 0; t < GPU_MAX_K / 32; t++) {
+                        int j = lane + 32 * t;
+                        if (j > below && j < n) {
+                            moved[t] = best[j - 1];
+                            moved_row[t] = best_row[j - 1];
+                        }
+                    }
+                    __syncwarp();
+                    for (int t = 0; t < GPU_MAX_K / 32; t++) {
+                        int j = lane + 32 * t;
+                        if (j > below && j < n) {
+                            best[j] = moved[t];
+                            best_row[j] = moved_row[t];
+                        }
+                    }
+                    if (lane == 0) {
+                        best[below] = v;
+                        best_row[below] = tile + c + src;
+                    }
+                    filled = n;
+                    __syncwarp();
+                }
+            }
+            if (lane == 0) sh_filled[qq] = filled;
+        }
+        __syncthreads();
+    }
+
+    for (int qq = 0; qq < nq; qq++) {
+        for (int j = tid; j < k; j += blockDim.x) {
+            size_t at = ((size_t)(q0 + qq) * gridDim.x + split) * k + j;
+            bool valid = j < sh_filled[qq];
+            part_scores[at] = valid ? sh_best[qq][j] : FLT_MAX;
+            part_rows[at] = valid ? stripe.to_global(id_offset + sh_best_row[qq][j]) : EMPTY_ID;
+        }
+    }
+}
+
+// ids holds column positions from select_topk_kernel over a candidate matrix
+// and is rewritten in place with the candidates' slab rows, or user ids
+// through id_map.
+__global__ void map_candidate_ids_kernel(const float* scores, uint64_t* ids, const uint64_t* cand_rows,
+                                         int ld, int k, int num_queries,
+                                         const uint64_t* id_map, uint64_t id_map_rows) {
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= num_queries * k) return;
+
+    if (scores[idx] == FLT_MAX) {
+        ids[idx] = EMPTY_ID;
+        return;
+    }
+    uint64_t row = cand_rows[(size_t)(idx / k) * ld + ids[idx]];
+    ids[idx] = !id_map ? row : (row < id_map_rows ? id_map[row] : EMPTY_ID);
+}
+
+
+// Row -> user id table mirrored from an IdSlab, plus the dead-row bitmask
+// derived from it. Only the rows dirtied since the last sync are uploaded.
+struct DeviceRowUsers {
+    uint64_t* d_row_user = nullptr;
+    uint32_t* d_dead_mask = nullptr;
+    size_t capacity = 0;
+    size_t rows = 0;
+    size_t tracker = SIZE_MAX;
+
+    void sync(IdSlab& ids, cudaStream_t stream = 0) {
+        if (tracker == SIZE_MAX) tracker = ids.add_row_user_tracker();
+        auto range = ids.take_dirty_row_users(tracker);
+        // rows the writer adds from here on are left to the next sync
+        size_t wanted = range.second;
+        if (wanted > capacity) {
+            capacity = std::max<size_t>(wanted, std::max<size_t>(1024, capacity * 2));
+            cudaFree(d_row_user);
+            cudaFree(d_dead_mask);
+            CUDA_CHECK(cudaMalloc(&d_row_user, capacity * sizeof(uint64_t)));
+            CUDA_CHECK(cudaMalloc(&d_dead_mask, (capacity + 31) / 32 * sizeof(uint32_t)));
+            range.first = 0;
+        }
+        if (range.second > range.first) {
+            CUDA_CHECK(cudaMemcpyAsync(d_row_user + range.first, ids.row_user_data() + range.first,
+                                       (range.second - range.first) * sizeof(uint64_t), cudaMemcpyHostToDevice, stream));
+            metrics().add(metrics().h2d_bytes, (range.second - range.first) * sizeof(uint64_t));
+        }
+
+        // the old last word may have had padding bits for rows that now exist
+        uint64_t word_begin = std::min(range.first, rows) / 32;
+        uint64_t word_end = (wanted + 31) / 32;
+        if (word_end > word_begin) {
+            int threads = 256;
+            int blocks = (word_end - word_begin + threads - 1) / threads;
+            build_dead_mask_kernel<<<blocks, threads, 0, stream>>>(d_row_user, wanted, d_dead_mask, word_begin, word_end);
+            CUDA_CHECK_LAUNCH();
+        }
+        rows = wanted;
+    }
+
+    void release() {
+        cudaFree(d_row_user);
+        cudaFree(d_dead_mask);
+        d_row_user = nullptr;
+        d_dead_mask = nullptr;
+    }
+};
+
+// Device copies of the attribute columns filters read, kept current like
+// DeviceRowUsers, and the row mask a filtered search builds from them.
+struct DeviceAttrs {
+    struct Column {
+        void* d_values = nullptr;
+        size_t capacity = 0;
+        size_t rows = 0;
+    };
+    std::vector<Column> columns;
+    size_t tracker = SIZE_MAX;
+    uint32_t* d_mask = nullptr;
+    size_t mask_words = 0;
+
+    void sync_column(AttrStore& attrs, uint32_t c, cudaStream_t stream) {
+        if (columns.size() < attrs.size()) columns.resize(attrs.size());
+        AttrColumn& src = attrs.column(c);
+        Column& col = columns[c];
+        size_t width = attr_width(src.get_type());
+        auto range = src.take_dirty(tracker);
+        if (range.second > col.capacity) {
+            col.capacity = std::max<size_t>(range.second, std::max<size_t>(1024, col.capacity * 2));
+            cudaFree(col.d_values);
+            CUDA_CHECK(cudaMalloc(&col.d_values, col.capacity * width));
+            range.first = 0;
+        }
+        if (range.second > range.first) {
+            CUDA_CHECK(cudaMemcpyAsync(static_cast<char*>(col.d_values) + range.first * width,
+                                       static_cast<const char*>(src.data()) + range.first * width,
+                                       (range.second - range.first) * width, cudaMemcpyHostToDevice, stream));
+            metrics().add(metrics().h2d_bytes, (range.second - range.first) * width);
+        }
+        col.rows = range.second;
+    }
+
+    // Syncs the filter's columns and returns the mask of rows [0, rows) that
+    // are dead or fail it.
+    const uint32_t* build_mask(AttrStore& attrs, const AttrFilter& filter, const uint32_t* dead_mask,
+                               uint64_t rows, cudaStream_t stream = 0) {
+        if (filter.clauses.size() > ATTR_MAX_CLAUSES) {
+            throw std::runtime_error("too many filter clauses");
+        }
+        DeviceFilter f = {};
+        f.num_clauses = filter.clauses.size();
+        for (int i = 0; i < f.num_clauses; i++) {
+            const AttrClause& c = filter.clauses[i];
+            sync_column(attrs, c.column, stream);
+            f.clauses[i] = { columns[c.column].d_values, columns[c.column].rows, attrs.column(c.column).get_type(),
+                             c.op, c.ivalue, c.fvalue };
+        }
+
+        uint64_t words = (rows + 31) / 32;
+        if (words > mask_words) {
+            mask_words = std::max<size_t>(words, mask_words * 2);
+            cudaFree(d_mask);
+            CUDA_CHECK(cudaMalloc(&d_mask, mask_words * sizeof(uint32_t)));
+        }
+        if (words > 0) {
+            int threads = 256;
+            int blocks = (words + threads - 1) / threads;
+            build_filter_mask_kernel<<<blocks, threads, 0, stream>>>(f, dead_mask, rows, d_mask, words);
+            CUDA_CHECK_LAUNCH();
+        }
+        return d_mask;
+    }
+
+    void release() {
+        for (auto& col : columns) cudaFree(col.d_values);
+        columns.clear();
+        cudaFree(d_mask);
+        d_mask = nullptr;
+        mask_words = 0;
+    }
+};
+
+
+// Exact FP32 distances (in the slab's metric) for the fetch_k candidate rows
+// of every query, read from the mmap'd slab, keeping the best k in the k
+// slots of out[q * k]. Cosine queries must already be normalized. Rows are
+// mapped to user ids when `ids` is given; rows without a live user are
+// dropped. `candidates` is caller scratch, reused across calls.
+inline void rerank_exact(const MatrixSlab& slab, const IdSlab* ids, const float* queries, size_t num_queries,
+                         const uint64_t* rows, int fetch_k, int k, SearchResult* out,
+                         std::vector<std::pair<float, uint64_t>>& candidates) {
+    const float* data = slab.get_data_ptr();
+    size_t dim = slab.get_dim();
+    bool l2 = slab.get_metric() == METRIC_L2;
+    pad_results(out, num_queries * k);
+
+    for (size_t q = 0; q < num_queries; q++) {
+        candidates.clear();
+        for (int i = 0; i < fetch_k; i++) {
+            uint64_t row = rows[q * fetch_k + i];
+            if (row == EMPTY_ID) continue;
+            if (ids && ids->get_user_from_row(row) == NO_USER) continue;
+
+            const float* x = data + row * dim;
+            float score = l2 ? l2_sq_f32(x, queries + q * dim, dim) : -dot_f32(x, queries + q * dim, dim);
+            candidates.push_back({ score, row });
+        }
+
+        size_t keep = std::min<size_t>(k, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + keep, candidates.end());
+        for (size_t i = 0; i < keep; i++) {
+            uint64_t id = ids ? ids->get_user_from_row(candidates[i].second) : candidates[i].second;
+            out[q * k + i] = { id, candidates[i].first };
+        }
+    }
+}
+
+inline void rerank_exact(const MatrixSlab& slab, const IdSlab* ids,
+                         const std::vector<std::vector<float>>& queries, const std::vector<uint64_t>& rows,
+                         int fetch_k, int k, std::vector<std::vector<SearchResult>>& out) {
+    std::vector<float> flat;
+    std::vector<SearchResult> best(queries.size() * k);
+    std::vector<std::pair<float, uint64_t>> candidates;
+    flatten_queries(queries, slab.get_dim(), flat);
+    rerank_exact(slab, ids, flat.data(), queries.size(), rows.data(), fetch_k, k, best.data(), candidates);
+    out = unpack_results(best.data(), queries.size(), k);
+}
+
+
+// Query side buffers of one batch, with pinned host copies of the queries and
+// the top-k results. The synchronous search uses a lane on the legacy default
+// stream; async lanes get their own stream and a completion event.
+struct SearchLane {
+    cudaStream_t stream = 0;
+    cudaEvent_t done = nullptr;
+    float* d_queries = nullptr;
+    float* d_q_norms = nullptr;
+    void* d_queries_lp = nullptr;
+    float* d_topk_scores = nullptr;
+    uint64_t* d_topk_ids = nullptr;
+    float* d_block_scores = nullptr;
+    uint64_t* d_block_ids = nullptr;
+    float* d_scores = nullptr;
+    float* h_queries = nullptr;
+    float* h_q_norms = nullptr;
+    float* h_topk_scores = nullptr;
+    uint64_t* h_topk_ids = nullptr;
+    // Rows the top-k stage skips for the batch in flight: the dead-row mask,
+    // or a filtered search's combined mask, and the rows it covers.
+    const uint32_t* d_mask = nullptr;
+    uint64_t mask_rows = 0;
+    // GPU stage timings of the batch in flight, see StageTimer
+    StageTimer timer;
+};
+
+using SearchCallback = std::function<void(std::vector<std::vector<SearchResult>>&)>;
+
+// Batches search_async() keeps in flight. Two are enough to overlap one
+// batch's uploads and readback with the other's GEMM and top-k.
+constexpr int ASYNC_LANES = 2;
+
+// Concurrency: searches (sync or async) may come from any number of threads
+// while one writer thread adds rows. Searches take turns on submit_mutex and
+// each covers the resident rows published when it started. Everything that
+// writes resident rows holds write_mutex, enqueues its copies on stream 0 and
+// only then publishes the new current_count with a release store; a search
+// loads it with acquire and orders its lane after stream 0, so every row it
+// counts is on the device before it is scored. Searches flush the append ring
+// only when the writer is not busy and never wait for an upload. compact(),
+// load_data() and clear() exclude searches for their whole run.
 class GpuIndex {
 private:
     cublasHandle_t handle;
 
     float* d_db = nullptr;
     float* d_db_norms = nullptr;
-
-    float* d_queries = nullptr;
-    float* d_q_norms = nullptr;
-    float* d_results = nullptr;
+    SearchLane sync_lane;
+    size_t chunk_rows;
 
     size_t max_vectors;
     size_t dim;
-    size_t current_count = 0;
+    std::atomic<size_t> current_count{ 0 };
     size_t max_batch_size = 100;
+    int device = 0;
+    RowStripe stripe;
+
+    // With STORE_FP16/STORE_BF16 the resident rows live in d_db_lp instead of
+    // d_db and the resident GEMM goes through cublasGemmEx with FP32
+    // accumulation. Uploads pass through the FP32 d_convert staging buffer.
+    // With rerank_factor > 1 the GPU returns k * rerank_factor candidates and
+    // the final k are picked by exact FP32 distances against the slab.
+    StoragePrecision precision;
+    void* d_db_lp = nullptr;
+    float* d_convert = nullptr;
+    size_t convert_rows = 0;
+    int rerank_factor = 0;
+
+    // Only METRIC_L2 uploads and uses row norms. The other metrics score with
+    // a single alpha = -1 GEMM whose output goes straight to top-k.
+    Metric metric = METRIC_L2;
+
+    // Streaming state. Rows of the attached slab past current_count are not
+    // resident and get uploaded in tiles on every search, double buffered so
+    // the copy of tile N+1 runs on copy_stream while tile N is scored.
+    const MatrixSlab* slab = nullptr;
+    size_t tile_rows = 0;
+    cudaStream_t copy_stream = nullptr;
+    float* h_stage[2] = { nullptr, nullptr };
+    float* h_stage_norms[2] = { nullptr, nullptr };
+    float* d_tile[2] = { nullptr, nullptr };
+    float* d_tile_norms[2] = { nullptr, nullptr };
+    cudaEvent_t tile_uploaded[2];
+    cudaEvent_t tile_consumed[2];
+
+    // Set by attach_ids(). When present the top-k kernel writes user ids, so
+    // search results need no host lookups, and skips dead rows.
+    IdSlab* ids = nullptr;
+    DeviceRowUsers row_users;
+
+    // Set by attach_attrs(), read by filtered searches only.
+    AttrStore* attrs = nullptr;
+    DeviceAttrs device_attrs;
+
+    // Append ring for add_single_vector(). Pending rows collect in one of two
+    // pinned buffers, which goes up in one copy once full, once its oldest row
+    // has waited APPEND_MAX_DELAY, or before anything reads resident rows. The
+    // other buffer fills while that copy runs. Allocated on first use.
+    // Guarded, with the resident rows, by write_mutex.
+    mutable std::mutex write_mutex;
+    float* h_append[2] = { nullptr, nullptr };
+    float* h_append_norms[2] = { nullptr, nullptr };
+    cudaEvent_t append_uploaded[2];
+    size_t append_capacity = 0;
+    size_t append_pending = 0;
+    int append_buffer = 0;
+    std::chrono::steady_clock::time_point append_oldest;
+
+    // search_async() state. Lanes are set up on first use. Batches are
+    // enqueued under submit_mutex and finished in order by completion_thread,
+    // which waits for a lane's event, builds the results from its pinned
+    // buffers and hands the lane back.
+    struct PendingBatch {
+        int lane;
+        int num_queries;
+        int k;
+        int slots;
+        SearchResult* out;
+        std::promise<void> written;
+        std::promise<std::vector<std::vector<SearchResult>>> promise;
+        SearchCallback callback;
+        std::chrono::steady_clock::time_point submitted;
+    };
+    SearchLane async_lanes[ASYNC_LANES];
+    bool lane_busy[ASYNC_LANES] = {};
+    bool async_started = false;
+    bool async_stopping = false;
+    int next_lane = 0;
+    std::mutex submit_mutex;
+    std::mutex pending_mutex;
+    std::condition_variable pending_cv;
+    std::deque<PendingBatch> pending;
+    std::thread completion_thread;
+    cudaEvent_t rows_ready = nullptr;
+    std::vector<std::pair<float, uint64_t>> rerank_scratch;
+
+    static size_t score_chunk_rows(size_t batch) {
+        return std::max<size_t>(1024, SCORE_CHUNK_BYTES / (batch * sizeof(float)));
+    }
+
+    static size_t default_tile_rows(size_t dimension) {
+        // ~64 MB of vectors per tile buffer
+        return std::max<size_t>(1024, (64ull << 20) / (dimension * sizeof(float)));
+    }
+
+    static size_t element_bytes(StoragePrecision p) {
+        return p == STORE_FP32 ? sizeof(float) : sizeof(uint16_t);
+    }
+    cudaDataType lp_type() const { return precision == STORE_FP16 ? CUDA_R_16F : CUDA_R_16BF; }
+    bool uses_norms() const { return metric == METRIC_L2; }
+    const float* resident_norms() const { return uses_norms() ? d_db_norms : nullptr; }
+
+    void convert_to_lp(const float* d_src, void* d_dst, size_t n, cudaStream_t stream = 0) {
+        int threads = 256;
+        size_t blocks = (n + threads - 1) / threads;
+        if (precision == STORE_FP16) {
+            convert_from_float_kernel<<<blocks, threads, 0, stream>>>(d_src, static_cast<__half*>(d_dst), n);
+        } else {
+            convert_from_float_kernel<<<blocks, threads, 0, stream>>>(d_src, static_cast<__nv_bfloat16*>(d_dst), n);
+        }
+        CUDA_CHECK_LAUNCH();
+    }
+
+    void create_lane(SearchLane& lane, bool async) {
+        CUDA_CHECK(cudaMalloc(&lane.d_queries, max_batch_size * dim * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&lane.d_q_norms, max_batch_size * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&lane.d_topk_scores, max_batch_size * GPU_MAX_K * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&lane.d_topk_ids, max_batch_size * GPU_MAX_K * sizeof(uint64_t)));
+        CUDA_CHECK(cudaMalloc(&lane.d_block_scores, max_batch_size * GPU_MAX_K * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&lane.d_block_ids, max_batch_size * GPU_MAX_K * sizeof(uint64_t)));
+        CUDA_CHECK(cudaMalloc(&lane.d_scores, chunk_rows * max_batch_size * sizeof(float)));
+        if (precision != STORE_FP32) {
+            CUDA_CHECK(cudaMalloc(&lane.d_queries_lp, max_batch_size * dim * sizeof(uint16_t)));
+        }
+        CUDA_CHECK(cudaMallocHost(&lane.h_queries, max_batch_size * dim * sizeof(float)));
+        CUDA_CHECK(cudaMallocHost(&lane.h_q_norms, max_batch_size * sizeof(float)));
+        CUDA_CHECK(cudaMallocHost(&lane.h_topk_scores, max_batch_size * GPU_MAX_K * sizeof(float)));
+        CUDA_CHECK(cudaMallocHost(&lane.h_topk_ids, max_batch_size * GPU_MAX_K * sizeof(uint64_t)));
+        if (!async) return;
+
+        // non-blocking, so a lane does not serialize with the uploads on stream 0
+        CUDA_CHECK(cudaStreamCreateWithFlags(&lane.stream, cudaStreamNonBlocking));
+        CUDA_CHECK(cudaEventCreateWithFlags(&lane.done, cudaEventDisableTiming));
+    }
+
+    static void destroy_lane(SearchLane& lane) {
+        cudaFree(lane.d_queries);
+        cudaFree(lane.d_q_norms);
+        cudaFree(lane.d_queries_lp);
+        cudaFree(lane.d_topk_scores);
+        cudaFree(lane.d_topk_ids);
+        cudaFree(lane.d_block_scores);
+        cudaFree(lane.d_block_ids);
+        cudaFree(lane.d_scores);
+        cudaFreeHost(lane.h_queries);
+        cudaFreeHost(lane.h_q_norms);
+        cudaFreeHost(lane.h_topk_scores);
+        cudaFreeHost(lane.h_topk_ids);
+        lane.timer.release();
+        if (!lane.stream) return;
+        cudaEventDestroy(lane.done);
+        cudaStreamDestroy(lane.stream);
+    }
+
+    // Writes n host vectors to resident rows [first, first + n) in the storage
+    // precision, with their norms copied from host_norms or computed in FP32.
+    void upload_rows(const float* host_vecs, const float* host_norms, size_t first, size_t n) {
+        NvtxRange range("firedb upload");
+        bool norms = uses_norms();
+        metrics().add(metrics().rows_uploaded, n);
+        metrics().add(metrics().h2d_bytes, n * dim * sizeof(float) + (norms && host_norms ? n * sizeof(float) : 0));
+        if (norms && host_norms) {
+            CUDA_CHECK(cudaMemcpyAsync(d_db_norms + first, host_norms, n * sizeof(float), cudaMemcpyHostToDevice, 0));
+        }
+
+        if (precision == STORE_FP32) {
+            CUDA_CHECK(cudaMemcpyAsync(d_db + first * dim, host_vecs, n * dim * sizeof(float), cudaMemcpyHostToDevice, 0));
+            if (norms && !host_norms) launch_norms(d_db + first * dim, d_db_norms + first, n, dim);
+            return;
+        }
+
+        // everything is on stream 0, so d_convert is free again for the next chunk
+        for (size_t done = 0; done < n; done += convert_rows) {
+            size_t c = std::min(convert_rows, n - done);
+            CUDA_CHECK(cudaMemcpyAsync(d_convert, host_vecs + done * dim, c * dim * sizeof(float), cudaMemcpyHostToDevice, 0));
+            if (norms && !host_norms) launch_norms(d_convert, d_db_norms + first + done, c, dim);
+            convert_to_lp(d_convert, static_cast<uint16_t*>(d_db_lp) + (first + done) * dim, c * dim);
+        }
+    }
+
+    void start_appends() {
+        append_capacity = std::max<size_t>(1, APPEND_BYTES / (dim * sizeof(float)));
+        for (int b = 0; b < 2; b++) {
+            CUDA_CHECK(cudaMallocHost(&h_append[b], append_capacity * dim * sizeof(float)));
+            CUDA_CHECK(cudaMallocHost(&h_append_norms[b], append_capacity * sizeof(float)));
+            CUDA_CHECK(cudaEventCreateWithFlags(&append_uploaded[b], cudaEventDisableTiming));
+        }
+    }
+
+    // Makes pending appends resident with one async copy from pinned memory.
+    // Called with write_mutex held.
+    void flush_appends_locked() {
+        if (append_pending == 0) return;
+        int b = append_buffer;
+        size_t first = current_count.load(std::memory_order_relaxed);
+        upload_rows(h_append[b], h_append_norms[b], first, append_pending);
+        CUDA_CHECK(cudaEventRecord(append_uploaded[b], 0));
+        current_count.store(first + append_pending, std::memory_order_release);
+        append_pending = 0;
+        append_buffer = b ^ 1;
+    }
+
+    // Called by searches: pending appends are flushed unless the writer holds
+    // write_mutex, in which case they wait for its own flush or the next
+    // search. Returns the resident rows the search covers.
+    size_t snapshot_rows() {
+        std::unique_lock<std::mutex> lock(write_mutex, std::try_to_lock);
+        if (lock.owns_lock()) flush_appends_locked();
+        return current_count.load(std::memory_order_acquire);
+    }
+
+    size_t append_rows_locked(const float* host_vecs, size_t n, const float* host_norms) {
+        flush_appends_locked();
+        size_t first = current_count.load(std::memory_order_relaxed);
+        size_t fit = std::min(n, max_vectors - first);
+        if (fit < n && !tile_rows) std::cout << "GPU Full!" << std::endl;
+        if (fit == 0) return 0;
+
+        upload_rows(host_vecs, host_norms, first, fit);
+        current_count.store(first + fit, std::memory_order_release);
+        return fit;
+    }
+
+    // GEMM + L2 + top-k over `rows` consecutive vectors whose global row ids
+    // start at `id_offset`, at most chunk_rows at a time through lane.d_scores.
+    // The first chunk of a `first` block writes the running top-k directly,
+    // later chunks are merged into it. `lowp` rows are in the storage
+    // precision, otherwise FP32. Without `translate` the ids are slab rows.
+    // Without d_norms the score is the negated inner product.
+    // Everything runs on lane.stream; the caller has bound the cuBLAS handle.
+    void score_block(SearchLane& lane, const void* d_rows, bool lowp, const float* d_norms, size_t rows, uint64_t id_offset,
+                     int num_queries, int k, bool first, bool translate) {
+        if (!lowp && num_queries <= FUSED_MAX_QUERIES) {
+            score_fused(lane, static_cast<const float*>(d_rows), d_norms, rows, id_offset, num_queries, k, first, translate);
+            return;
+        }
+
+        size_t row_bytes = dim * (lowp ? element_bytes(precision) : sizeof(float));
+        for (size_t begin = 0; begin < rows; begin += chunk_rows) {
+            size_t n = std::min(chunk_rows, rows - begin);
+            score_chunk(lane, static_cast<const char*>(d_rows) + begin * row_bytes, lowp, d_norms ? d_norms + begin : nullptr, n,
+                        id_offset + begin, num_queries, k, first && begin == 0, translate);
+        }
+    }
+
+    // Small FP32 batches: per-split top-k lists from fused_l2_topk_kernel,
+    // kept in lane.d_scores, reduced to k per query by select_topk_kernel.
+    void score_fused(SearchLane& lane, const float* d_rows, const float* d_norms, size_t rows, uint64_t id_offset,
+                     int num_queries, int k, bool first, bool translate) {
+        size_t scratch_bytes = chunk_rows * max_batch_size * sizeof(float);
+        size_t split_bytes = (size_t)num_queries * k * (sizeof(float) + sizeof(uint64_t));
+        // part_rows starts 8-byte aligned after part_scores, up to one float of padding
+        size_t max_splits = std::min<size_t>(FUSED_MAX_SPLITS, (scratch_bytes - sizeof(float)) / split_bytes);
+        size_t splits = std::min(max_splits, std::max<size_t>(1, (rows + FUSED_SPLIT_ROWS - 1) / FUSED_SPLIT_ROWS));
+        size_t per_split = (rows + splits - 1) / splits;
+        per_split = (per_split + FUSED_ROWS - 1) / FUSED_ROWS * FUSED_ROWS;
+        splits = (rows + per_split - 1) / per_split;
+
+        int ld = splits * k;
+        float* part_scores = lane.d_scores;
+        uint64_t* part_rows = reinterpret_cast<uint64_t*>(lane.d_scores + ((size_t)num_queries * ld + 1) / 2 * 2);
+        const uint64_t* id_map = ids && translate ? row_users.d_row_user : nullptr;
+
+        dim3 grid(splits, (num_queries + FUSED_QUERIES - 1) / FUSED_QUERIES);
+        int fused = lane.timer.start(STAGE_FUSED, lane.stream);
+        fused_l2_topk_kernel<<<grid, FUSED_ROWS, 0, lane.stream>>>(
+            d_rows, d_norms, rows, dim, lane.d_queries, lane.d_q_norms, num_queries, k,
+            per_split, id_offset, lane.d_mask, lane.mask_rows, stripe, part_scores, part_rows
+        );
+        CUDA_CHECK_LAUNCH();
+        lane.timer.stop(fused, lane.stream);
+
+        int topk = lane.timer.start(STAGE_TOPK, lane.stream);
+        float* out_scores = first ? lane.d_topk_scores : lane.d_block_scores;
+        uint64_t* out_ids = first ? lane.d_topk_ids : lane.d_block_ids;
+        select_topk_kernel<<<num_queries, TOPK_THREADS, 0, lane.stream>>>(
+            part_scores, ld, ld, k, 0, nullptr, 0, nullptr, out_scores, out_ids
+        );
+        int threads = 256;
+        int blocks = (num_queries * k + threads - 1) / threads;
+        map_candidate_ids_kernel<<<blocks, threads, 0, lane.stream>>>(
+            out_scores, out_ids, part_rows, ld, k, num_queries, id_map, row_users.rows
+        );
+        if (!first) {
+            int merge_blocks = (num_queries + threads - 1) / threads;
+            merge_topk_kernel<<<merge_blocks, threads, 0, lane.stream>>>(
+                lane.d_topk_scores, lane.d_topk_ids, lane.d_block_scores, lane.d_block_ids, num_queries, k
+            );
+        }
+        CUDA_CHECK_LAUNCH();
+        lane.timer.stop(topk, lane.stream);
+    }
+
+    void score_chunk(SearchLane& lane, const void* d_rows, bool lowp, const float* d_norms, size_t rows, uint64_t id_offset,
+                     int num_queries, int k, bool first, bool translate) {
+        float alpha = d_norms ? -2.0f : -1.0f;
+        float beta = 0.0f;
+        float* d_scratch = lane.d_scores;
+
+        int gemm = lane.timer.start(STAGE_GEMM, lane.stream);
+        if (lowp) {
+            CUBLAS_CHECK(cublasGemmEx(handle,
+                CUBLAS_OP_T, CUBLAS_OP_N,
+                rows, num_queries, dim,
+                &alpha,
+                d_rows, lp_type(), dim,
+                lane.d_queries_lp, lp_type(), dim,
+                &beta,
+                d_scratch, CUDA_R_32F, rows,
+                CUBLAS_COMPUTE_32F, CUBLAS_GEMM_DEFAULT_TENSOR_OP
+            ));
+        } else {
+            CUBLAS_CHECK(cublasSgemm(handle,
+                CUBLAS_OP_T, CUBLAS_OP_N,
+                rows, num_queries, dim,
+                &alpha,
+                static_cast<const float*>(d_rows), dim,
+                lane.d_queries, dim,
+                &beta,
+                d_scratch, rows
+            ));
+        }
+        lane.timer.stop(gemm, lane.stream);
+
+        int total_pairs = rows * num_queries;
+        int threads = 256;
+        int blocks = (total_pairs + threads - 1) / threads;
+
+        if (d_norms) {
+            int distance = lane.timer.start(STAGE_DISTANCE, lane.stream);
+            compute_l2_dist_kernel<<<blocks, threads, 0, lane.stream>>>(
+                d_norms, lane.d_q_norms, d_scratch, rows, num_queries
+            );
+            CUDA_CHECK_LAUNCH();
+            lane.timer.stop(distance, lane.stream);
+        }
+
+        // with ids attached mask_rows is row_users.rows, the id_map bound too
+        const uint64_t* id_map = ids && translate ? row_users.d_row_user : nullptr;
+        int topk = lane.timer.start(STAGE_TOPK, lane.stream);
+        if (first) {
+            select_topk_kernel<<<num_queries, TOPK_THREADS, 0, lane.stream>>>(
+                d_scratch, rows, rows, k, id_offset, id_map, lane.mask_rows, lane.d_mask,
+                lane.d_topk_scores, lane.d_topk_ids, stripe
+            );
+        } else {
+            select_topk_kernel<<<num_queries, TOPK_THREADS, 0, lane.stream>>>(
+                d_scratch, rows, rows, k, id_offset, id_map, lane.mask_rows, lane.d_mask,
+                lane.d_block_scores, lane.d_block_ids, stripe
+            );
+            int merge_blocks = (num_queries + threads - 1) / threads;
+            merge_topk_kernel<<<merge_blocks, threads, 0, lane.stream>>>(
+                lane.d_topk_scores, lane.d_topk_ids, lane.d_block_scores, lane.d_block_ids, num_queries, k
+            );
+        }
+        CUDA_CHECK_LAUNCH();
+        lane.timer.stop(topk, lane.stream);
+    }
+
+    void stage_tile(size_t begin, size_t rows, int b) {
+        // h_stage[b] is free once its previous upload finished, d_tile[b] once
+        // the compute stream is done scoring the tile that used it before.
+        CUDA_CHECK(cudaEventSynchronize(tile_uploaded[b]));
+        CUDA_CHECK(cudaStreamWaitEvent(copy_stream, tile_consumed[b], 0));
+
+        std::memcpy(h_stage[b], slab->get_data_ptr() + begin * dim, rows * dim * sizeof(float));
+        int upload = sync_lane.timer.start(STAGE_STREAM, copy_stream);
+        CUDA_CHECK(cudaMemcpyAsync(d_tile[b], h_stage[b], rows * dim * sizeof(float),
+                                   cudaMemcpyHostToDevice, copy_stream));
+        metrics().add(metrics().h2d_bytes, rows * dim * sizeof(float));
+        if (uses_norms()) {
+            std::memcpy(h_stage_norms[b], slab->get_norms_ptr() + begin, rows * sizeof(float));
+            CUDA_CHECK(cudaMemcpyAsync(d_tile_norms[b], h_stage_norms[b], rows * sizeof(float),
+                                       cudaMemcpyHostToDevice, copy_stream));
+            metrics().add(metrics().h2d_bytes, rows * sizeof(float));
+        }
+        sync_lane.timer.stop(upload, copy_stream);
+        CUDA_CHECK(cudaEventRecord(tile_uploaded[b], copy_stream));
+    }
+
+    void stream_rows(size_t begin, size_t end, int num_queries, int k, bool first, bool translate) {
+        NvtxRange range("firedb stream tiles");
+        size_t num_tiles = (end - begin + tile_rows - 1) / tile_rows;
+        auto tile_size = [&](size_t t) { return std::min(tile_rows, end - begin - t * tile_rows); };
+
+        stage_tile(begin, tile_size(0), 0);
+        for (size_t t = 0; t < num_tiles; t++) {
+            int b = t % 2;
+            size_t rows = tile_size(t);
+
+            CUDA_CHECK(cudaStreamWaitEvent(0, tile_uploaded[b], 0));
+            score_block(sync_lane, d_tile[b], false, uses_norms() ? d_tile_norms[b] : nullptr, rows, begin + t * tile_rows,
+                        num_queries, k, first && t == 0, translate);
+            CUDA_CHECK(cudaEventRecord(tile_consumed[b], 0));
+
+            if (t + 1 < num_tiles) {
+                stage_tile(begin + (t + 1) * tile_rows, tile_size(t + 1), (t + 1) % 2);
+            }
+        }
+    }
+
+    // Copies a batch into lane's pinned staging buffers with its norms (L2)
+    // or normalized (cosine).
+    void stage_queries(SearchLane& lane, const float* queries, int num_queries) {
+        ScopedStage pack(STAGE_PACK);
+        std::memcpy(lane.h_queries, queries, num_queries * dim * sizeof(float));
+        for (int q = 0; q < num_queries; q++) {
+            float* query = lane.h_queries + q * dim;
+            if (metric == METRIC_COSINE) normalize_vector(query, dim);
+            lane.h_q_norms[q] = uses_norms() ? squared_norm(query, dim) : 0.0f;
+        }
+    }
+
+    // Writes a lane's k results per query to the `slots` wide rows of `out`.
+    static void write_results(const SearchLane& lane, int num_queries, int k, int slots, SearchResult* out) {
+        pad_results(out, num_queries * slots);
+        for (int q = 0; q < num_queries; q++) {
+            int n = 0;
+            for (int i = 0; i < k; i++) {
+                uint64_t id = lane.h_topk_ids[q * k + i];
+                if (id == EMPTY_ID) continue;
+                out[q * slots + n++] = { id, lane.h_topk_scores[q * k + i] };
+            }
+        }
+    }
+
+    // Synchronous search on sync_lane over `resident` device rows (and the
+    // slab rows past them when streaming), limited to `filter` when given.
+    // Without `translate` the results are slab rows even with ids attached.
+    // Callers hold submit_mutex with no async batch in flight.
+    void run_search(const float* queries, int num_queries, int k, SearchResult* out, size_t resident,
+                    const AttrFilter* filter = nullptr, bool translate = true) {
+        NvtxRange range("firedb search");
+        auto started = std::chrono::steady_clock::now();
+        // growth must not move the slab while tiles or re-rank rows are read
+        std::shared_lock<std::shared_mutex> view;
+        if (slab) view = slab->read_lock();
+        size_t streamed_end = tile_rows ? std::max<size_t>(slab->get_count(), resident) : resident;
+
+        int slots = std::max(k, 0);
+        int safe_k = std::min((size_t)slots, streamed_end);
+        if (safe_k > GPU_MAX_K) {
+            throw std::runtime_error("k exceeds GPU_MAX_K");
+        }
+        if (safe_k <= 0) {
+            pad_results(out, num_queries * slots);
+            return;
+        }
+
+        // Re-ranking needs slab rows back, user ids are looked up afterwards
+        bool rerank = precision != STORE_FP32 && rerank_factor > 1 && slab && resident > 0;
+        int fetch_k = safe_k;
+        if (rerank) {
+            fetch_k = std::min<size_t>({ (size_t)GPU_MAX_K, (size_t)safe_k * rerank_factor, streamed_end });
+        }
+
+        sync_lane.timer.begin();
+        stage_queries(sync_lane, queries, num_queries);
+        int upload = sync_lane.timer.start(STAGE_H2D, 0);
+        CUDA_CHECK(cudaMemcpy(sync_lane.d_queries, sync_lane.h_queries, num_queries * dim * sizeof(float), cudaMemcpyHostToDevice));
+        CUDA_CHECK(cudaMemcpy(sync_lane.d_q_norms, sync_lane.h_q_norms, num_queries * sizeof(float), cudaMemcpyHostToDevice));
+        if (precision != STORE_FP32) convert_to_lp(sync_lane.d_queries, sync_lane.d_queries_lp, num_queries * dim);
+        sync_lane.timer.stop(upload, 0);
+        metrics().add(metrics().h2d_bytes, num_queries * (dim + 1) * sizeof(float));
+        int masking = sync_lane.timer.start(STAGE_MASK, 0);
+        if (ids) row_users.sync(*ids);
+        sync_lane.d_mask = ids ? row_users.d_dead_mask : nullptr;
+        sync_lane.mask_rows = row_users.rows;
+        if (filter && !filter->empty()) {
+            if (!attrs) {
+                throw std::runtime_error("filtered search needs attach_attrs()");
+            }
+            // the mask is indexed by slab row, which shards and streamed tiles map to
+            uint64_t rows = ids ? row_users.rows : (slab ? std::max(slab->get_count(), resident) : resident);
+            sync_lane.d_mask = device_attrs.build_mask(*attrs, *filter, sync_lane.d_mask, rows);
+            sync_lane.mask_rows = rows;
+        }
+        sync_lane.timer.stop(masking, 0);
+
+        if (resident > 0) {
+            bool lowp = precision != STORE_FP32;
+            const void* d_rows = lowp ? d_db_lp : static_cast<const void*>(d_db);
+            score_block(sync_lane, d_rows, lowp, resident_norms(), resident, 0, num_queries, fetch_k, true,
+                        translate && !rerank);
+        }
+        if (streamed_end > resident) {
+            stream_rows(resident, streamed_end, num_queries, fetch_k, resident == 0, translate && !rerank);
+        }
+
+        int readback = sync_lane.timer.start(STAGE_D2H, 0);
+        CUDA_CHECK(cudaMemcpy(sync_lane.h_topk_scores, sync_lane.d_topk_scores, num_queries * fetch_k * sizeof(float),
+                              cudaMemcpyDeviceToHost));
+        CUDA_CHECK(cudaMemcpy(sync_lane.h_topk_ids, sync_lane.d_topk_ids, num_queries * fetch_k * sizeof(uint64_t),
+                              cudaMemcpyDeviceToHost));
+        sync_lane.timer.stop(readback, 0);
+        sync_lane.timer.collect();
+        metrics().add(metrics().d2h_bytes, num_queries * fetch_k * (sizeof(float) + sizeof(uint64_t)));
+
+        if (rerank) {
+            // the staged copy, which cosine has normalized
+            ScopedStage reranking(STAGE_RERANK);
+            rerank_exact(*slab, translate ? ids : nullptr, sync_lane.h_queries, num_queries, sync_lane.h_topk_ids,
+                         fetch_k, slots, out, rerank_scratch);
+        } else {
+            write_results(sync_lane, num_queries, safe_k, slots, out);
+        }
+        count_search(num_queries, started);
+    }
+
+    static void count_search(int num_queries, std::chrono::steady_clock::time_point started) {
+        metrics().add(metrics().searches, 1);
+        metrics().add(metrics().queries, num_queries);
+        metrics().add(metrics().search_ns, elapsed_ns(started));
+    }
+
+    void check_batch(size_t num_queries) const {
+        if (num_queries > max_batch_size) {
+            throw std::runtime_error("query batch exceeds max_batch_size");
+        }
+    }
+
+    void start_async() {
+        for (auto& lane : async_lanes) create_lane(lane, true);
+        CUDA_CHECK(cudaEventCreateWithFlags(&rows_ready, cudaEventDisableTiming));
+        completion_thread = std::thread([this] { complete_batches(); });
+        async_started = true;
+    }
+
+    // Blocks until every async batch has finished. Needed before anything
+    // that rewrites rows a batch may still be reading.
+    void drain_async() {
+        if (!async_started) return;
+        std::unique_lock<std::mutex> lock(pending_mutex);
+        pending_cv.wait(lock, [&] {
+            return pending.empty() && std::none_of(lane_busy, lane_busy + ASYNC_LANES, [](bool b) { return b; });
+        });
+    }
+
+    void complete_batches() {
+        cudaSetDevice(device);
+        while (true) {
+            std::unique_lock<std::mutex> lock(pending_mutex);
+            pending_cv.wait(lock, [&] { return async_stopping || !pending.empty(); });
+            if (pending.empty()) return;
+            PendingBatch batch = std::move(pending.front());
+            pending.pop_front();
+            lock.unlock();
+
+            // batches were enqueued in order on alternating lanes, so waiting
+            // on the oldest one first never delays a later batch's results
+            SearchLane& lane = async_lanes[batch.lane];
+            cudaEventSynchronize(lane.done);
+            std::vector<std::vector<SearchResult>> results;
+            if (batch.out) {
+                write_results(lane, batch.num_queries, batch.k, batch.slots, batch.out);
+            } else {
+                results.resize(batch.num_queries);
+                for (int q = 0; q < batch.num_queries; q++) {
+                    for (int i = 0; i < batch.k; i++) {
+                        uint64_t id = lane.h_topk_ids[q * batch.k + i];
+                        if (id == EMPTY_ID) continue;
+                        results[q].push_back({ id, lane.h_topk_scores[q * batch.k + i] });
+                    }
+                }
+            }
+
+            count_search(batch.num_queries, batch.submitted);
+
+            lock.lock();
+            lane_busy[batch.lane] = false;
+            lock.unlock();
+            pending_cv.notify_all();
+            if (batch.out) batch.written.set_value();
+            else finish_batch(batch.promise, batch.callback, results);
+        }
+    }
+
+    static void finish_batch(std::promise<std::vector<std::vector<SearchResult>>>& promise,
+                             const SearchCallback& callback, std::vector<std::vector<SearchResult>>& results) {
+        try {
+            if (callback) callback(results);
+            promise.set_value(std::move(results));
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+    }
+
+    // Runs the batch synchronously into `out` if it cannot go through a lane
+    // (streamed tiles, re-ranking, nothing to search) and returns true, else
+    // enqueues it on the next free lane, taking `batch`, and returns false.
+    bool submit_batch(const float* queries, int num_queries, int k, SearchResult* out, PendingBatch& batch) {
+        std::lock_guard<std::mutex> submit(submit_mutex);
+        CUDA_CHECK(cudaSetDevice(device));
+        size_t resident = snapshot_rows();
+
+        int safe_k = std::min((size_t)std::max(k, 0), resident);
+        if (safe_k > GPU_MAX_K) {
+            throw std::runtime_error("k exceeds GPU_MAX_K");
+        }
+        bool streamed = tile_rows && slab->get_count() > resident;
+        bool rerank = precision != STORE_FP32 && rerank_factor > 1 && slab && resident > 0;
+        if (streamed || rerank || safe_k <= 0 || num_queries == 0) {
+            drain_async();
+            if (num_queries) run_search(queries, num_queries, k, out, resident);
+            return true;
+        }
+
+        NvtxRange range("firedb submit batch");
+        auto submitted = std::chrono::steady_clock::now();
+        if (!async_started) start_async();
+        int l = next_lane;
+        next_lane = (next_lane + 1) % ASYNC_LANES;
+        {
+            std::unique_lock<std::mutex> lock(pending_mutex);
+            pending_cv.wait(lock, [&] { return !lane_busy[l]; });
+            lane_busy[l] = true;
+        }
+        SearchLane& lane = async_lanes[l];
+
+        try {
+            // uploads run on stream 0, which a non-blocking lane does not wait for
+            CUDA_CHECK(cudaEventRecord(rows_ready, 0));
+            CUDA_CHECK(cudaStreamWaitEvent(lane.stream, rows_ready, 0));
+            stage_queries(lane, queries, num_queries);
+            CUDA_CHECK(cudaMemcpyAsync(lane.d_queries, lane.h_queries, num_queries * dim * sizeof(float),
+                                       cudaMemcpyHostToDevice, lane.stream));
+            CUDA_CHECK(cudaMemcpyAsync(lane.d_q_norms, lane.h_q_norms, num_queries * sizeof(float),
+                                       cudaMemcpyHostToDevice, lane.stream));
+            if (precision != STORE_FP32) convert_to_lp(lane.d_queries, lane.d_queries_lp, num_queries * dim, lane.stream);
+            if (ids) row_users.sync(*ids, lane.stream);
+            lane.d_mask = ids ? row_users.d_dead_mask : nullptr;
+            lane.mask_rows = row_users.rows;
+
+            bool lowp = precision != STORE_FP32;
+            const void* d_rows = lowp ? d_db_lp : static_cast<const void*>(d_db);
+            CUBLAS_CHECK(cublasSetStream(handle, lane.stream));
+            score_block(lane, d_rows, lowp, resident_norms(), resident, 0, num_queries, safe_k, true, true);
+            CUBLAS_CHECK(cublasSetStream(handle, 0));
+
+            CUDA_CHECK(cudaMemcpyAsync(lane.h_topk_scores, lane.d_topk_scores, num_queries * safe_k * sizeof(float),
+                                       cudaMemcpyDeviceToHost, lane.stream));
+            CUDA_CHECK(cudaMemcpyAsync(lane.h_topk_ids, lane.d_topk_ids, num_queries * safe_k * sizeof(uint64_t),
+                                       cudaMemcpyDeviceToHost, lane.stream));
+            CUDA_CHECK(cudaEventRecord(lane.done, lane.stream));
+        } catch (...) {
+            // give the lane back so drain_async() and later batches do not wait on it
+            cublasSetStream(handle, 0);
+            {
+                std::lock_guard<std::mutex> lock(pending_mutex);
+                lane_busy[l] = false;
+            }
+            pending_cv.notify_all();
+            throw;
+        }
+        metrics().add(metrics().h2d_bytes, num_queries * (dim + 1) * sizeof(float));
+        metrics().add(metrics().d2h_bytes, num_queries * safe_k * (sizeof(float) + sizeof(uint64_t)));
+
+        batch.lane = l;
+        batch.num_queries = num_queries;
+        batch.k = safe_k;
+        batch.slots = std::max(k, 0);
+        batch.submitted = submitted;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            pending.push_back(std::move(batch));
+        }
+        pending_cv.notify_all();
+        return false;
+    }
 
 public:
-    GpuIndex(size_t dimension, size_t capacity) : dim(dimension), max_vectors(capacity) {
-        cublasCreate(&handle);
+    GpuIndex(size_t dimension, size_t capacity, StoragePrecision storage = STORE_FP32, int device_id = 0)
+        : dim(dimension), max_vectors(capacity), precision(storage), device(device_id) {
+        chunk_rows = score_chunk_rows(max_batch_size);
+        CUDA_CHECK(cudaSetDevice(device));
+        CUBLAS_CHECK(cublasCreate(&handle));
+        create_lane(sync_lane, false);
+
+        if (max_vectors == 0) return;
+
+        void** d_rows = precision == STORE_FP32 ? reinterpret_cast<void**>(&d_db) : &d_db_lp;
+        if (cudaMalloc(d_rows, max_vectors * dim * element_bytes(precision)) != cudaSuccess ||
+            cudaMalloc(&d_db_norms, max_vectors * sizeof(float)) != cudaSuccess) {
+            cudaGetLastError();
+            std::cout << "[GPU] Could not reserve " << max_vectors
+                      << " resident vectors, every row will be streamed" << std::endl;
+            cudaFree(d_db);
+            cudaFree(d_db_lp);
+            cudaFree(d_db_norms);
+            d_db = d_db_norms = nullptr;
+            d_db_lp = nullptr;
+            max_vectors = 0;
+            return;
+        }
+
+        if (precision != STORE_FP32) {
+            convert_rows = std::min(max_vectors, default_tile_rows(dim));
+            CUDA_CHECK(cudaMalloc(&d_convert, convert_rows * dim * sizeof(float)));
+        }
+    }
+
+    // Number of rows (at most `wanted`) whose vectors and norms fit in free
+    // VRAM next to the streaming tile buffers and the lanes' distance scratch.
+    static size_t resident_capacity(size_t dimension, size_t wanted, size_t batch,
+                                    StoragePrecision storage = STORE_FP32) {
+        size_t free_bytes = 0, total_bytes = 0;
+        if (cudaMemGetInfo(&free_bytes, &total_bytes) != cudaSuccess) return 0;
+
+        size_t tile = default_tile_rows(dimension);
+        size_t scratch = (1 + ASYNC_LANES) * score_chunk_rows(batch) * batch * sizeof(float);
+        size_t reserve = 2 * tile * (dimension + 1) * sizeof(float) + scratch + (256ull << 20);
+        if (free_bytes <= reserve) return 0;
+
+        size_t per_row = dimension * element_bytes(storage) + sizeof(float);
+        return std::min(wanted, (free_bytes - reserve) / per_row);
+    }
+
+    // 0 without a CUDA device (or driver), callers fall back to CpuIndex.
+    static int device_count() {
+        int devices = 0;
+        if (cudaGetDeviceCount(&devices) != cudaSuccess) {
+            cudaGetLastError();
+            return 0;
+        }
+        return devices;
+    }
+
+    // Resident rows, 0 when the constructor could not allocate them.
+    size_t get_capacity() const { return max_vectors; }
+    size_t get_count() const {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        return current_count.load(std::memory_order_relaxed) + append_pending;
+    }
+    int get_device() const { return device; }
+
+    // Makes this index one shard of a ShardedIndex, holding the slab rows
+    // `layout` assigns to it. Set before any rows are added.
+    void set_layout(RowStripe layout) { stripe = layout; }
 
+    // Metric of the rows this index holds; attach_slab adopts the slab's.
+    // Cosine rows must already be unit length, as MatrixSlab stores them. Set
+    // before any rows are added.
+    void set_metric(Metric m) { metric = m; }
 
-        cudaMalloc(&d_db, max_vectors * dim * sizeof(float));
-        cudaMalloc(&d_db_norms, max_vectors * sizeof(float));
-        cudaMalloc(&d_queries, max_batch_size * dim * sizeof(float));
-        cudaMalloc(&d_q_norms, max_batch_size * sizeof(float));
-        cudaMalloc(&d_results, max_vectors * max_batch_size * sizeof(float));
+    // Forgets the resident rows so they can be added again.
+    void clear() {
+        std::lock_guard<std::mutex> submit(submit_mutex);
+        drain_async();
+        std::lock_guard<std::mutex> lock(write_mutex);
+        current_count.store(0);
+        append_pending = 0;
     }
 
+    // Candidates fetched per result for exact FP32 re-ranking against the
+    // attached slab. 0 or 1 disables it. Only used with FP16/BF16 storage.
+    void set_rerank_factor(int factor) { rerank_factor = factor; }
+
     ~GpuIndex() {
+        if (async_started) {
+            {
+                std::lock_guard<std::mutex> lock(pending_mutex);
+                async_stopping = true;
+            }
+            pending_cv.notify_all();
+            completion_thread.join();
+        }
+
+        cudaSetDevice(device);
         cudaFree(d_db);
+        cudaFree(d_db_lp);
+        cudaFree(d_convert);
         cudaFree(d_db_norms);
-        cudaFree(d_queries);
-        cudaFree(d_q_norms);
-        cudaFree(d_results);
+        destroy_lane(sync_lane);
+        if (async_started) {
+            for (auto& lane : async_lanes) destroy_lane(lane);
+            cudaEventDestroy(rows_ready);
+        }
+        if (append_capacity) {
+            for (int b = 0; b < 2; b++) {
+                cudaFreeHost(h_append[b]);
+                cudaFreeHost(h_append_norms[b]);
+                cudaEventDestroy(append_uploaded[b]);
+            }
+        }
+        row_users.release();
+        device_attrs.release();
+        if (tile_rows) {
+            for (int b = 0; b < 2; b++) {
+                cudaFreeHost(h_stage[b]);
+                cudaFreeHost(h_stage_norms[b]);
+                cudaFree(d_tile[b]);
+                cudaFree(d_tile_norms[b]);
+                cudaEventDestroy(tile_uploaded[b]);
+                cudaEventDestroy(tile_consumed[b]);
+            }
+            cudaStreamDestroy(copy_stream);
+        }
         cublasDestroy(handle);
     }
 
-    bool add_single_vector(const float* host_vec) {
-        if (current_count >= max_vectors) {
-            std::cout << "GPU Full!" << std::endl;
+    // Lets search cover rows of `source` that did not fit in VRAM by streaming
+    // them from the mmap'd slab. The slab must outlive the index. Without
+    // `stream` the slab is only read for re-ranking.
+    void attach_slab(const MatrixSlab& source, bool stream = true) {
+        if (slab) return;
+        slab = &source;
+        metric = source.get_metric();
+        if (!stream) return;
+
+        CUDA_CHECK(cudaSetDevice(device));
+        tile_rows = default_tile_rows(dim);
+
+        CUDA_CHECK(cudaStreamCreateWithFlags(&copy_stream, cudaStreamNonBlocking));
+        for (int b = 0; b < 2; b++) {
+            CUDA_CHECK(cudaMallocHost(&h_stage[b], tile_rows * dim * sizeof(float)));
+            CUDA_CHECK(cudaMallocHost(&h_stage_norms[b], tile_rows * sizeof(float)));
+            CUDA_CHECK(cudaMalloc(&d_tile[b], tile_rows * dim * sizeof(float)));
+            CUDA_CHECK(cudaMalloc(&d_tile_norms[b], tile_rows * sizeof(float)));
+            CUDA_CHECK(cudaEventCreateWithFlags(&tile_uploaded[b], cudaEventDisableTiming));
+            CUDA_CHECK(cudaEventCreateWithFlags(&tile_consumed[b], cudaEventDisableTiming));
+        }
+    }
+
+    // Queues one row in the append ring; it is resident by the next search.
+    bool add_single_vector(const float* host_vec, const float* host_norm = nullptr) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        if (current_count.load(std::memory_order_relaxed) + append_pending >= max_vectors) {
+            // With a streamed slab the row is simply read at search time
+            if (!tile_rows) std::cout << "GPU Full!" << std::endl;
             return false;
         }
+        CUDA_CHECK(cudaSetDevice(device));
+        if (!append_capacity) start_appends();
 
-        size_t offset = current_count * dim;
-        cudaMemcpy(d_db + offset, host_vec, dim * sizeof(float), cudaMemcpyHostToDevice);
+        int b = append_buffer;
+        auto now = std::chrono::steady_clock::now();
+        if (append_pending == 0) {
+            // the copy that last read this buffer has to be done
+            CUDA_CHECK(cudaEventSynchronize(append_uploaded[b]));
+            append_oldest = now;
+        }
+        std::memcpy(h_append[b] + append_pending * dim, host_vec, dim * sizeof(float));
+        if (uses_norms()) h_append_norms[b][append_pending] = host_norm ? *host_norm : squared_norm(host_vec, dim);
+        append_pending++;
 
-        float sum_sq = 0.0f;
-        for (size_t i = 0; i < dim; i++) sum_sq += host_vec[i] * host_vec[i];
+        if (append_pending == append_capacity || now - append_oldest >= APPEND_MAX_DELAY) flush_appends_locked();
+        return true;
+    }
 
-        cudaMemcpy(d_db_norms + current_count, &sum_sq, sizeof(float), cudaMemcpyHostToDevice);
+    // Appends n vectors with one H2D copy (one per staging chunk with
+    // FP16/BF16 storage). Norms are copied from host_norms when given (the
+    // slab keeps them), otherwise computed by one norms launch over the new
+    // range. Rows past max_vectors are left to the streaming path. Returns the
+    // number of rows made resident.
+    size_t add_vectors(const float* host_vecs, size_t n, const float* host_norms = nullptr) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        CUDA_CHECK(cudaSetDevice(device));
+        return append_rows_locked(host_vecs, n, host_norms);
+    }
 
-        current_count++;
-        return true;
+    // Makes search return user ids from `source` instead of slab rows. Rows
+    // without a live user id are left out of the results.
+    void attach_ids(IdSlab& source) {
+        CUDA_CHECK(cudaSetDevice(device));
+        ids = &source;
+        row_users.sync(*ids);
     }
 
-    void load_data(const MatrixSlab& slab) {
-        current_count = slab.get_count();
-        std::cout << "[GPU] Uploading " << current_count << " vectors..." << std::endl;
+    // add_vectors for large host ranges that are not pinned, such as an mmap'd
+    // file. The range is page-locked for the copy so it runs at full PCIe
+    // speed, falling back to a pageable copy if registration is refused.
+    size_t add_vectors_registered(const float* host_vecs, size_t n, const float* host_norms = nullptr) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t begin = reinterpret_cast<uintptr_t>(host_vecs) / page * page;
+        uintptr_t end = reinterpret_cast<uintptr_t>(host_vecs + n * dim);
+        void* region = reinterpret_cast<void*>(begin);
 
-        cudaMemcpy(d_db, slab.get_data_ptr(),
-                   current_count * dim * sizeof(float),
-                   cudaMemcpyHostToDevice);
+        CUDA_CHECK(cudaSetDevice(device));
+        bool registered = cudaHostRegister(region, end - begin, cudaHostRegisterReadOnly) == cudaSuccess;
+        if (!registered) cudaGetLastError();
 
-        int threads = 256;
-        int blocks = (current_count + threads - 1) / threads;
-        compute_norms_kernel<<<blocks, threads>>>(d_db, d_db_norms, current_count, dim);
+        size_t fit = add_vectors(host_vecs, n, host_norms);
+        CUDA_CHECK(cudaDeviceSynchronize());
 
-        cudaDeviceSynchronize();
+        if (registered) cudaHostUnregister(region);
+        return fit;
     }
 
-    std::vector<std::vector<SearchResult>> search(const std::vector<std::vector<float>>& queries, int k) {
-        int num_queries = queries.size();
-        if (num_queries == 0) return {};
+    // Drops dead rows from the resident copy once the slab has been compacted
+    // down to `live` (old row numbers, ascending). Surviving vectors and norms
+    // are gathered on the device, so only the row list crosses PCIe. Resident
+    // capacity that frees up is refilled from the compacted slab.
+    void compact(const std::vector<uint64_t>& live, const MatrixSlab& compacted) {
+        NvtxRange range("firedb compact");
+        std::lock_guard<std::mutex> submit(submit_mutex);
+        CUDA_CHECK(cudaSetDevice(device));
+        drain_async();
+        std::lock_guard<std::mutex> lock(write_mutex);
+        flush_appends_locked();
+        size_t resident = current_count.load();
+        size_t keep = std::lower_bound(live.begin(), live.end(), (uint64_t)resident) - live.begin();
+
+        if (keep > 0) {
+            const size_t chunk = 65536;
+            size_t row_bytes = dim * element_bytes(precision);
+            char* d_store = precision == STORE_FP32 ? reinterpret_cast<char*>(d_db) : static_cast<char*>(d_db_lp);
+            void* d_tmp = nullptr;
+            float* d_tmp_norms = nullptr;
+            uint64_t* d_rows = nullptr;
+            CUDA_CHECK(cudaMalloc(&d_tmp, chunk * row_bytes));
+            CUDA_CHECK(cudaMalloc(&d_tmp_norms, chunk * sizeof(float)));
+            CUDA_CHECK(cudaMalloc(&d_rows, chunk * sizeof(uint64_t)));
 
+            // Chunk c only reads rows >= its own start (live[i] >= i), which no
+            // earlier chunk has written, so the gather can run in place.
+            for (size_t begin = 0; begin < keep; begin += chunk) {
+                size_t n = std::min(chunk, keep - begin);
+                CUDA_CHECK(cudaMemcpy(d_rows, live.data() + begin, n * sizeof(uint64_t), cudaMemcpyHostToDevice));
 
-        std::vector<float> flat_queries;
-        std::vector<float> host_q_norms;
+                int threads = 256;
+                int blocks = (n * dim + threads - 1) / threads;
+                if (precision == STORE_FP32) {
+                    gather_rows_kernel<<<blocks, threads>>>(d_db, d_rows, n, dim, static_cast<float*>(d_tmp));
+                } else {
+                    gather_rows_kernel<<<blocks, threads>>>(static_cast<const uint16_t*>(d_db_lp), d_rows, n, dim,
+                                                            static_cast<uint16_t*>(d_tmp));
+                }
+                blocks = (n + threads - 1) / threads;
+                gather_rows_kernel<<<blocks, threads>>>(d_db_norms, d_rows, n, 1, d_tmp_norms);
 
-        for (const auto& q : queries) {
-            float sum_sq = 0.0f;
-            for (float val : q) {
-                flat_queries.push_back(val);
-                sum_sq += val * val;
+                CUDA_CHECK(cudaMemcpy(d_store + begin * row_bytes, d_tmp, n * row_bytes, cudaMemcpyDeviceToDevice));
+                CUDA_CHECK(cudaMemcpy(d_db_norms + begin, d_tmp_norms, n * sizeof(float), cudaMemcpyDeviceToDevice));
             }
-            host_q_norms.push_back(sum_sq);
+
+            cudaFree(d_tmp);
+            cudaFree(d_tmp_norms);
+            cudaFree(d_rows);
         }
+        current_count.store(keep);
 
-        cudaMemcpy(d_queries, flat_queries.data(), flat_queries.size() * sizeof(float), cudaMemcpyHostToDevice);
-        cudaMemcpy(d_q_norms, host_q_norms.data(), host_q_norms.size() * sizeof(float), cudaMemcpyHostToDevice);
+        size_t target = std::min<size_t>(max_vectors, compacted.get_count());
+        if (target > keep) {
+            append_rows_locked(compacted.get_data_ptr() + keep * dim, target - keep,
+                               compacted.get_norms_ptr() + keep);
+        }
+        if (ids) row_users.sync(*ids);
+        CUDA_CHECK(cudaDeviceSynchronize());
+    }
 
-        float alpha = -2.0f;
-        float beta = 0.0f;
+    void load_data(const MatrixSlab& source) {
+        NvtxRange range("firedb load");
+        std::lock_guard<std::mutex> submit(submit_mutex);
+        CUDA_CHECK(cudaSetDevice(device));
+        drain_async();
+        std::lock_guard<std::mutex> lock(write_mutex);
+        append_pending = 0;
+        size_t rows = std::min<size_t>(source.get_count(), max_vectors);
+        std::cout << "[GPU] Uploading " << rows << " vectors..." << std::endl;
+        if (rows > 0) upload_rows(source.get_data_ptr(), source.get_norms_ptr(), 0, rows);
+        current_count.store(rows);
+        CUDA_CHECK(cudaDeviceSynchronize());
+    }
 
-        cublasSgemm(handle,
-            CUBLAS_OP_T, CUBLAS_OP_N,
-            current_count, num_queries, dim,
-            &alpha,
-            d_db, dim,
-            d_queries, dim,
-            &beta,
-            d_results, current_count
-        );
+    // Lets search take an AttrFilter over the columns of `source`, which
+    // must outlive the index. Filter columns are mirrored on the device and
+    // the predicate is evaluated there into a row mask that the top-k stage
+    // applies together with the dead rows, so a filtered search returns the
+    // exact top-k of the matching rows however selective the filter is.
+    void attach_attrs(AttrStore& source) {
+        attrs = &source;
+        device_attrs.tracker = source.add_tracker();
+    }
 
+    // Span API: num_queries row-major queries in, k slots per query out (see
+    // pad_results). Allocates nothing once the index is warm. A filter
+    // limits the search to the rows it matches, see attach_attrs().
+    void search(const float* queries, int num_queries, int k, SearchResult* out,
+                const AttrFilter* filter = nullptr) {
+        if (num_queries <= 0) return;
+        check_batch(num_queries);
 
-        int total_pairs = current_count * num_queries;
-        int threads = 256;
-        int blocks = (total_pairs + threads - 1) / threads;
+        std::lock_guard<std::mutex> submit(submit_mutex);
+        CUDA_CHECK(cudaSetDevice(device));
+        drain_async();
+        run_search(queries, num_queries, k, out, snapshot_rows(), filter);
+    }
 
-        compute_l2_dist_kernel<<<blocks, threads>>>(
-            d_db_norms, d_q_norms, d_results, current_count, num_queries
-        );
-        cudaDeviceSynchronize();
+    // search() with slab rows in the results instead of user ids. Rows
+    // without a live user are still skipped. For bulk jobs indexed by row.
+    void search_rows(const float* queries, int num_queries, int k, SearchResult* out) {
+        if (num_queries <= 0) return;
+        check_batch(num_queries);
 
+        std::lock_guard<std::mutex> submit(submit_mutex);
+        CUDA_CHECK(cudaSetDevice(device));
+        drain_async();
+        run_search(queries, num_queries, k, out, snapshot_rows(), nullptr, false);
+    }
 
-        std::vector<float> all_scores(total_pairs);
-        cudaMemcpy(all_scores.data(), d_results, total_pairs * sizeof(float), cudaMemcpyDeviceToHost);
+    size_t get_max_batch() const { return max_batch_size; }
 
-        std::vector<std::vector<SearchResult>> final_results(num_queries);
+    std::vector<std::vector<SearchResult>> search(const std::vector<std::vector<float>>& queries, int k,
+                                                  const AttrFilter* filter = nullptr) {
+        if (queries.empty()) return {};
+        thread_local std::vector<float> flat;
+        thread_local std::vector<SearchResult> out;
+        {
+            ScopedStage pack(STAGE_PACK);
+            flatten_queries(queries, dim, flat);
+        }
+        out.resize(queries.size() * std::max(k, 0));
+        search(flat.data(), queries.size(), k, out.data(), filter);
+        return unpack_results(out.data(), queries.size(), std::max(k, 0));
+    }
 
-        for (int q = 0; q < num_queries; q++) {
-            float* query_scores = all_scores.data() + (q * current_count);
+    // Enqueues a batch and returns at once. The queries are copied before the
+    // call returns; `out` (k slots per query) must stay valid until the future
+    // is ready. While the GPU works on one batch the caller can pack and upload
+    // the next, whose copies overlap the running GEMM and top-k. Batches that
+    // need streamed tiles or FP32 re-ranking run synchronously instead.
+    // Rows added while a batch is in flight are left to later batches.
+    std::future<void> search_async(const float* queries, int num_queries, int k, SearchResult* out) {
+        check_batch(num_queries);
+        PendingBatch batch = {};
+        batch.out = out;
+        auto future = batch.written.get_future();
+        if (submit_batch(queries, num_queries, k, out, batch)) batch.written.set_value();
+        return future;
+    }
 
-            std::vector<std::pair<float, int>> candidates(current_count);
-            for (int i = 0; i < current_count; i++) {
-                candidates[i] = { query_scores[i], i };
-            }
+    // Same, delivering vectors through the future and, when given, to
+    // `on_done` on the completion thread. on_done must not call back into
+    // the index.
+    std::future<std::vector<std::vector<SearchResult>>> search_async(const std::vector<std::vector<float>>& queries,
+                                                                     int k, SearchCallback on_done = nullptr) {
+        check_batch(queries.size());
+        thread_local std::vector<float> flat;
+        thread_local std::vector<SearchResult> out;
+        {
+            ScopedStage pack(STAGE_PACK);
+            flatten_queries(queries, dim, flat);
+        }
 
-            int safe_k = std::min((size_t)k, current_count);
-            std::partial_sort(candidates.begin(), candidates.begin() + safe_k, candidates.end());
+        PendingBatch batch = {};
+        batch.callback = std::move(on_done);
+        auto future = batch.promise.get_future();
 
-            for (int i = 0; i < safe_k; i++) {
-                final_results[q].push_back({ (uint64_t)candidates[i].second, candidates[i].first });
-            }
+        // only the synchronous fallback writes through `out`
+        out.resize(queries.size() * std::max(k, 0));
+        if (submit_batch(flat.data(), queries.size(), k, out.data(), batch)) {
+            auto results = unpack_results(out.data(), queries.size(), std::max(k, 0));
+            finish_batch(batch.promise, batch.callback, results);
         }
-
-        return final_results;
+        return future;
     }
 
     std::vector<SearchResult> search_one(const std::vector<float>& query, int k) {
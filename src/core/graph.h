@@ -0,0 +1,186 @@
+#pragma once
+#ifndef FIREDB_GRAPH_H
+#define FIREDB_GRAPH_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "slab.h"
+#include "search_result.h"
+
+// Layout of a KNN graph file: the header, then row_ptr (rows + 1 uint64),
+// then the neighbor rows and their scores. Row r's neighbors are
+// cols[row_ptr[r] .. row_ptr[r + 1]), best first; nnz <= rows * k and both
+// sections are sized for rows * k. Rows without a live user have none.
+// Neighbors are slab rows of slab_generation, scores are in the slab's metric.
+struct GraphHeader {
+    uint32_t magic = 0x4B4E4E47;
+    uint32_t version = 1;
+    uint64_t rows = 0;
+    uint64_t k = 0;
+    uint64_t nnz = 0;
+    uint64_t slab_generation = 0;
+    uint64_t row_ptr_offset = 0;
+    uint64_t cols_offset = 0;
+    uint64_t scores_offset = 0;
+    uint32_t metric = METRIC_L2;
+    char _pad[60];
+};
+
+// Read-only mmap of a graph written by build_knn_graph().
+class KnnGraph {
+    private:
+        int fd = -1;
+        size_t file_size = 0;
+        char* base = nullptr;
+        const GraphHeader* header = nullptr;
+        const uint64_t* row_ptr = nullptr;
+        const uint64_t* cols = nullptr;
+        const float* scores = nullptr;
+
+    public:
+        explicit KnnGraph(const std::string& path_file) {
+            fd = open(path_file.c_str(), O_RDONLY);
+            if (fd == -1) {
+                throw std::runtime_error("could not open knn graph");
+            }
+            struct stat st;
+            fstat(fd, &st);
+            file_size = st.st_size;
+            if (file_size < sizeof(GraphHeader)) {
+                close(fd);
+                throw std::runtime_error("knn graph is truncated");
+            }
+            void* ptr = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("mmap failed");
+            }
+            base = static_cast<char*>(ptr);
+            header = reinterpret_cast<const GraphHeader*>(base);
+            size_t end = header->scores_offset + header->rows * header->k * sizeof(float);
+            if (header->magic != GraphHeader().magic || end > file_size) {
+                munmap(base, file_size);
+                close(fd);
+                throw std::runtime_error("not a knn graph");
+            }
+            row_ptr = reinterpret_cast<const uint64_t*>(base + header->row_ptr_offset);
+            cols = reinterpret_cast<const uint64_t*>(base + header->cols_offset);
+            scores = reinterpret_cast<const float*>(base + header->scores_offset);
+        }
+        KnnGraph(const KnnGraph&) = delete;
+        KnnGraph& operator=(const KnnGraph&) = delete;
+
+        ~KnnGraph() {
+            if (base) munmap(base, file_size);
+            if (fd != -1) close(fd);
+        }
+
+        size_t get_rows() const { return header->rows; }
+        size_t get_k() const { return header->k; }
+        size_t get_nnz() const { return header->nnz; }
+        uint64_t get_generation() const { return header->slab_generation; }
+        size_t degree(size_t row) const { return row_ptr[row + 1] - row_ptr[row]; }
+        const uint64_t* neighbors(size_t row) const { return cols + row_ptr[row]; }
+        const float* neighbor_scores(size_t row) const { return scores + row_ptr[row]; }
+        const uint64_t* get_row_ptr() const { return row_ptr; }
+};
+
+// Builds the k nearest neighbors of every slab row, excluding the row itself,
+// and writes them to `path_file` as a GraphHeader file (via a .tmp and a
+// rename). With `ids`, rows without a live user get no neighbors. Rows are
+// fed to `search_rows(queries, n, k, out)` straight from the slab in batches
+// of `batch`; it must return slab rows (the search_rows() of the exact
+// indexes), so every batch is one tiled GEMM over the whole slab plus device
+// top-k. Runs on the writer thread. Returns nnz.
+template <typename SearchRows>
+inline size_t build_knn_graph(const MatrixSlab& slab, const IdSlab* ids, int k, size_t batch,
+                              const std::string& path_file, SearchRows&& search_rows) {
+    size_t rows = slab.get_count();
+    size_t dim = slab.get_dim();
+    if (k <= 0 || batch == 0) {
+        throw std::runtime_error("knn graph needs k > 0");
+    }
+
+    GraphHeader h;
+    h.rows = rows;
+    h.k = k;
+    h.slab_generation = slab.get_generation();
+    h.metric = slab.get_metric();
+    h.row_ptr_offset = sizeof(GraphHeader);
+    h.cols_offset = h.row_ptr_offset + (rows + 1) * sizeof(uint64_t);
+    h.scores_offset = h.cols_offset + rows * k * sizeof(uint64_t);
+    size_t bytes = h.scores_offset + rows * k * sizeof(float);
+
+    std::string tmp_path = path_file + ".tmp";
+    int out = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out == -1) {
+        throw std::runtime_error("could not create knn graph");
+    }
+    if (ftruncate(out, bytes) == -1) {
+        close(out);
+        throw std::runtime_error("ftruncate failed");
+    }
+
+    // one extra candidate per row, the row usually finds itself first
+    int fetch = k + 1;
+    std::vector<uint64_t> row_ptr(rows + 1, 0);
+    std::vector<SearchResult> found(batch * fetch);
+    std::vector<uint64_t> cols;
+    std::vector<float> scores;
+    cols.reserve(batch * k);
+    scores.reserve(batch * k);
+
+    size_t nnz = 0;
+    size_t report = std::max<size_t>(batch, rows / 10);
+    for (size_t begin = 0; begin < rows; begin += batch) {
+        size_t n = std::min(batch, rows - begin);
+        search_rows(slab.get_data_ptr() + begin * dim, n, fetch, found.data());
+
+        cols.clear();
+        scores.clear();
+        for (size_t q = 0; q < n; q++) {
+            size_t row = begin + q;
+            size_t kept = 0;
+            bool live = !ids || ids->get_user_from_row(row) != NO_USER;
+            for (int i = 0; live && i < fetch && kept < (size_t)k; i++) {
+                const SearchResult& r = found[q * fetch + i];
+                if (r.id == EMPTY_ID) break;
+                if (r.id == row) continue;
+                cols.push_back(r.id);
+                scores.push_back(r.score);
+                kept++;
+            }
+            row_ptr[row + 1] = row_ptr[row] + kept;
+        }
+
+        MatrixSlab::pwrite_all(out, reinterpret_cast<const char*>(cols.data()), cols.size() * sizeof(uint64_t),
+                               h.cols_offset + nnz * sizeof(uint64_t));
+        MatrixSlab::pwrite_all(out, reinterpret_cast<const char*>(scores.data()), scores.size() * sizeof(float),
+                               h.scores_offset + nnz * sizeof(float));
+        nnz += cols.size();
+
+        if ((begin + n) / report != begin / report || begin + n == rows) {
+            std::cout << "[KNN] " << begin + n << " / " << rows << " rows" << std::endl;
+        }
+    }
+
+    h.nnz = nnz;
+    MatrixSlab::pwrite_all(out, reinterpret_cast<const char*>(row_ptr.data()), row_ptr.size() * sizeof(uint64_t),
+                           h.row_ptr_offset);
+    MatrixSlab::pwrite_all(out, reinterpret_cast<const char*>(&h), sizeof(h), 0);
+    fsync(out);
+    close(out);
+    if (rename(tmp_path.c_str(), path_file.c_str()) == -1) {
+        throw std::runtime_error("could not install knn graph");
+    }
+    return nnz;
+}
+
+#endif
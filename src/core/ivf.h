@@ -0,0 +1,605 @@
+#pragma once
+#ifndef FIREDB_IVF_H
+#define FIREDB_IVF_H
+
+#include <cuda_runtime.h>
+#include <cublas_v2.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <cfloat>
+#include <cstdio>
+#include <stdexcept>
+#include "slab.h"
+#include "gpu.h"
+
+// Inverted file index. Rows are assigned to the nearest of nlist coarse
+// centroids and stored contiguously per list on the GPU; a query scans only
+// the nprobe lists whose centroids are nearest. Centroids are kept in
+// <db>.ivf, the lists are rebuilt from the slab on load.
+
+constexpr uint32_t IVF_MAGIC = 0x1F0C3A7D;
+constexpr int IVF_TRAIN_ITERS = 20;
+constexpr size_t IVF_TRAIN_PER_LIST = 64;
+constexpr size_t IVF_TRAIN_MAX = 262144;
+
+struct IvfHeader {
+    uint32_t magic = IVF_MAGIC;
+    uint32_t version = 1;
+    uint64_t nlist = 0;
+    uint64_t dim = 0;
+    uint8_t _pad[40];
+};
+
+
+// One thread per element. sums and counts must be zeroed.
+__global__ void kmeans_accumulate_kernel(const float* x, const uint64_t* assign, size_t n, int dim,
+                                         float* sums, uint32_t* counts) {
+    size_t idx = blockIdx.x * (size_t)blockDim.x + threadIdx.x;
+    if (idx >= n * dim) return;
+
+    size_t r = idx / dim;
+    int d = idx % dim;
+    uint64_t c = assign[r];
+    atomicAdd(&sums[c * dim + d], x[idx]);
+    if (d == 0) atomicAdd(&counts[c], 1u);
+}
+
+// Empty clusters keep their previous centroid.
+__global__ void kmeans_update_kernel(float* centroids, const float* sums, const uint32_t* counts,
+                                     int nlist, int dim) {
+    int idx = blockIdx.x * blockDim.x + threadIdx.x;
+    if (idx >= nlist * dim) return;
+
+    int c = idx / dim;
+    if (counts[c] > 0) centroids[idx] = sums[idx] / counts[c];
+}
+
+// Copies staged row r to list slot slots[r].
+__global__ void ivf_scatter_kernel(const float* vecs, const float* norms, size_t n, int dim,
+                                   const uint64_t* slots, uint64_t first_row,
+                                   float* list_vecs, float* list_norms, uint64_t* list_rows) {
+    size_t idx = blockIdx.x * (size_t)blockDim.x + threadIdx.x;
+    if (idx >= n * dim) return;
+
+    size_t r = idx / dim;
+    int d = idx % dim;
+    uint64_t s = slots[r];
+    list_vecs[s * dim + d] = vecs[idx];
+    if (d == 0) {
+        list_norms[s] = norms[r];
+        list_rows[s] = first_row + r;
+    }
+}
+
+__global__ void fill_kernel(float* data, size_t n, float value) {
+    size_t idx = blockIdx.x * (size_t)blockDim.x + threadIdx.x;
+    if (idx < n) data[idx] = value;
+}
+
+// Grid (nprobe, num_queries), one warp per list entry. plan[q][p] holds the
+// probed list's first slot, its size and where its distances go in query q's
+// column of `out`. Dead rows get FLT_MAX.
+__global__ void ivf_scan_kernel(const float* list_vecs, const float* list_norms, const uint64_t* list_rows,
+                                const float* queries, const float* q_norms, int dim,
+                                const uint64_t* plan, int nprobe, int ld,
+                                const uint32_t* row_mask, uint64_t mask_rows,
+                                float* out, uint64_t* out_rows) {
+    int p = blockIdx.x;
+    int q = blockIdx.y;
+    int warp = threadIdx.x / 32;
+    int lane = threadIdx.x & 31;
+    int warps = blockDim.x / 32;
+
+    const uint64_t* entry = plan + ((size_t)q * nprobe + p) * 3;
+    uint64_t begin = entry[0];
+    uint64_t size = entry[1];
+    uint64_t offset = entry[2];
+    const float* query = queries + (size_t)q * dim;
+
+    for (uint64_t i = warp; i < size; i += warps) {
+        const float* v = list_vecs + (begin + i) * dim;
+        float dot = 0.0f;
+        for (int d = lane; d < dim; d += 32) dot += v[d] * query[d];
+        for (int o = 16; o > 0; o >>= 1) dot += __shfl_down_sync(0xffffffff, dot, o);
+
+        if (lane == 0) {
+            uint64_t row = list_rows[begin + i];
+            bool dead = row_mask && (row >= mask_rows || (row_mask[row >> 5] >> (row & 31)) & 1u);
+            size_t at = (size_t)q * ld + offset + i;
+            out[at] = dead ? FLT_MAX : list_norms[begin + i] + q_norms[q] - 2.0f * dot;
+            out_rows[at] = row;
+        }
+    }
+}
+
+class IvfIndex {
+private:
+    cublasHandle_t handle;
+    std::string fpath;
+    size_t dim;
+    size_t nlist;
+    size_t max_batch_size = 100;
+    int nprobe = 8;
+    bool is_trained = false;
+
+    float* d_centroids = nullptr;
+    float* d_centroid_norms = nullptr;
+
+    // Lists are slices of one allocation. list_cap leaves room for appends,
+    // a full list makes the whole layout grow.
+    float* d_list_vecs = nullptr;
+    float* d_list_norms = nullptr;
+    uint64_t* d_list_rows = nullptr;
+    size_t total_cap = 0;
+    std::vector<uint64_t> list_begin;
+    std::vector<uint64_t> list_size;
+    std::vector<uint64_t> list_cap;
+
+    // assignment scratch, assign_rows x nlist distances at a time
+    size_t assign_rows = 0;
+    float* d_assign_scores = nullptr;
+    float* d_assign_best = nullptr;
+    uint64_t* d_assign_ids = nullptr;
+
+    // append staging
+    size_t stage_rows = 65536;
+    float* d_stage = nullptr;
+    float* d_stage_norms = nullptr;
+    uint64_t* d_slots = nullptr;
+
+    // search scratch
+    float* d_queries = nullptr;
+    float* d_q_norms = nullptr;
+    float* d_coarse = nullptr;
+    float* d_probe_scores = nullptr;
+    uint64_t* d_probe_ids = nullptr;
+    uint64_t* d_plan = nullptr;
+    float* d_scan = nullptr;
+    uint64_t* d_scan_rows = nullptr;
+    size_t scan_capacity = 0;
+    float* d_topk_scores = nullptr;
+    uint64_t* d_topk_ids = nullptr;
+
+    IdSlab* ids = nullptr;
+    DeviceRowUsers row_users;
+
+    // Nearest centroid of each of n device vectors, written to d_out.
+    void assign(const float* d_vecs, const float* d_norms, size_t n, uint64_t* d_out) {
+        float alpha = -2.0f;
+        float beta = 0.0f;
+        int threads = 256;
+        for (size_t done = 0; done < n; done += assign_rows) {
+            size_t c = std::min(assign_rows, n - done);
+            CUBLAS_CHECK(cublasSgemm(handle,
+                CUBLAS_OP_T, CUBLAS_OP_N,
+                nlist, c, dim,
+                &alpha,
+                d_centroids, dim,
+                d_vecs + done * dim, dim,
+                &beta,
+                d_assign_scores, nlist
+            ));
+            int blocks = (nlist * c + threads - 1) / threads;
+            compute_l2_dist_kernel<<<blocks, threads>>>(d_centroid_norms, d_norms + done, d_assign_scores, nlist, c);
+            CUDA_CHECK_LAUNCH();
+            select_topk_kernel<<<c, TOPK_THREADS>>>(
+                d_assign_scores, nlist, nlist, 1, 0, nullptr, 0, nullptr, d_assign_best, d_out + done
+            );
+            CUDA_CHECK_LAUNCH();
+        }
+    }
+
+    // Moves every list into a fresh allocation with the given capacities.
+    void relayout(const std::vector<uint64_t>& new_cap) {
+        size_t new_total = 0;
+        std::vector<uint64_t> new_begin(nlist);
+        for (size_t l = 0; l < nlist; l++) {
+            new_begin[l] = new_total;
+            new_total += new_cap[l];
+        }
+
+        float* vecs = nullptr;
+        float* norms = nullptr;
+        uint64_t* rows = nullptr;
+        if (cudaMalloc(&vecs, new_total * dim * sizeof(float)) != cudaSuccess ||
+            cudaMalloc(&norms, new_total * sizeof(float)) != cudaSuccess ||
+            cudaMalloc(&rows, new_total * sizeof(uint64_t)) != cudaSuccess) {
+            cudaGetLastError();
+            cudaFree(vecs);
+            cudaFree(norms);
+            cudaFree(rows);
+            throw std::runtime_error("GPU Full!");
+        }
+
+        try {
+            for (size_t l = 0; l < nlist; l++) {
+                if (list_size[l] == 0) continue;
+                CUDA_CHECK(cudaMemcpy(vecs + new_begin[l] * dim, d_list_vecs + list_begin[l] * dim,
+                                      list_size[l] * dim * sizeof(float), cudaMemcpyDeviceToDevice));
+                CUDA_CHECK(cudaMemcpy(norms + new_begin[l], d_list_norms + list_begin[l],
+                                      list_size[l] * sizeof(float), cudaMemcpyDeviceToDevice));
+                CUDA_CHECK(cudaMemcpy(rows + new_begin[l], d_list_rows + list_begin[l],
+                                      list_size[l] * sizeof(uint64_t), cudaMemcpyDeviceToDevice));
+            }
+        } catch (...) {
+            // the old layout is still intact
+            cudaFree(vecs);
+            cudaFree(norms);
+            cudaFree(rows);
+            throw;
+        }
+
+        cudaFree(d_list_vecs);
+        cudaFree(d_list_norms);
+        cudaFree(d_list_rows);
+        d_list_vecs = vecs;
+        d_list_norms = norms;
+        d_list_rows = rows;
+        list_begin = new_begin;
+        list_cap = new_cap;
+        total_cap = new_total;
+    }
+
+    void save_centroids() {
+        std::vector<float> host(nlist * dim);
+        CUDA_CHECK(cudaMemcpy(host.data(), d_centroids, host.size() * sizeof(float), cudaMemcpyDeviceToHost));
+
+        IvfHeader h;
+        h.nlist = nlist;
+        h.dim = dim;
+        std::string tmp_path = fpath + ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+            out.write(reinterpret_cast<const char*>(host.data()), host.size() * sizeof(float));
+            if (!out) throw std::runtime_error("could not write ivf centroids");
+        }
+        if (std::rename(tmp_path.c_str(), fpath.c_str()) != 0) {
+            throw std::runtime_error("could not install ivf centroids");
+        }
+    }
+
+    bool load_centroids() {
+        std::ifstream in(fpath, std::ios::binary);
+        if (!in.is_open()) return false;
+
+        IvfHeader h;
+        in.read(reinterpret_cast<char*>(&h), sizeof(h));
+        if (!in || h.magic != IVF_MAGIC || h.dim != dim) {
+            throw std::runtime_error("invalid ivf file");
+        }
+        if (nlist != 0 && h.nlist != nlist) {
+            std::cout << "[IVF] Using the " << h.nlist << " lists stored in " << fpath << std::endl;
+            nlist = h.nlist;
+        }
+
+        std::vector<float> host(nlist * dim);
+        in.read(reinterpret_cast<char*>(host.data()), host.size() * sizeof(float));
+        if (!in) throw std::runtime_error("ivf file is truncated");
+
+        allocate_lists_state();
+        CUDA_CHECK(cudaMemcpy(d_centroids, host.data(), host.size() * sizeof(float), cudaMemcpyHostToDevice));
+        launch_norms(d_centroids, d_centroid_norms, nlist, dim);
+        return true;
+    }
+
+    // d_coarse comes last, so a state that failed halfway is allocated again.
+    void allocate_lists_state() {
+        for (float** p : { &d_centroids, &d_centroid_norms, &d_assign_scores, &d_assign_best, &d_coarse }) {
+            cudaFree(*p);
+            *p = nullptr;
+        }
+        CUDA_CHECK(cudaMalloc(&d_centroids, nlist * dim * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_centroid_norms, nlist * sizeof(float)));
+        list_begin.assign(nlist, 0);
+        list_size.assign(nlist, 0);
+        list_cap.assign(nlist, 0);
+
+        // ~256 MB of assignment distances
+        assign_rows = std::max<size_t>(1, std::min<size_t>(65536, (64ull << 20) / nlist));
+        CUDA_CHECK(cudaMalloc(&d_assign_scores, assign_rows * nlist * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_assign_best, assign_rows * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_coarse, nlist * max_batch_size * sizeof(float)));
+    }
+
+public:
+    // `lists` is only used when <path> holds no centroids yet, 0 takes the
+    // stored count without a notice.
+    IvfIndex(const std::string& path, size_t dimension, size_t lists) : fpath(path), dim(dimension), nlist(lists) {
+        CUBLAS_CHECK(cublasCreate(&handle));
+
+        CUDA_CHECK(cudaMalloc(&d_stage, stage_rows * dim * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_stage_norms, stage_rows * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_slots, stage_rows * sizeof(uint64_t)));
+        CUDA_CHECK(cudaMalloc(&d_assign_ids, std::max<size_t>(stage_rows, IVF_TRAIN_MAX) * sizeof(uint64_t)));
+
+        CUDA_CHECK(cudaMalloc(&d_queries, max_batch_size * dim * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_q_norms, max_batch_size * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_probe_scores, max_batch_size * GPU_MAX_K * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_probe_ids, max_batch_size * GPU_MAX_K * sizeof(uint64_t)));
+        CUDA_CHECK(cudaMalloc(&d_plan, max_batch_size * GPU_MAX_K * 3 * sizeof(uint64_t)));
+        CUDA_CHECK(cudaMalloc(&d_topk_scores, max_batch_size * GPU_MAX_K * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_topk_ids, max_batch_size * GPU_MAX_K * sizeof(uint64_t)));
+
+        is_trained = load_centroids();
+    }
+
+    ~IvfIndex() {
+        cudaFree(d_centroids);
+        cudaFree(d_centroid_norms);
+        cudaFree(d_list_vecs);
+        cudaFree(d_list_norms);
+        cudaFree(d_list_rows);
+        cudaFree(d_assign_scores);
+        cudaFree(d_assign_best);
+        cudaFree(d_assign_ids);
+        cudaFree(d_stage);
+        cudaFree(d_stage_norms);
+        cudaFree(d_slots);
+        cudaFree(d_queries);
+        cudaFree(d_q_norms);
+        cudaFree(d_coarse);
+        cudaFree(d_probe_scores);
+        cudaFree(d_probe_ids);
+        cudaFree(d_plan);
+        cudaFree(d_scan);
+        cudaFree(d_scan_rows);
+        cudaFree(d_topk_scores);
+        cudaFree(d_topk_ids);
+        row_users.release();
+        cublasDestroy(handle);
+    }
+
+    bool trained() const { return is_trained; }
+    size_t get_nlist() const { return nlist; }
+    int get_nprobe() const { return nprobe; }
+
+    // Lists scanned per query, capped by GPU_MAX_K and nlist.
+    void set_nprobe(int probes) {
+        nprobe = std::max(1, std::min<int>({ probes, GPU_MAX_K, (int)nlist }));
+    }
+
+    // GPU k-means over a strided sample of `slab`. Assignment is the same
+    // norms + GEMM + L2 + top-1 pipeline search uses, the update step
+    // accumulates with atomics. Saves the centroids to <path>.
+    void train(const MatrixSlab& slab) {
+        size_t count = slab.get_count();
+        if (count < nlist) {
+            throw std::runtime_error("IVF needs at least nlist vectors to train");
+        }
+        if (!d_coarse) allocate_lists_state();
+
+        size_t n = std::min({ count, nlist * IVF_TRAIN_PER_LIST, IVF_TRAIN_MAX });
+        std::vector<float> sample(n * dim);
+        for (size_t i = 0; i < n; i++) {
+            size_t row = i * count / n;
+            std::memcpy(&sample[i * dim], slab.get_data_ptr() + row * dim, dim * sizeof(float));
+        }
+
+        float* d_train = nullptr;
+        float* d_train_norms = nullptr;
+        float* d_sums = nullptr;
+        uint32_t* d_counts = nullptr;
+        auto release = [&]() {
+            cudaFree(d_train);
+            cudaFree(d_train_norms);
+            cudaFree(d_sums);
+            cudaFree(d_counts);
+        };
+        try {
+            CUDA_CHECK(cudaMalloc(&d_train, n * dim * sizeof(float)));
+            CUDA_CHECK(cudaMalloc(&d_train_norms, n * sizeof(float)));
+            CUDA_CHECK(cudaMalloc(&d_sums, nlist * dim * sizeof(float)));
+            CUDA_CHECK(cudaMalloc(&d_counts, nlist * sizeof(uint32_t)));
+            CUDA_CHECK(cudaMemcpy(d_train, sample.data(), sample.size() * sizeof(float), cudaMemcpyHostToDevice));
+            launch_norms(d_train, d_train_norms, n, dim);
+
+            // initial centroids spread over the sample
+            for (size_t c = 0; c < nlist; c++) {
+                CUDA_CHECK(cudaMemcpy(d_centroids + c * dim, d_train + (c * n / nlist) * dim, dim * sizeof(float),
+                                      cudaMemcpyDeviceToDevice));
+            }
+
+            int threads = 256;
+            for (int it = 0; it < IVF_TRAIN_ITERS; it++) {
+                launch_norms(d_centroids, d_centroid_norms, nlist, dim);
+                assign(d_train, d_train_norms, n, d_assign_ids);
+
+                CUDA_CHECK(cudaMemset(d_sums, 0, nlist * dim * sizeof(float)));
+                CUDA_CHECK(cudaMemset(d_counts, 0, nlist * sizeof(uint32_t)));
+                size_t blocks = (n * dim + threads - 1) / threads;
+                kmeans_accumulate_kernel<<<blocks, threads>>>(d_train, d_assign_ids, n, dim, d_sums, d_counts);
+                CUDA_CHECK_LAUNCH();
+                blocks = (nlist * dim + threads - 1) / threads;
+                kmeans_update_kernel<<<blocks, threads>>>(d_centroids, d_sums, d_counts, nlist, dim);
+                CUDA_CHECK_LAUNCH();
+            }
+            launch_norms(d_centroids, d_centroid_norms, nlist, dim);
+            CUDA_CHECK(cudaDeviceSynchronize());
+        } catch (...) {
+            release();
+            throw;
+        }
+        release();
+
+        save_centroids();
+        is_trained = true;
+    }
+
+    void attach_ids(IdSlab& source) {
+        ids = &source;
+        row_users.sync(*ids);
+    }
+
+    // Assigns n host vectors (slab rows first_row..) to their lists on the
+    // GPU. Only the list ids and the target slots cross PCIe.
+    void add_vectors(const float* host_vecs, size_t n, uint64_t first_row) {
+        if (!is_trained) return;
+        std::vector<uint64_t> lists(stage_rows);
+        std::vector<uint64_t> slots(stage_rows);
+        int threads = 256;
+
+        for (size_t done = 0; done < n; done += stage_rows) {
+            size_t c = std::min(stage_rows, n - done);
+            CUDA_CHECK(cudaMemcpy(d_stage, host_vecs + done * dim, c * dim * sizeof(float), cudaMemcpyHostToDevice));
+            launch_norms(d_stage, d_stage_norms, c, dim);
+            assign(d_stage, d_stage_norms, c, d_assign_ids);
+            CUDA_CHECK(cudaMemcpy(lists.data(), d_assign_ids, c * sizeof(uint64_t), cudaMemcpyDeviceToHost));
+
+            std::vector<uint64_t> incoming(nlist, 0);
+            for (size_t i = 0; i < c; i++) incoming[lists[i]]++;
+
+            bool grow = false;
+            std::vector<uint64_t> new_cap = list_cap;
+            for (size_t l = 0; l < nlist; l++) {
+                if (list_size[l] + incoming[l] <= list_cap[l]) continue;
+                new_cap[l] = std::max<uint64_t>({ 16, list_cap[l] * 2, list_size[l] + incoming[l] });
+                grow = true;
+            }
+            if (grow) relayout(new_cap);
+
+            for (size_t i = 0; i < c; i++) slots[i] = list_begin[lists[i]] + list_size[lists[i]]++;
+            CUDA_CHECK(cudaMemcpy(d_slots, slots.data(), c * sizeof(uint64_t), cudaMemcpyHostToDevice));
+
+            size_t blocks = (c * dim + threads - 1) / threads;
+            ivf_scatter_kernel<<<blocks, threads>>>(d_stage, d_stage_norms, c, dim, d_slots, first_row + done,
+                                                    d_list_vecs, d_list_norms, d_list_rows);
+            CUDA_CHECK_LAUNCH();
+        }
+    }
+
+    // Rebuilds every list from the slab, also after a compaction.
+    void load_data(const MatrixSlab& source) {
+        std::fill(list_size.begin(), list_size.end(), 0);
+        std::cout << "[IVF] Assigning " << source.get_count() << " vectors to " << nlist << " lists..." << std::endl;
+        add_vectors(source.get_data_ptr(), source.get_count(), 0);
+        if (ids) row_users.sync(*ids);
+        CUDA_CHECK(cudaDeviceSynchronize());
+    }
+
+    std::vector<std::vector<SearchResult>> search(const std::vector<std::vector<float>>& queries, int k) {
+        int num_queries = queries.size();
+        if (num_queries == 0) return {};
+        if (num_queries > (int)max_batch_size) {
+            throw std::runtime_error("query batch exceeds max_batch_size");
+        }
+        if (k > GPU_MAX_K) {
+            throw std::runtime_error("k exceeds GPU_MAX_K");
+        }
+
+        std::vector<std::vector<SearchResult>> final_results(num_queries);
+        if (k <= 0 || !is_trained) return final_results;
+
+        std::vector<float> flat_queries;
+        std::vector<float> host_q_norms;
+        for (const auto& q : queries) {
+            float sum_sq = 0.0f;
+            for (float val : q) {
+                flat_queries.push_back(val);
+                sum_sq += val * val;
+            }
+            host_q_norms.push_back(sum_sq);
+        }
+        CUDA_CHECK(cudaMemcpy(d_queries, flat_queries.data(), flat_queries.size() * sizeof(float), cudaMemcpyHostToDevice));
+        CUDA_CHECK(cudaMemcpy(d_q_norms, host_q_norms.data(), host_q_norms.size() * sizeof(float), cudaMemcpyHostToDevice));
+        if (ids) row_users.sync(*ids);
+
+        // coarse step: nearest nprobe centroids per query
+        float alpha = -2.0f;
+        float beta = 0.0f;
+        int threads = 256;
+        CUBLAS_CHECK(cublasSgemm(handle,
+            CUBLAS_OP_T, CUBLAS_OP_N,
+            nlist, num_queries, dim,
+            &alpha,
+            d_centroids, dim,
+            d_queries, dim,
+            &beta,
+            d_coarse, nlist
+        ));
+        int blocks = (nlist * num_queries + threads - 1) / threads;
+        compute_l2_dist_kernel<<<blocks, threads>>>(d_centroid_norms, d_q_norms, d_coarse, nlist, num_queries);
+        CUDA_CHECK_LAUNCH();
+        select_topk_kernel<<<num_queries, TOPK_THREADS>>>(
+            d_coarse, nlist, nlist, nprobe, 0, nullptr, 0, nullptr, d_probe_scores, d_probe_ids
+        );
+        CUDA_CHECK_LAUNCH();
+
+        // Scan plan: where each probed list sits and where its distances go.
+        // Every query's column is as long as the longest probe set.
+        std::vector<uint64_t> probes(num_queries * nprobe);
+        CUDA_CHECK(cudaMemcpy(probes.data(), d_probe_ids, probes.size() * sizeof(uint64_t), cudaMemcpyDeviceToHost));
+        std::vector<uint64_t> plan(probes.size() * 3);
+        size_t ld = 0;
+        for (int q = 0; q < num_queries; q++) {
+            uint64_t offset = 0;
+            for (int p = 0; p < nprobe; p++) {
+                uint64_t l = probes[q * nprobe + p];
+                uint64_t* entry = &plan[(q * nprobe + p) * 3];
+                entry[0] = l == EMPTY_ID ? 0 : list_begin[l];
+                entry[1] = l == EMPTY_ID ? 0 : list_size[l];
+                entry[2] = offset;
+                offset += entry[1];
+            }
+            ld = std::max<size_t>(ld, offset);
+        }
+        if (ld == 0) return final_results;
+
+        if (ld * num_queries > scan_capacity) {
+            // a failed regrow leaves no buffer behind, the next search retries
+            cudaFree(d_scan);
+            cudaFree(d_scan_rows);
+            d_scan = nullptr;
+            d_scan_rows = nullptr;
+            scan_capacity = 0;
+            CUDA_CHECK(cudaMalloc(&d_scan, ld * num_queries * 2 * sizeof(float)));
+            CUDA_CHECK(cudaMalloc(&d_scan_rows, ld * num_queries * 2 * sizeof(uint64_t)));
+            scan_capacity = ld * num_queries * 2;
+        }
+        CUDA_CHECK(cudaMemcpy(d_plan, plan.data(), plan.size() * sizeof(uint64_t), cudaMemcpyHostToDevice));
+
+        size_t total = ld * num_queries;
+        fill_kernel<<<(total + threads - 1) / threads, threads>>>(d_scan, total, FLT_MAX);
+        CUDA_CHECK_LAUNCH();
+        const uint32_t* mask = ids ? row_users.d_dead_mask : nullptr;
+        ivf_scan_kernel<<<dim3(nprobe, num_queries), threads>>>(
+            d_list_vecs, d_list_norms, d_list_rows, d_queries, d_q_norms, dim,
+            d_plan, nprobe, ld, mask, row_users.rows, d_scan, d_scan_rows
+        );
+        CUDA_CHECK_LAUNCH();
+
+        int safe_k = std::min<size_t>(k, ld);
+        select_topk_kernel<<<num_queries, TOPK_THREADS>>>(
+            d_scan, ld, ld, safe_k, 0, nullptr, 0, nullptr, d_topk_scores, d_topk_ids
+        );
+        CUDA_CHECK_LAUNCH();
+        const uint64_t* id_map = ids ? row_users.d_row_user : nullptr;
+        blocks = (num_queries * safe_k + threads - 1) / threads;
+        map_candidate_ids_kernel<<<blocks, threads>>>(
+            d_topk_scores, d_topk_ids, d_scan_rows, ld, safe_k, num_queries, id_map, row_users.rows
+        );
+        CUDA_CHECK_LAUNCH();
+
+        std::vector<float> top_scores(num_queries * safe_k);
+        std::vector<uint64_t> top_ids(num_queries * safe_k);
+        CUDA_CHECK(cudaMemcpy(top_scores.data(), d_topk_scores, top_scores.size() * sizeof(float), cudaMemcpyDeviceToHost));
+        CUDA_CHECK(cudaMemcpy(top_ids.data(), d_topk_ids, top_ids.size() * sizeof(uint64_t), cudaMemcpyDeviceToHost));
+
+        for (int q = 0; q < num_queries; q++) {
+            for (int i = 0; i < safe_k; i++) {
+                if (top_ids[q * safe_k + i] == EMPTY_ID) continue;
+                final_results[q].push_back({ top_ids[q * safe_k + i], top_scores[q * safe_k + i] });
+            }
+        }
+        return final_results;
+    }
+
+    std::vector<SearchResult> search_one(const std::vector<float>& query, int k) {
+        return search({query}, k)[0];
+    }
+};
+
+#endif
@@ -0,0 +1,143 @@
+#pragma once
+#ifndef FIREDB_METRICS_H
+#define FIREDB_METRICS_H
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+
+// Process-wide counters of the search and storage hot paths, read by the
+// `stats` command and REQ_STATS in the Prometheus text format. Counters are
+// relaxed atomics and always on. Stage timings cost a few cudaEventRecord
+// calls per search chunk, so they are only taken while `timers` is set.
+
+// Stages of a GPU search. GPU stages are timed with cudaEvents on the
+// stream that runs them, host stages with steady_clock.
+enum Stage : int {
+    STAGE_PACK = 0,      // host: flattening and staging queries (norms, cosine)
+    STAGE_H2D,           // query upload
+    STAGE_MASK,          // dead-row and filter masks
+    STAGE_GEMM,          // cuBLAS distance GEMM
+    STAGE_DISTANCE,      // L2 epilogue kernel
+    STAGE_FUSED,         // fused distance + top-k kernel of small batches
+    STAGE_TOPK,          // top-k selection and merging
+    STAGE_STREAM,        // tile uploads of rows that are not resident
+    STAGE_D2H,           // top-k readback
+    STAGE_RERANK,        // host: exact re-ranking against the slab
+    STAGE_COUNT
+};
+
+inline const char* stage_name(Stage s) {
+    static const char* names[STAGE_COUNT] = {
+        "pack", "h2d", "mask", "gemm", "distance", "fused", "topk", "stream", "d2h", "rerank"
+    };
+    return names[s];
+}
+
+struct StageTotals {
+    std::atomic<uint64_t> ns{ 0 };
+    std::atomic<uint64_t> calls{ 0 };
+};
+
+struct Metrics {
+    std::atomic<bool> timers{ false };
+
+    std::atomic<uint64_t> searches{ 0 };      // search calls of the GPU indexes
+    std::atomic<uint64_t> queries{ 0 };
+    std::atomic<uint64_t> search_ns{ 0 };     // wall time of those calls
+    std::atomic<uint64_t> h2d_bytes{ 0 };
+    std::atomic<uint64_t> d2h_bytes{ 0 };
+    std::atomic<uint64_t> rows_uploaded{ 0 };
+    std::atomic<uint64_t> wal_writes{ 0 };    // write() of buffered records
+    std::atomic<uint64_t> wal_bytes{ 0 };
+    std::atomic<uint64_t> wal_syncs{ 0 };     // fdatasync() of the log
+    std::atomic<uint64_t> wal_sync_ns{ 0 };
+    std::atomic<uint64_t> cuda_errors{ 0 };
+    StageTotals stages[STAGE_COUNT];
+
+    void add(std::atomic<uint64_t>& counter, uint64_t value) { counter.fetch_add(value, std::memory_order_relaxed); }
+
+    void add_stage(Stage s, uint64_t ns) {
+        add(stages[s].ns, ns);
+        add(stages[s].calls, 1);
+    }
+
+    bool timing() const { return timers.load(std::memory_order_relaxed); }
+
+    void reset() {
+        for (auto* c : { &searches, &queries, &search_ns, &h2d_bytes, &d2h_bytes, &rows_uploaded, &wal_writes,
+                         &wal_bytes, &wal_syncs, &wal_sync_ns, &cuda_errors }) {
+            c->store(0, std::memory_order_relaxed);
+        }
+        for (auto& s : stages) {
+            s.ns.store(0, std::memory_order_relaxed);
+            s.calls.store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+inline Metrics& metrics() {
+    static Metrics m;
+    return m;
+}
+
+inline uint64_t elapsed_ns(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Adds the lifetime of the scope to a host stage while timers are on.
+class ScopedStage {
+    private:
+        Stage stage;
+        bool active;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        explicit ScopedStage(Stage s) : stage(s), active(metrics().timing()) {
+            if (active) start = std::chrono::steady_clock::now();
+        }
+        ~ScopedStage() {
+            if (active) metrics().add_stage(stage, elapsed_ns(start));
+        }
+        ScopedStage(const ScopedStage&) = delete;
+        ScopedStage& operator=(const ScopedStage&) = delete;
+};
+
+// Host counters in the Prometheus text exposition format.
+inline void render_metrics(std::ostream& os) {
+    Metrics& m = metrics();
+    // integer counters print as integers, seconds with microsecond digits
+    auto counter = [&](const char* name, const char* help, auto value) {
+        os << "# HELP " << name << " " << help << "\n# TYPE " << name << " counter\n" << name << " " << value << "\n";
+    };
+    auto load = [](const std::atomic<uint64_t>& c) { return c.load(std::memory_order_relaxed); };
+    auto seconds = [&](const std::atomic<uint64_t>& c) { return std::to_string(load(c) * 1e-9); };
+
+    counter("firedb_searches_total", "Search calls answered by the GPU indexes", load(m.searches));
+    counter("firedb_queries_total", "Queries answered by the GPU indexes", load(m.queries));
+    counter("firedb_search_seconds_total", "Wall time of GPU search calls", seconds(m.search_ns));
+    counter("firedb_h2d_bytes_total", "Bytes copied host to device", load(m.h2d_bytes));
+    counter("firedb_d2h_bytes_total", "Bytes copied device to host", load(m.d2h_bytes));
+    counter("firedb_rows_uploaded_total", "Rows made resident on a GPU", load(m.rows_uploaded));
+    counter("firedb_wal_writes_total", "Buffered id log writes", load(m.wal_writes));
+    counter("firedb_wal_bytes_total", "Bytes written to the id log", load(m.wal_bytes));
+    counter("firedb_wal_syncs_total", "fdatasync calls on the id log", load(m.wal_syncs));
+    counter("firedb_wal_sync_seconds_total", "Time spent in id log fdatasync", seconds(m.wal_sync_ns));
+    counter("firedb_cuda_errors_total", "Failed CUDA and cuBLAS calls", load(m.cuda_errors));
+
+    os << "# HELP firedb_stage_seconds_total Search time per stage, while timers are on\n"
+       << "# TYPE firedb_stage_seconds_total counter\n";
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        os << "firedb_stage_seconds_total{stage=\"" << stage_name(Stage(s)) << "\"} "
+           << seconds(m.stages[s].ns) << "\n";
+    }
+    os << "# HELP firedb_stage_calls_total Timed intervals per stage\n"
+       << "# TYPE firedb_stage_calls_total counter\n";
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        os << "firedb_stage_calls_total{stage=\"" << stage_name(Stage(s)) << "\"} " << load(m.stages[s].calls) << "\n";
+    }
+}
+
+#endif
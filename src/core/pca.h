@@ -0,0 +1,340 @@
+#pragma once
+#ifndef FIREDB_PCA_H
+#define FIREDB_PCA_H
+
+#include <cuda_runtime.h>
+#include <cublas_v2.h>
+#include <cusolverDn.h>
+#include <vector>
+#include <string>
+#include <memory>
+#include <iostream>
+#include <filesystem>
+#include <stdexcept>
+#include "slab.h"
+#include "simd.h"
+#include "cuda_util.h"
+
+// PCA projection of a database. The top out_dim principal components of the
+// slab are learned once on the GPU and kept in <db>.pca; the searched copy of
+// the vectors lives projected in <db>.pca.slab with the same row numbers as
+// the full slab, which stays the source of truth (and of exact re-ranking).
+// A projected vector is y = W (x - mean), W the out_dim x in_dim components.
+
+// Rows per streamed tile when training and per GEMM when projecting.
+constexpr size_t PCA_TILE_ROWS = 8192;
+
+// File layout: header, mean (in_dim floats), components (out_dim rows of
+// in_dim floats, largest variance first), variance (out_dim floats).
+struct PcaHeader {
+    uint32_t magic = 0x50434131;
+    uint32_t version = 1;
+    uint64_t in_dim = 0;
+    uint64_t out_dim = 0;
+    uint64_t train_rows = 0;
+    uint64_t slab_generation = 0;   // generation of the rows in <db>.pca.slab
+    char _pad[24];
+};
+
+// Learns the projection from every row of `slab` and writes it to
+// `path_file`. Two streamed passes: the mean with GEMV against a ones
+// vector, then the covariance of the centered tiles accumulated with SYRK.
+// The eigenvectors of the covariance come from cuSOLVER's syevd.
+inline void train_pca(const MatrixSlab& slab, size_t out_dim, const std::string& path_file) {
+    size_t n = slab.get_count();
+    size_t dim = slab.get_dim();
+    if (out_dim == 0 || out_dim >= dim) {
+        throw std::runtime_error("PCA dimension must be below the vector dimension");
+    }
+    if (n <= out_dim) {
+        throw std::runtime_error("PCA needs more vectors than output dimensions");
+    }
+
+    cublasHandle_t handle;
+    cusolverDnHandle_t solver;
+    if (cublasCreate(&handle) != CUBLAS_STATUS_SUCCESS) {
+        throw std::runtime_error("cublasCreate failed");
+    }
+    if (cusolverDnCreate(&solver) != CUSOLVER_STATUS_SUCCESS) {
+        cublasDestroy(handle);
+        throw std::runtime_error("cusolverDnCreate failed");
+    }
+
+    float* d_tile = nullptr;
+    float* d_ones = nullptr;
+    float* d_mean = nullptr;
+    float* d_cov = nullptr;
+    float* d_eigen = nullptr;
+    float* d_work = nullptr;
+    int* d_info = nullptr;
+    auto cleanup = [&] {
+        cudaFree(d_tile);
+        cudaFree(d_ones);
+        cudaFree(d_mean);
+        cudaFree(d_cov);
+        cudaFree(d_eigen);
+        cudaFree(d_work);
+        cudaFree(d_info);
+        cusolverDnDestroy(solver);
+        cublasDestroy(handle);
+    };
+
+    PcaHeader h;
+    h.in_dim = dim;
+    h.out_dim = out_dim;
+    h.train_rows = n;
+    h.slab_generation = ~0ull;   // no projected rows yet
+    std::vector<float> mean(dim), eigen(dim), vectors(dim * dim);
+    try {
+        CUDA_CHECK(cudaMalloc(&d_tile, PCA_TILE_ROWS * dim * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_ones, PCA_TILE_ROWS * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_mean, dim * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_cov, dim * dim * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_eigen, dim * sizeof(float)));
+        std::vector<float> ones(PCA_TILE_ROWS, 1.0f);
+        CUDA_CHECK(cudaMemcpy(d_ones, ones.data(), ones.size() * sizeof(float), cudaMemcpyHostToDevice));
+
+        // a row-major tile is a column-major dim x rows matrix
+        auto upload = [&](size_t begin, size_t rows) {
+            CUDA_CHECK(cudaMemcpy(d_tile, slab.get_data_ptr() + begin * dim, rows * dim * sizeof(float),
+                                  cudaMemcpyHostToDevice));
+        };
+
+        std::cout << "[PCA] Training " << out_dim << " components on " << n << " vectors..." << std::endl;
+        float one = 1.0f;
+        for (size_t begin = 0; begin < n; begin += PCA_TILE_ROWS) {
+            size_t rows = std::min(PCA_TILE_ROWS, n - begin);
+            upload(begin, rows);
+            float beta = begin == 0 ? 0.0f : 1.0f;
+            CUBLAS_CHECK(cublasSgemv(handle, CUBLAS_OP_N, dim, rows, &one, d_tile, dim, d_ones, 1, &beta,
+                                     d_mean, 1));
+        }
+        float inv_n = 1.0f / n;
+        CUBLAS_CHECK(cublasSscal(handle, dim, &inv_n, d_mean, 1));
+
+        float minus_one = -1.0f;
+        for (size_t begin = 0; begin < n; begin += PCA_TILE_ROWS) {
+            size_t rows = std::min(PCA_TILE_ROWS, n - begin);
+            upload(begin, rows);
+            // tile -= mean * ones^T, then cov += tile * tile^T (lower triangle)
+            CUBLAS_CHECK(cublasSger(handle, dim, rows, &minus_one, d_mean, 1, d_ones, 1, d_tile, dim));
+            float beta = begin == 0 ? 0.0f : 1.0f;
+            CUBLAS_CHECK(cublasSsyrk(handle, CUBLAS_FILL_MODE_LOWER, CUBLAS_OP_N, dim, rows, &one, d_tile, dim,
+                                     &beta, d_cov, dim));
+        }
+        float inv_n1 = 1.0f / (n - 1);
+        CUBLAS_CHECK(cublasSscal(handle, dim * dim, &inv_n1, d_cov, 1));
+
+        int lwork = 0;
+        if (cusolverDnSsyevd_bufferSize(solver, CUSOLVER_EIG_MODE_VECTOR, CUBLAS_FILL_MODE_LOWER, dim, d_cov, dim,
+                                        d_eigen, &lwork) != CUSOLVER_STATUS_SUCCESS) {
+            throw std::runtime_error("eigendecomposition failed");
+        }
+        CUDA_CHECK(cudaMalloc(&d_work, (size_t)lwork * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_info, sizeof(int)));
+        cusolverStatus_t status = cusolverDnSsyevd(solver, CUSOLVER_EIG_MODE_VECTOR, CUBLAS_FILL_MODE_LOWER, dim,
+                                                   d_cov, dim, d_eigen, d_work, lwork, d_info);
+        int info = 0;
+        CUDA_CHECK(cudaMemcpy(&info, d_info, sizeof(int), cudaMemcpyDeviceToHost));
+        if (status != CUSOLVER_STATUS_SUCCESS || info != 0) {
+            throw std::runtime_error("eigendecomposition failed");
+        }
+
+        // eigenvalues come ascending, eigenvector j is column j of d_cov
+        CUDA_CHECK(cudaMemcpy(mean.data(), d_mean, dim * sizeof(float), cudaMemcpyDeviceToHost));
+        CUDA_CHECK(cudaMemcpy(eigen.data(), d_eigen, dim * sizeof(float), cudaMemcpyDeviceToHost));
+        CUDA_CHECK(cudaMemcpy(vectors.data(), d_cov, dim * dim * sizeof(float), cudaMemcpyDeviceToHost));
+    } catch (...) {
+        cleanup();
+        throw;
+    }
+    cleanup();
+
+    std::vector<float> components(out_dim * dim), variance(out_dim);
+    double kept = 0.0, total = 0.0;
+    for (size_t j = 0; j < dim; j++) total += std::max(eigen[j], 0.0f);
+    for (size_t c = 0; c < out_dim; c++) {
+        size_t j = dim - 1 - c;
+        std::copy(vectors.begin() + j * dim, vectors.begin() + (j + 1) * dim, components.begin() + c * dim);
+        variance[c] = eigen[j];
+        kept += std::max(eigen[j], 0.0f);
+    }
+
+    std::string tmp_path = path_file + ".tmp";
+    int out = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out == -1) {
+        throw std::runtime_error("could not create PCA file");
+    }
+    size_t at = 0;
+    MatrixSlab::pwrite_all(out, reinterpret_cast<const char*>(&h), sizeof(h), at);
+    at += sizeof(h);
+    MatrixSlab::pwrite_all(out, reinterpret_cast<const char*>(mean.data()), dim * sizeof(float), at);
+    at += dim * sizeof(float);
+    MatrixSlab::pwrite_all(out, reinterpret_cast<const char*>(components.data()), components.size() * sizeof(float), at);
+    at += components.size() * sizeof(float);
+    MatrixSlab::pwrite_all(out, reinterpret_cast<const char*>(variance.data()), out_dim * sizeof(float), at);
+    fsync(out);
+    close(out);
+    if (rename(tmp_path.c_str(), path_file.c_str()) == -1) {
+        throw std::runtime_error("could not install PCA file");
+    }
+    std::cout << "[PCA] " << out_dim << " of " << dim << " dimensions keep "
+              << (total > 0 ? 100.0 * kept / total : 100.0) << "% of the variance" << std::endl;
+}
+
+// A trained projection, mapped from <db>.pca. Single vectors are projected
+// on the host; project_batch() runs one GEMM per PCA_TILE_ROWS rows on the
+// GPU when there is one.
+class Projection {
+    private:
+        int fd = -1;
+        size_t file_size = 0;
+        PcaHeader* header = nullptr;
+        const float* mean = nullptr;
+        const float* components = nullptr;
+        std::vector<float> offsets;   // W * mean, so y = W x - offsets
+
+        // GEMM state, set up by the first project_batch() on a GPU machine
+        bool device_ready = false;
+        cublasHandle_t handle = nullptr;
+        float* d_components = nullptr;
+        float* d_offsets = nullptr;
+        float* d_ones = nullptr;
+        float* d_in = nullptr;
+        float* d_out = nullptr;
+
+        void stop_device() {
+            cudaFree(d_components);
+            cudaFree(d_offsets);
+            cudaFree(d_ones);
+            cudaFree(d_in);
+            cudaFree(d_out);
+            if (handle) cublasDestroy(handle);
+            d_components = d_offsets = d_ones = d_in = d_out = nullptr;
+            handle = nullptr;
+            device_ready = false;
+        }
+
+        void start_device() {
+            size_t in = get_in_dim(), out = get_out_dim();
+            try {
+                CUBLAS_CHECK(cublasCreate(&handle));
+                CUDA_CHECK(cudaMalloc(&d_components, out * in * sizeof(float)));
+                CUDA_CHECK(cudaMalloc(&d_offsets, out * sizeof(float)));
+                CUDA_CHECK(cudaMalloc(&d_ones, PCA_TILE_ROWS * sizeof(float)));
+                CUDA_CHECK(cudaMalloc(&d_in, PCA_TILE_ROWS * in * sizeof(float)));
+                CUDA_CHECK(cudaMalloc(&d_out, PCA_TILE_ROWS * out * sizeof(float)));
+                CUDA_CHECK(cudaMemcpy(d_components, components, out * in * sizeof(float), cudaMemcpyHostToDevice));
+                CUDA_CHECK(cudaMemcpy(d_offsets, offsets.data(), out * sizeof(float), cudaMemcpyHostToDevice));
+                std::vector<float> ones(PCA_TILE_ROWS, 1.0f);
+                CUDA_CHECK(cudaMemcpy(d_ones, ones.data(), ones.size() * sizeof(float), cudaMemcpyHostToDevice));
+            } catch (...) {
+                stop_device();
+                throw;
+            }
+            device_ready = true;
+        }
+
+    public:
+        explicit Projection(const std::string& path_file) {
+            fd = open(path_file.c_str(), O_RDWR);
+            if (fd == -1) {
+                throw std::runtime_error("could not open PCA file");
+            }
+            struct stat st;
+            fstat(fd, &st);
+            file_size = st.st_size;
+            void* ptr = file_size >= sizeof(PcaHeader)
+                ? mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+            if (ptr == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("could not map PCA file");
+            }
+            header = static_cast<PcaHeader*>(ptr);
+            size_t in = header->in_dim, out = header->out_dim;
+            if (header->magic != PcaHeader().magic ||
+                file_size < sizeof(PcaHeader) + (in + out * in + out) * sizeof(float)) {
+                munmap(ptr, file_size);
+                close(fd);
+                throw std::runtime_error("PCA file is damaged");
+            }
+            mean = reinterpret_cast<const float*>(header + 1);
+            components = mean + in;
+
+            offsets.resize(out);
+            for (size_t c = 0; c < out; c++) offsets[c] = dot_f32(components + c * in, mean, in);
+        }
+        Projection(const Projection&) = delete;
+        Projection& operator=(const Projection&) = delete;
+
+        ~Projection() {
+            if (device_ready) stop_device();
+            if (header) munmap(header, file_size);
+            if (fd != -1) close(fd);
+        }
+
+        size_t get_in_dim() const { return header->in_dim; }
+        size_t get_out_dim() const { return header->out_dim; }
+        uint64_t get_generation() const { return header->slab_generation; }
+        void set_generation(uint64_t generation) { header->slab_generation = generation; }
+
+        void project(const float* x, float* y) const {
+            size_t in = get_in_dim();
+            for (size_t c = 0; c < get_out_dim(); c++) y[c] = dot_f32(components + c * in, x, in) - offsets[c];
+        }
+
+        // n row-major vectors in, n row-major projections out.
+        void project_batch(const float* x, size_t n, float* y, bool use_gpu) {
+            size_t in = get_in_dim(), out = get_out_dim();
+            if (!use_gpu) {
+                for (size_t i = 0; i < n; i++) project(x + i * in, y + i * out);
+                return;
+            }
+            if (!device_ready) start_device();
+
+            // Y = W X - offsets * ones^T, column-major out x rows
+            float one = 1.0f, zero = 0.0f, minus_one = -1.0f;
+            for (size_t begin = 0; begin < n; begin += PCA_TILE_ROWS) {
+                size_t rows = std::min(PCA_TILE_ROWS, n - begin);
+                CUDA_CHECK(cudaMemcpy(d_in, x + begin * in, rows * in * sizeof(float), cudaMemcpyHostToDevice));
+                CUBLAS_CHECK(cublasSgemm(handle, CUBLAS_OP_T, CUBLAS_OP_N, out, rows, in, &one, d_components, in,
+                                         d_in, in, &zero, d_out, out));
+                CUBLAS_CHECK(cublasSger(handle, out, rows, &minus_one, d_offsets, 1, d_ones, 1, d_out, out));
+                CUDA_CHECK(cudaMemcpy(y + begin * out, d_out, rows * out * sizeof(float), cudaMemcpyDeviceToHost));
+            }
+        }
+};
+
+// Opens the projected copy of `slab` at `path_file` and brings it up to date:
+// a copy of another slab generation (a compaction since it was written) or
+// with rows the slab lacks is rebuilt, then the rows it is missing are
+// projected and appended.
+inline std::unique_ptr<MatrixSlab> open_reduced(const MatrixSlab& slab, Projection& projection,
+                                                const std::string& path_file, bool use_gpu) {
+    if (projection.get_generation() != slab.get_generation()) std::filesystem::remove(path_file);
+    auto reduced = std::make_unique<MatrixSlab>(path_file, projection.get_out_dim());
+    if (reduced->get_count() > slab.get_count() || reduced->get_dim() != projection.get_out_dim()) {
+        reduced.reset();
+        std::filesystem::remove(path_file);
+        reduced = std::make_unique<MatrixSlab>(path_file, projection.get_out_dim());
+    }
+    projection.set_generation(slab.get_generation());
+
+    size_t have = reduced->get_count();
+    size_t rows = slab.get_count();
+    if (have == rows) return reduced;
+
+    std::cout << "[PCA] Projecting " << rows - have << " vectors to " << projection.get_out_dim()
+              << " dimensions..." << std::endl;
+    size_t in = slab.get_dim(), out = projection.get_out_dim();
+    std::vector<float> buffer(PCA_TILE_ROWS * out);
+    reduced->reserve(rows);
+    for (size_t begin = have; begin < rows; begin += PCA_TILE_ROWS) {
+        size_t n = std::min(PCA_TILE_ROWS, rows - begin);
+        projection.project_batch(slab.get_data_ptr() + begin * in, n, buffer.data(), use_gpu);
+        reduced->add_vectors(buffer.data(), n);
+    }
+    return reduced;
+}
+
+#endif
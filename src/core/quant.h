@@ -0,0 +1,688 @@
+#pragma once
+#ifndef FIREDB_QUANT_H
+#define FIREDB_QUANT_H
+
+#include <cuda_runtime.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <iostream>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <stdexcept>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "slab.h"
+#include "gpu.h"
+
+// Compressed vectors for collections that do not fit in VRAM as floats.
+//   QUANT_SQ8: one byte per dimension, x ~ vmin[d] + code * scale[d]     (4x)
+//   QUANT_PQ:  one byte per subspace, an index into 256 learned centroids
+//              of dim / m floats each                                 (4 * dim / m x)
+// Codes live in <db>.codes next to the slab. They are derived data: after a
+// crash or a compaction they are re-encoded from the slab on load.
+enum QuantType : uint32_t {
+    QUANT_NONE = 0,
+    QUANT_SQ8 = 1,
+    QUANT_PQ = 2
+};
+
+constexpr int PQ_CENTROIDS = 256;
+constexpr size_t QUANT_TRAIN_SAMPLE = 16384;
+constexpr int QUANT_TRAIN_ITERS = 10;
+
+struct CodesHeader {
+    uint32_t magic = 0x0C0DE5AB;
+    uint32_t version = 1;
+    uint32_t type = QUANT_NONE;
+    uint32_t m = 0;
+    uint64_t dim = 0;
+    uint64_t count = 0;
+    uint64_t capacity = 0;
+    uint64_t slab_generation = 0;
+    uint64_t codes_offset = 0;
+    uint8_t _pad[72];
+};
+
+
+// Plain Lloyd iterations on the host. Only runs on a training sample, and
+// for PQ on one dim / m wide subspace at a time.
+inline void kmeans(const float* x, size_t n, size_t d, size_t k, int iters, float* centroids) {
+    for (size_t c = 0; c < k; c++) {
+        std::memcpy(centroids + c * d, x + (c * n / k) * d, d * sizeof(float));
+    }
+
+    std::vector<uint32_t> assign(n);
+    std::vector<float> sums(k * d);
+    std::vector<size_t> counts(k);
+    for (int it = 0; it < iters; it++) {
+        for (size_t i = 0; i < n; i++) {
+            float best = FLT_MAX;
+            for (size_t c = 0; c < k; c++) {
+                float dist = 0.0f;
+                for (size_t j = 0; j < d; j++) {
+                    float diff = x[i * d + j] - centroids[c * d + j];
+                    dist += diff * diff;
+                }
+                if (dist < best) {
+                    best = dist;
+                    assign[i] = c;
+                }
+            }
+        }
+
+        std::fill(sums.begin(), sums.end(), 0.0f);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < n; i++) {
+            counts[assign[i]]++;
+            for (size_t j = 0; j < d; j++) sums[assign[i] * d + j] += x[i * d + j];
+        }
+        for (size_t c = 0; c < k; c++) {
+            // an empty cluster restarts on some sample point
+            if (counts[c] == 0) {
+                std::memcpy(centroids + c * d, x + ((c * 7919) % n) * d, d * sizeof(float));
+                continue;
+            }
+            for (size_t j = 0; j < d; j++) centroids[c * d + j] = sums[c * d + j] / counts[c];
+        }
+    }
+}
+
+
+class CodeSlab {
+    private:
+        std::string fpath;
+        int fd = -1;
+        size_t file_size = 0;
+        CodesHeader* header = nullptr;
+        float* codebook = nullptr;
+        uint8_t* codes = nullptr;
+
+        const size_t INITIAL_CAPACITY = 1000;
+
+        static size_t codebook_floats(uint32_t type, size_t dimension) {
+            return type == QUANT_PQ ? PQ_CENTROIDS * dimension : 2 * dimension;
+        }
+        size_t file_bytes_for(size_t capacity) const {
+            return header->codes_offset + capacity * code_size();
+        }
+
+        void map_file(size_t bytes) {
+            if (header != nullptr) munmap(header, file_size);
+            file_size = bytes;
+
+            void* ptr = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED) {
+                throw std::runtime_error("mmap failed");
+            }
+            header = static_cast<CodesHeader*>(ptr);
+            char* base = static_cast<char*>(ptr);
+            codebook = reinterpret_cast<float*>(base + sizeof(CodesHeader));
+            codes = reinterpret_cast<uint8_t*>(base + header->codes_offset);
+        }
+
+        void reserve(size_t rows) {
+            if (rows <= header->capacity) return;
+            size_t new_capacity = std::max<size_t>(header->capacity, INITIAL_CAPACITY);
+            while (new_capacity < rows) new_capacity *= 2;
+
+            // codes are the last section, growing needs no moves
+            size_t bytes = file_bytes_for(new_capacity);
+            if (ftruncate(fd, bytes) == -1) {
+                throw std::runtime_error("ftruncate failed");
+            }
+            map_file(bytes);
+            header->capacity = new_capacity;
+        }
+
+    public:
+        explicit CodeSlab(const std::string& path_file) : fpath(path_file) {
+            if (!std::filesystem::exists(fpath)) return;
+
+            fd = open(fpath.c_str(), O_RDWR);
+            if (fd == -1) {
+                throw std::runtime_error("could not open codes file");
+            }
+            struct stat st;
+            fstat(fd, &st);
+            if ((size_t)st.st_size < sizeof(CodesHeader)) {
+                throw std::runtime_error("codes file is truncated");
+            }
+            map_file(st.st_size);
+        }
+        ~CodeSlab() {
+            if (header) munmap(header, file_size);
+            if (fd != -1) close(fd);
+        }
+
+        bool trained() const { return header != nullptr; }
+
+        // Learns the codebook from a strided sample of `slab` and starts an empty
+        // codes file. PQ needs dim % m == 0 and at least 256 vectors.
+        void train(QuantType type, uint32_t m, const MatrixSlab& slab) {
+            size_t dimension = slab.get_dim();
+            size_t n = std::min<size_t>(slab.get_count(), QUANT_TRAIN_SAMPLE);
+            if (type == QUANT_PQ && (m == 0 || dimension % m != 0)) {
+                throw std::runtime_error("PQ subquantizers must divide the dimension");
+            }
+            if (n < (type == QUANT_PQ ? (size_t)PQ_CENTROIDS : 1)) {
+                throw std::runtime_error("not enough vectors to train the codebook");
+            }
+
+            std::vector<float> sample(n * dimension);
+            for (size_t i = 0; i < n; i++) {
+                size_t row = i * slab.get_count() / n;
+                std::memcpy(&sample[i * dimension], slab.get_data_ptr() + row * dimension, dimension * sizeof(float));
+            }
+
+            std::vector<float> book(codebook_floats(type, dimension));
+            if (type == QUANT_SQ8) {
+                // book = [vmin | scale]
+                for (size_t d = 0; d < dimension; d++) {
+                    float lo = FLT_MAX, hi = -FLT_MAX;
+                    for (size_t i = 0; i < n; i++) {
+                        lo = std::min(lo, sample[i * dimension + d]);
+                        hi = std::max(hi, sample[i * dimension + d]);
+                    }
+                    book[d] = lo;
+                    book[dimension + d] = hi > lo ? (hi - lo) / 255.0f : 1.0f;
+                }
+            } else {
+                // book = [m][256][dsub]
+                size_t dsub = dimension / m;
+                std::vector<float> sub(n * dsub);
+                for (uint32_t s = 0; s < m; s++) {
+                    for (size_t i = 0; i < n; i++) {
+                        std::memcpy(&sub[i * dsub], &sample[i * dimension + s * dsub], dsub * sizeof(float));
+                    }
+                    kmeans(sub.data(), n, dsub, PQ_CENTROIDS, QUANT_TRAIN_ITERS, &book[s * PQ_CENTROIDS * dsub]);
+                }
+            }
+
+            if (header) munmap(header, file_size);
+            if (fd != -1) close(fd);
+            header = nullptr;
+
+            fd = open(fpath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {
+                throw std::runtime_error("could not create codes file");
+            }
+            CodesHeader h;
+            h.type = type;
+            h.m = type == QUANT_PQ ? m : dimension;
+            h.dim = dimension;
+            h.slab_generation = slab.get_generation();
+            h.codes_offset = sizeof(CodesHeader) + book.size() * sizeof(float);
+
+            size_t bytes = h.codes_offset + INITIAL_CAPACITY * h.m;
+            h.capacity = INITIAL_CAPACITY;
+            if (ftruncate(fd, bytes) == -1) {
+                throw std::runtime_error("ftruncate failed");
+            }
+            MatrixSlab::pwrite_all(fd, reinterpret_cast<const char*>(&h), sizeof(h), 0);
+            MatrixSlab::pwrite_all(fd, reinterpret_cast<const char*>(book.data()),
+                                   book.size() * sizeof(float), sizeof(h));
+            map_file(bytes);
+        }
+
+        // Space for n more codes at the end, stored once commit(n) is called so
+        // a crash mid-encode leaves them out.
+        uint8_t* tail(size_t n) {
+            reserve(header->count + n);
+            return codes + header->count * code_size();
+        }
+        void commit(size_t n) { header->count += n; }
+
+        // Keeps only the codes of `live` (old rows, ascending). live[i] >= i,
+        // so the rows can be moved down in place.
+        void compact(const std::vector<uint64_t>& live, uint64_t generation) {
+            size_t keep = std::lower_bound(live.begin(), live.end(), header->count) - live.begin();
+            for (size_t i = 0; i < keep; i++) {
+                if (live[i] != i) std::memcpy(codes + i * code_size(), codes + live[i] * code_size(), code_size());
+            }
+            header->count = keep;
+            header->slab_generation = generation;
+        }
+
+        // Drops every code, they are re-encoded from the slab.
+        void reset(uint64_t generation) {
+            header->count = 0;
+            header->slab_generation = generation;
+        }
+
+        QuantType get_type() const { return header ? (QuantType)header->type : QUANT_NONE; }
+        size_t get_m() const { return header->m; }
+        size_t get_dim() const { return header->dim; }
+        size_t code_size() const { return header->m; }
+        size_t get_count() const { return header->count; }
+        uint64_t get_generation() const { return header->slab_generation; }
+        const float* get_codebook() const { return codebook; }
+        size_t get_codebook_floats() const { return codebook_floats(header->type, header->dim); }
+        const uint8_t* get_codes_ptr() const { return codes; }
+};
+
+
+// One thread per element.
+__global__ void sq8_encode_kernel(const float* vecs, size_t n, int dim, const float* vmin, const float* scale,
+                                  uint8_t* codes) {
+    size_t idx = blockIdx.x * (size_t)blockDim.x + threadIdx.x;
+    if (idx >= n * dim) return;
+
+    int d = idx % dim;
+    float v = rintf((vecs[idx] - vmin[d]) / scale[d]);
+    codes[idx] = (uint8_t)fminf(fmaxf(v, 0.0f), 255.0f);
+}
+
+// One thread per (row, subspace), nearest of the 256 centroids.
+__global__ void pq_encode_kernel(const float* vecs, size_t n, int dim, int m, const float* codebook,
+                                 uint8_t* codes) {
+    size_t idx = blockIdx.x * (size_t)blockDim.x + threadIdx.x;
+    if (idx >= n * m) return;
+
+    int dsub = dim / m;
+    int s = idx % m;
+    const float* x = vecs + (idx / m) * dim + s * dsub;
+    const float* book = codebook + (size_t)s * PQ_CENTROIDS * dsub;
+
+    float best = FLT_MAX;
+    int best_c = 0;
+    for (int c = 0; c < PQ_CENTROIDS; c++) {
+        float dist = 0.0f;
+        for (int j = 0; j < dsub; j++) {
+            float diff = x[j] - book[c * dsub + j];
+            dist += diff * diff;
+        }
+        if (dist < best) {
+            best = dist;
+            best_c = c;
+        }
+    }
+    codes[idx] = best_c;
+}
+
+// Grid (m, num_queries), one thread per centroid: lut[q][s][c] is the squared
+// distance of query q's subvector s to centroid c.
+__global__ void pq_lut_kernel(const float* queries, int dim, int m, const float* codebook, float* lut) {
+    int s = blockIdx.x;
+    int q = blockIdx.y;
+    int c = threadIdx.x;
+    int dsub = dim / m;
+
+    const float* x = queries + (size_t)q * dim + s * dsub;
+    const float* centroid = codebook + ((size_t)s * PQ_CENTROIDS + c) * dsub;
+    float dist = 0.0f;
+    for (int j = 0; j < dsub; j++) {
+        float diff = x[j] - centroid[j];
+        dist += diff * diff;
+    }
+    lut[((size_t)q * m + s) * PQ_CENTROIDS + c] = dist;
+}
+
+// Asymmetric distances, grid (row blocks, num_queries), one thread per row.
+// The query's table is staged in shared memory when it fits.
+__global__ void pq_adc_kernel(const uint8_t* codes, int rows, int m, const float* lut, bool use_shared,
+                              float* out) {
+    extern __shared__ float sh_lut[];
+    int q = blockIdx.y;
+    const float* table = lut + (size_t)q * m * PQ_CENTROIDS;
+    if (use_shared) {
+        for (int i = threadIdx.x; i < m * PQ_CENTROIDS; i += blockDim.x) sh_lut[i] = table[i];
+        __syncthreads();
+        table = sh_lut;
+    }
+
+    int row = blockIdx.x * blockDim.x + threadIdx.x;
+    if (row >= rows) return;
+
+    const uint8_t* code = codes + (size_t)row * m;
+    float dist = 0.0f;
+    for (int s = 0; s < m; s++) dist += table[s * PQ_CENTROIDS + code[s]];
+    out[(size_t)q * rows + row] = dist;
+}
+
+// Grid (row warps, num_queries). One warp per row like compute_norms_kernel,
+// decoding the bytes on the fly.
+__global__ void sq8_adc_kernel(const uint8_t* codes, int rows, int dim, const float* vmin, const float* scale,
+                               const float* queries, float* out) {
+    int warp = (blockIdx.x * blockDim.x + threadIdx.x) / 32;
+    int lane = threadIdx.x & 31;
+    int q = blockIdx.y;
+    if (warp >= rows) return;
+
+    const uint8_t* code = codes + (size_t)warp * dim;
+    const float* query = queries + (size_t)q * dim;
+    float sum = 0.0f;
+    for (int i = lane; i < dim; i += 32) {
+        float diff = query[i] - (vmin[i] + code[i] * scale[i]);
+        sum += diff * diff;
+    }
+    for (int offset = 16; offset > 0; offset >>= 1) {
+        sum += __shfl_down_sync(0xffffffff, sum, offset);
+    }
+    if (lane == 0) out[(size_t)q * rows + warp] = sum;
+}
+
+
+// Brute force over the codes of a CodeSlab. Codes past the VRAM capacity are
+// streamed from the mmap'd CodeSlab in chunk_rows tiles. Candidates
+// are re-ranked with exact FP32 distances from the attached slab, so the
+// approximate distances only have to get the right rows into the top
+// k * rerank_factor.
+class QuantIndex {
+private:
+    size_t dim;
+    size_t max_vectors;
+    size_t current_count = 0;
+    size_t max_batch_size = 100;
+    QuantType type;
+    size_t m;
+    size_t code_size;
+
+    uint8_t* d_codes = nullptr;
+    float* d_codebook = nullptr;
+    float* d_queries = nullptr;
+    float* h_queries = nullptr;       // pinned staging of the query batch
+    float* h_topk_scores = nullptr;
+    uint64_t* h_topk_ids = nullptr;
+    std::vector<std::pair<float, uint64_t>> rerank_scratch;
+    float* d_lut = nullptr;
+    float* d_scores = nullptr;
+    float* d_topk_scores = nullptr;
+    uint64_t* d_topk_ids = nullptr;
+    float* d_block_scores = nullptr;
+    uint64_t* d_block_ids = nullptr;
+
+    // Rows are scored QUANT_CHUNK_ROWS at a time, so the distance scratch
+    // does not grow with the collection.
+    static constexpr size_t QUANT_CHUNK_ROWS = 262144;
+    size_t chunk_rows = 0;
+
+    // encode staging, FP32 in and codes out
+    float* d_encode = nullptr;
+    uint8_t* d_encode_codes = nullptr;
+    size_t encode_rows = 0;
+
+    // Codes of every row, resident or not. Rows from max_vectors on go
+    // through the pinned tile, allocated the first time one is needed.
+    const CodeSlab* code_source = nullptr;
+    uint8_t* h_tile = nullptr;
+    uint8_t* d_tile = nullptr;
+
+    const MatrixSlab* slab = nullptr;
+    IdSlab* ids = nullptr;
+    DeviceRowUsers row_users;
+    int rerank_factor = 4;
+
+    void encode(const float* host_vecs, size_t n, uint8_t* host_codes, size_t first, bool resident) {
+        int threads = 256;
+        for (size_t done = 0; done < n; done += encode_rows) {
+            size_t c = std::min(encode_rows, n - done);
+            CUDA_CHECK(cudaMemcpy(d_encode, host_vecs + done * dim, c * dim * sizeof(float), cudaMemcpyHostToDevice));
+
+            size_t total = c * code_size;
+            size_t blocks = (total + threads - 1) / threads;
+            if (type == QUANT_SQ8) {
+                sq8_encode_kernel<<<blocks, threads>>>(d_encode, c, dim, d_codebook, d_codebook + dim, d_encode_codes);
+                CUDA_CHECK_LAUNCH();
+            } else {
+                pq_encode_kernel<<<blocks, threads>>>(d_encode, c, dim, m, d_codebook, d_encode_codes);
+                CUDA_CHECK_LAUNCH();
+            }
+
+            if (resident) {
+                CUDA_CHECK(cudaMemcpy(d_codes + (first + done) * code_size, d_encode_codes, total,
+                                      cudaMemcpyDeviceToDevice));
+            }
+            CUDA_CHECK(cudaMemcpy(host_codes + done * code_size, d_encode_codes, total, cudaMemcpyDeviceToHost));
+        }
+    }
+
+    void start_streaming() {
+        if (d_tile) return;
+        std::cout << "[GPU] Streaming the codes past " << max_vectors << " rows from the code file" << std::endl;
+        CUDA_CHECK(cudaMallocHost(&h_tile, chunk_rows * code_size));
+        CUDA_CHECK(cudaMalloc(&d_tile, chunk_rows * code_size));
+    }
+
+    size_t stored_rows() const { return code_source ? code_source->get_count() : current_count; }
+
+public:
+    QuantIndex(size_t capacity, const CodeSlab& codes)
+        : dim(codes.get_dim()), max_vectors(capacity), type(codes.get_type()), m(codes.get_m()),
+          code_size(codes.code_size()) {
+        // a small VRAM capacity still streams the rest in reasonably sized tiles
+        chunk_rows = std::min(QUANT_CHUNK_ROWS, std::max<size_t>(max_vectors, QUANT_CHUNK_ROWS / 4));
+        encode_rows = 65536;
+
+        CUDA_CHECK(cudaMalloc(&d_codebook, codes.get_codebook_floats() * sizeof(float)));
+        CUDA_CHECK(cudaMemcpy(d_codebook, codes.get_codebook(), codes.get_codebook_floats() * sizeof(float),
+                              cudaMemcpyHostToDevice));
+
+        CUDA_CHECK(cudaMalloc(&d_queries, max_batch_size * dim * sizeof(float)));
+        CUDA_CHECK(cudaMallocHost(&h_queries, max_batch_size * dim * sizeof(float)));
+        CUDA_CHECK(cudaMallocHost(&h_topk_scores, max_batch_size * GPU_MAX_K * sizeof(float)));
+        CUDA_CHECK(cudaMallocHost(&h_topk_ids, max_batch_size * GPU_MAX_K * sizeof(uint64_t)));
+        if (type == QUANT_PQ) CUDA_CHECK(cudaMalloc(&d_lut, max_batch_size * m * PQ_CENTROIDS * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_scores, chunk_rows * max_batch_size * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_topk_scores, max_batch_size * GPU_MAX_K * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_topk_ids, max_batch_size * GPU_MAX_K * sizeof(uint64_t)));
+        CUDA_CHECK(cudaMalloc(&d_block_scores, max_batch_size * GPU_MAX_K * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_block_ids, max_batch_size * GPU_MAX_K * sizeof(uint64_t)));
+        CUDA_CHECK(cudaMalloc(&d_encode, encode_rows * dim * sizeof(float)));
+        CUDA_CHECK(cudaMalloc(&d_encode_codes, encode_rows * code_size));
+
+        if (cudaMalloc(&d_codes, max_vectors * code_size) != cudaSuccess) {
+            cudaGetLastError();
+            throw std::runtime_error("could not allocate the GPU codes");
+        }
+    }
+
+    // Rows (at most `wanted`) whose codes fit in free VRAM next to the scratch.
+    static size_t resident_capacity(size_t code_bytes, size_t wanted, size_t batch) {
+        size_t free_bytes = 0, total_bytes = 0;
+        if (cudaMemGetInfo(&free_bytes, &total_bytes) != cudaSuccess) return 0;
+
+        size_t reserve = QUANT_CHUNK_ROWS * batch * sizeof(float) + (256ull << 20);
+        if (free_bytes <= reserve) return 0;
+        return std::min(wanted, (free_bytes - reserve) / code_bytes);
+    }
+
+    ~QuantIndex() {
+        cudaFree(d_codes);
+        cudaFree(d_codebook);
+        cudaFree(d_queries);
+        cudaFreeHost(h_queries);
+        cudaFreeHost(h_topk_scores);
+        cudaFreeHost(h_topk_ids);
+        cudaFree(d_lut);
+        cudaFree(d_scores);
+        cudaFree(d_topk_scores);
+        cudaFree(d_topk_ids);
+        cudaFree(d_block_scores);
+        cudaFree(d_block_ids);
+        cudaFree(d_encode);
+        cudaFree(d_encode_codes);
+        cudaFreeHost(h_tile);
+        cudaFree(d_tile);
+        row_users.release();
+    }
+
+    // Source of the exact vectors for re-ranking. Must outlive the index.
+    void attach_slab(const MatrixSlab& source) { slab = &source; }
+
+    void attach_ids(IdSlab& source) {
+        ids = &source;
+        row_users.sync(*ids);
+    }
+
+    // Candidates fetched per result for re-ranking, 0 or 1 disables it.
+    void set_rerank_factor(int factor) { rerank_factor = factor; }
+
+    // Encodes n vectors on the GPU, appends their codes to `codes` and makes
+    // the ones that fit resident, the rest are streamed at search time.
+    // `codes` must outlive the index. Returns the number made resident.
+    size_t add_vectors(const float* host_vecs, size_t n, CodeSlab& codes) {
+        code_source = &codes;
+        size_t fit = std::min(n, max_vectors - current_count);
+        if (fit < n) start_streaming();
+
+        uint8_t* out = codes.tail(n);
+        encode(host_vecs, fit, out, current_count, true);
+        if (fit < n) encode(host_vecs + fit * dim, n - fit, out + fit * code_size, 0, false);
+        codes.commit(n);
+
+        current_count += fit;
+        return fit;
+    }
+
+    // Brings `codes` in line with `source` (re-encoding what a crash or a
+    // compaction left stale) and uploads them.
+    void load_data(const MatrixSlab& source, CodeSlab& codes) {
+        code_source = &codes;
+        if (codes.get_generation() != source.get_generation() || codes.get_count() > source.get_count()) {
+            codes.reset(source.get_generation());
+        }
+        if (codes.get_count() < source.get_count()) {
+            size_t first = codes.get_count();
+            size_t n = source.get_count() - first;
+            std::cout << "[GPU] Encoding " << n << " vectors..." << std::endl;
+            encode(source.get_data_ptr() + first * dim, n, codes.tail(n), 0, false);
+            codes.commit(n);
+        }
+
+        current_count = std::min<size_t>(codes.get_count(), max_vectors);
+        if (codes.get_count() > max_vectors) start_streaming();
+        std::cout << "[GPU] Uploading " << current_count << " codes..." << std::endl;
+        CUDA_CHECK(cudaMemcpy(d_codes, codes.get_codes_ptr(), current_count * code_size, cudaMemcpyHostToDevice));
+    }
+
+    // Follows a slab compaction. Codes are small, so they are compacted on
+    // the host and uploaded again.
+    void compact(const std::vector<uint64_t>& live, const MatrixSlab& compacted, CodeSlab& codes) {
+        codes.compact(live, compacted.get_generation());
+        load_data(compacted, codes);
+        if (ids) row_users.sync(*ids);
+    }
+
+    // num_queries x dim row-major queries, k result slots per query in `out`
+    // (see pad_results). Queries and results go through pinned buffers, so
+    // nothing is allocated once the index is warm.
+    void search(const float* queries, int num_queries, int k, SearchResult* out) {
+        if (num_queries <= 0) return;
+        if (num_queries > (int)max_batch_size) {
+            throw std::runtime_error("query batch exceeds max_batch_size");
+        }
+
+        int slots = std::max(k, 0);
+        size_t total_rows = stored_rows();
+        int safe_k = std::min((size_t)slots, total_rows);
+        if (safe_k > GPU_MAX_K) {
+            throw std::runtime_error("k exceeds GPU_MAX_K");
+        }
+        if (safe_k <= 0) {
+            pad_results(out, num_queries * slots);
+            return;
+        }
+
+        bool rerank = slab && rerank_factor > 1;
+        int fetch_k = safe_k;
+        if (rerank) {
+            fetch_k = std::min<size_t>({ (size_t)GPU_MAX_K, (size_t)safe_k * rerank_factor, total_rows });
+        }
+
+        std::memcpy(h_queries, queries, num_queries * dim * sizeof(float));
+        CUDA_CHECK(cudaMemcpy(d_queries, h_queries, num_queries * dim * sizeof(float), cudaMemcpyHostToDevice));
+        if (ids) row_users.sync(*ids);
+
+        size_t lut_bytes = m * PQ_CENTROIDS * sizeof(float);
+        bool lut_shared = lut_bytes <= 48 * 1024;
+        if (type == QUANT_PQ) {
+            pq_lut_kernel<<<dim3(m, num_queries), PQ_CENTROIDS>>>(d_queries, dim, m, d_codebook, d_lut);
+            CUDA_CHECK_LAUNCH();
+        }
+
+        if (total_rows > current_count) start_streaming();
+        const uint64_t* id_map = ids && !rerank ? row_users.d_row_user : nullptr;
+        const uint32_t* mask = ids ? row_users.d_dead_mask : nullptr;
+        int threads = 256;
+        for (size_t begin = 0; begin < total_rows;) {
+            // resident chunks end at current_count, streamed tiles start there
+            size_t rows;
+            const uint8_t* chunk;
+            if (begin < current_count) {
+                rows = std::min(chunk_rows, current_count - begin);
+                chunk = d_codes + begin * code_size;
+            } else {
+                rows = std::min(chunk_rows, total_rows - begin);
+                std::memcpy(h_tile, code_source->get_codes_ptr() + begin * code_size, rows * code_size);
+                CUDA_CHECK(cudaMemcpy(d_tile, h_tile, rows * code_size, cudaMemcpyHostToDevice));
+                chunk = d_tile;
+            }
+
+            if (type == QUANT_PQ) {
+                dim3 grid((rows + threads - 1) / threads, num_queries);
+                pq_adc_kernel<<<grid, threads, lut_shared ? lut_bytes : 0>>>(chunk, rows, m, d_lut, lut_shared, d_scores);
+                CUDA_CHECK_LAUNCH();
+            } else {
+                dim3 grid((rows * 32 + threads - 1) / threads, num_queries);
+                sq8_adc_kernel<<<grid, threads>>>(chunk, rows, dim, d_codebook, d_codebook + dim, d_queries, d_scores);
+                CUDA_CHECK_LAUNCH();
+            }
+
+            bool first = begin == 0;
+            select_topk_kernel<<<num_queries, TOPK_THREADS>>>(
+                d_scores, rows, rows, fetch_k, begin, id_map, row_users.rows, mask,
+                first ? d_topk_scores : d_block_scores, first ? d_topk_ids : d_block_ids
+            );
+            CUDA_CHECK_LAUNCH();
+            if (!first) {
+                int merge_blocks = (num_queries + threads - 1) / threads;
+                merge_topk_kernel<<<merge_blocks, threads>>>(
+                    d_topk_scores, d_topk_ids, d_block_scores, d_block_ids, num_queries, fetch_k
+                );
+                CUDA_CHECK_LAUNCH();
+            }
+            begin += rows;
+        }
+
+        CUDA_CHECK(cudaMemcpy(h_topk_scores, d_topk_scores, num_queries * fetch_k * sizeof(float),
+                              cudaMemcpyDeviceToHost));
+        CUDA_CHECK(cudaMemcpy(h_topk_ids, d_topk_ids, num_queries * fetch_k * sizeof(uint64_t),
+                              cudaMemcpyDeviceToHost));
+
+        if (rerank) {
+            rerank_exact(*slab, ids, h_queries, num_queries, h_topk_ids, fetch_k, slots, out, rerank_scratch);
+            return;
+        }
+
+        pad_results(out, num_queries * slots);
+        for (int q = 0; q < num_queries; q++) {
+            int n = 0;
+            for (int i = 0; i < safe_k; i++) {
+                uint64_t id = h_topk_ids[q * safe_k + i];
+                if (id == EMPTY_ID) continue;
+                out[q * slots + n++] = { id, h_topk_scores[q * safe_k + i] };
+            }
+        }
+    }
+
+    std::vector<std::vector<SearchResult>> search(const std::vector<std::vector<float>>& queries, int k) {
+        if (queries.empty()) return {};
+        thread_local std::vector<float> flat;
+        thread_local std::vector<SearchResult> out;
+        flatten_queries(queries, dim, flat);
+        out.resize(queries.size() * std::max(k, 0));
+        search(flat.data(), queries.size(), k, out.data());
+        return unpack_results(out.data(), queries.size(), std::max(k, 0));
+    }
+
+    std::vector<SearchResult> search_one(const std::vector<float>& query, int k) {
+        return search({query}, k)[0];
+    }
+};
+
+#endif
@@ -0,0 +1,196 @@
+#pragma once
+#ifndef FIREDB_SCHEDULER_H
+#define FIREDB_SCHEDULER_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+#include "search_result.h"
+
+// Collects single queries from any number of threads into batches for one
+// batched search backend. A batch is sent when it holds max_batch queries or
+// when its oldest query has waited max_wait, so a lone query pays at most
+// max_wait extra latency while a loaded server runs full-size GEMMs. A
+// batch only holds queries with the same k as its oldest one, so no caller
+// pays for (or can fail) another caller's k; the rest wait for the next one.
+//
+// The dispatcher is the only thread that searches the backend, so work that
+// must not overlap a search (compaction) can be handed to exclusive().
+class BatchScheduler {
+    public:
+        using BatchSearch = std::function<std::vector<std::vector<SearchResult>>(
+            const std::vector<std::vector<float>>&, int)>;
+        // Called on the dispatcher thread with the results, or with the
+        // backend's exception. Must not block.
+        using Completion = std::function<void(std::vector<SearchResult>&&, std::exception_ptr)>;
+
+    private:
+        struct Request {
+            std::vector<float> query;
+            int k;
+            std::chrono::steady_clock::time_point arrival;
+            std::promise<std::vector<SearchResult>> promise;
+            Completion done;
+        };
+
+        BatchSearch backend;
+        size_t max_batch;
+        std::chrono::microseconds max_wait;
+        int max_k;
+
+        std::mutex mutex;
+        std::condition_variable queue_cv;
+        std::deque<Request> queue;
+        std::deque<std::packaged_task<void()>> tasks;
+        bool stop = false;
+        uint64_t batches = 0;
+        uint64_t queries = 0;
+        std::thread dispatcher;
+
+        void dispatch_loop() {
+            std::vector<Request> batch;
+            std::vector<std::vector<float>> qs;
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                queue_cv.wait(lock, [&] { return stop || !queue.empty() || !tasks.empty(); });
+                if (!tasks.empty()) {
+                    auto task = std::move(tasks.front());
+                    tasks.pop_front();
+                    lock.unlock();
+                    task();
+                    lock.lock();
+                    continue;
+                }
+                if (queue.empty()) return;
+
+                // the deadline belongs to the oldest query, not to this wakeup
+                auto deadline = queue.front().arrival + max_wait;
+                queue_cv.wait_until(lock, deadline, [&] { return stop || queue.size() >= max_batch; });
+
+                int k = queue.front().k;
+                batch.clear();
+                for (auto it = queue.begin(); it != queue.end() && batch.size() < max_batch;) {
+                    if (it->k != k) {
+                        ++it;
+                        continue;
+                    }
+                    batch.push_back(std::move(*it));
+                    it = queue.erase(it);
+                }
+                size_t n = batch.size();
+                batches++;
+                queries += n;
+                lock.unlock();
+
+                qs.clear();
+                for (auto& r : batch) qs.push_back(std::move(r.query));
+                std::vector<std::vector<SearchResult>> results;
+                try {
+                    results = backend(qs, k);
+                    if (results.size() < n) throw std::runtime_error("backend returned too few results");
+                } catch (...) {
+                    for (auto& r : batch) {
+                        if (r.done) r.done({}, std::current_exception());
+                        else r.promise.set_exception(std::current_exception());
+                    }
+                    lock.lock();
+                    continue;
+                }
+                for (size_t i = 0; i < n; i++) {
+                    auto& res = results[i];
+                    if ((int)res.size() > k) res.resize(std::max(k, 0));
+                    if (batch[i].done) batch[i].done(std::move(res), nullptr);
+                    else batch[i].promise.set_value(std::move(res));
+                }
+                lock.lock();
+            }
+        }
+
+        // Bad k fails the one request at submit time instead of its batch.
+        void check_k(int k) const {
+            if (max_k > 0 && k > max_k) throw std::runtime_error("k exceeds the scheduler's max_k");
+        }
+
+    public:
+        // k_limit bounds the k of a request, 0 leaves it to the backend.
+        BatchScheduler(BatchSearch search, size_t batch_limit, std::chrono::microseconds wait, int k_limit = 0)
+            : backend(std::move(search)), max_batch(std::max<size_t>(1, batch_limit)), max_wait(wait),
+              max_k(k_limit) {
+            dispatcher = std::thread([this] { dispatch_loop(); });
+        }
+
+        // Queued queries are still answered before the dispatcher exits.
+        ~BatchScheduler() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            queue_cv.notify_all();
+            dispatcher.join();
+        }
+
+        std::future<std::vector<SearchResult>> submit(std::vector<float> query, int k) {
+            check_k(k);
+            std::promise<std::vector<SearchResult>> promise;
+            auto future = promise.get_future();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stop) throw std::runtime_error("scheduler is shutting down");
+                queue.push_back({ std::move(query), k, std::chrono::steady_clock::now(), std::move(promise), nullptr });
+                if (queue.size() != 1 && queue.size() < max_batch) return future;
+            }
+            queue_cv.notify_one();
+            return future;
+        }
+
+        // Callback flavour of submit() for event loops that cannot block on
+        // a future.
+        void submit(std::vector<float> query, int k, Completion done) {
+            check_k(k);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stop) throw std::runtime_error("scheduler is shutting down");
+                queue.push_back({ std::move(query), k, std::chrono::steady_clock::now(), {}, std::move(done) });
+                if (queue.size() != 1 && queue.size() < max_batch) return;
+            }
+            queue_cv.notify_one();
+        }
+
+        // Runs fn on the dispatcher between two batches, so no search is in
+        // flight while it runs, and waits for it. Queued queries are answered
+        // after it.
+        void exclusive(std::function<void()> fn) {
+            std::packaged_task<void()> task(std::move(fn));
+            auto done = task.get_future();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stop) throw std::runtime_error("scheduler is shutting down");
+                tasks.push_back(std::move(task));
+            }
+            queue_cv.notify_one();
+            done.get();
+        }
+
+        // Blocks the calling thread until the batch holding its query is done.
+        std::vector<SearchResult> search_one(const std::vector<float>& query, int k) {
+            return submit(query, k).get();
+        }
+
+        int get_max_k() const { return max_k; }
+
+        // Mean queries per backend call since construction.
+        double average_batch() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return batches ? double(queries) / batches : 0.0;
+        }
+};
+
+#endif
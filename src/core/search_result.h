@@ -0,0 +1,43 @@
+#pragma once
+#ifndef FIREDB_SEARCH_RESULT_H
+#define FIREDB_SEARCH_RESULT_H
+
+#include <cstdint>
+#include <cfloat>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+struct SearchResult {
+    uint64_t id;
+    float score;
+};
+
+// Id of an unused result slot.
+constexpr uint64_t EMPTY_ID = ~0ull;
+
+// The span search APIs write k slots per query, query q at out[q * k], best
+// first. Queries with fewer than k hits are padded with { EMPTY_ID, FLT_MAX }.
+inline void pad_results(SearchResult* out, size_t slots) {
+    std::fill(out, out + slots, SearchResult{ EMPTY_ID, FLT_MAX });
+}
+
+inline std::vector<std::vector<SearchResult>> unpack_results(const SearchResult* out, size_t num_queries, int k) {
+    std::vector<std::vector<SearchResult>> results(num_queries);
+    for (size_t q = 0; q < num_queries; q++) {
+        for (int i = 0; i < k && out[q * k + i].id != EMPTY_ID; i++) results[q].push_back(out[q * k + i]);
+    }
+    return results;
+}
+
+// Packs a vector-of-vectors batch into `flat` (reused by the caller) for the
+// span APIs.
+inline void flatten_queries(const std::vector<std::vector<float>>& queries, size_t dim, std::vector<float>& flat) {
+    flat.resize(queries.size() * dim);
+    for (size_t q = 0; q < queries.size(); q++) {
+        if (queries[q].size() != dim) throw std::runtime_error("query dimension mismatch");
+        std::copy(queries[q].begin(), queries[q].end(), flat.begin() + q * dim);
+    }
+}
+
+#endif
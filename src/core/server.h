@@ -0,0 +1,556 @@
+#pragma once
+#ifndef FIREDB_SERVER_H
+#define FIREDB_SERVER_H
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdexcept>
+#include <iostream>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "search_result.h"
+#include "scheduler.h"
+
+// Wire protocol, all integers and floats little-endian:
+//
+//   request:  u32 len | u8 op | u32 tag | body          (len counts op onwards)
+//   response: u32 len | u32 tag | u8 status | body      (len counts tag onwards)
+//
+//   REQ_SEARCH  body u32 k, u32 nq, f32[nq * dim]
+//               reply u32 nq, u32 k, nq * k * (u64 id, f32 score), best
+//               first, padded with EMPTY_ID / FLT_MAX. k is at most the
+//               scheduler's max_k (GPU_MAX_K in FireDB)
+//   REQ_PUT     body u32 n, u64 ids[n], f32[n * dim]   reply u32 inserted
+//   REQ_DELETE  body u32 n, u64 ids[n]                  reply u32 removed
+//   REQ_COUNT   empty body                              reply u64 rows
+//   REQ_STATS   empty body                              reply metrics, Prometheus text
+//
+// A failed request gets STATUS_ERROR and a message as its body. Clients may
+// pipeline any number of requests; replies come back in request order, the
+// tag is echoed so they can be matched anyway.
+enum RequestOp : uint8_t {
+    REQ_SEARCH = 1,
+    REQ_PUT = 2,
+    REQ_DELETE = 3,
+    REQ_COUNT = 4,
+    REQ_STATS = 5
+};
+
+enum ServerStatus : uint8_t {
+    STATUS_OK = 0,
+    STATUS_ERROR = 1
+};
+
+constexpr uint32_t SERVER_MAX_FRAME = 64u << 20;
+// Requests a connection may have in progress before the server stops
+// reading from it.
+constexpr size_t SERVER_MAX_PIPELINE = 1024;
+constexpr int SERVER_MAX_EVENTS = 256;
+constexpr size_t SERVER_READ_CHUNK = 64 << 10;
+
+// What the server does with each request. Searches go through the batching
+// scheduler; put / remove / count / stats run on the event loop thread, which
+// is the database's single writer while the server runs.
+struct ServerHandlers {
+    BatchScheduler* scheduler = nullptr;
+    std::function<bool(uint64_t id, const float* vec)> put;
+    std::function<size_t(const uint64_t* ids, size_t n)> remove;
+    std::function<uint64_t()> count;
+    std::function<std::string()> stats;
+};
+
+// Single-threaded epoll server. Every connection is non-blocking with its own
+// input buffer, output buffer and queue of replies in request order. A search
+// reply is sized up front and its slots are filled as the scheduler finishes
+// the queries, which happens on the dispatcher thread: results are handed to
+// the loop through a locked list and an eventfd.
+class QueryServer {
+    private:
+        struct Reply {
+            std::vector<char> bytes;
+            size_t waiting = 0;
+            std::string error;
+        };
+
+        struct Connection {
+            int fd = -1;
+            std::vector<char> in;
+            size_t in_begin = 0;
+            std::vector<char> out;
+            size_t out_sent = 0;
+            std::deque<Reply> replies;
+            uint64_t first_seq = 0;   // sequence number of replies.front()
+            uint32_t events = 0;
+        };
+
+        struct Finished {
+            uint64_t conn;
+            uint64_t seq;
+            uint32_t query;
+            std::vector<SearchResult> results;
+            std::exception_ptr error;
+        };
+
+        static constexpr uint64_t LISTENER = 0;
+        static constexpr uint64_t WAKEUP = 1;
+
+        ServerHandlers handlers;
+        size_t dim;
+        int listen_fd = -1;
+        int epoll_fd = -1;
+        int wake_fd = -1;
+        std::atomic<bool> stopping{ false };
+        uint64_t next_conn = 2;
+        std::unordered_map<uint64_t, Connection> conns;
+
+        std::mutex finished_mutex;
+        std::condition_variable finished_cv;
+        std::vector<Finished> finished;
+        std::vector<Finished> draining;
+        size_t in_flight = 0;
+
+        static constexpr size_t REQUEST_HEADER = sizeof(uint8_t) + sizeof(uint32_t);
+        static constexpr size_t REPLY_HEADER = sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
+        static constexpr size_t RESULT_BYTES = sizeof(uint64_t) + sizeof(float);
+
+        template <typename T>
+        static T read_le(const char* p) {
+            T v;
+            std::memcpy(&v, p, sizeof(T));
+            return v;
+        }
+
+        template <typename T>
+        static void write_le(char* p, T v) { std::memcpy(p, &v, sizeof(T)); }
+
+        static std::vector<char> make_reply(uint32_t tag, ServerStatus status, size_t body) {
+            std::vector<char> bytes(REPLY_HEADER + body);
+            write_le<uint32_t>(bytes.data(), bytes.size() - sizeof(uint32_t));
+            write_le<uint32_t>(bytes.data() + 4, tag);
+            bytes[8] = static_cast<char>(status);
+            return bytes;
+        }
+
+        static std::vector<char> error_reply(uint32_t tag, const std::string& message) {
+            auto bytes = make_reply(tag, STATUS_ERROR, message.size());
+            std::memcpy(bytes.data() + REPLY_HEADER, message.data(), message.size());
+            return bytes;
+        }
+
+        void watch(uint64_t id, int fd, uint32_t events) {
+            epoll_event ev = {};
+            ev.events = events;
+            ev.data.u64 = id;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+                throw std::runtime_error("epoll_ctl failed");
+            }
+        }
+
+        // Level triggered: read while the pipeline has room, write while
+        // output is queued.
+        void update_events(uint64_t id, Connection& c) {
+            uint32_t events = 0;
+            if (c.replies.size() < SERVER_MAX_PIPELINE) events |= EPOLLIN;
+            if (c.out_sent < c.out.size()) events |= EPOLLOUT;
+            if (events == c.events) return;
+            epoll_event ev = {};
+            ev.events = events;
+            ev.data.u64 = id;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+            c.events = events;
+        }
+
+        void close_connection(uint64_t id) {
+            auto it = conns.find(id);
+            if (it == conns.end()) return;
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+            close(it->second.fd);
+            conns.erase(it);
+        }
+
+        void accept_all() {
+            while (true) {
+                int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd == -1) {
+                    if (errno == EINTR) continue;
+                    return;   // EAGAIN, or out of descriptors until one closes
+                }
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                uint64_t id = next_conn++;
+                Connection& c = conns[id];
+                c.fd = fd;
+                c.events = EPOLLIN;
+                watch(id, fd, EPOLLIN);
+            }
+        }
+
+        // Moves every finished reply at the front of the queue to the output
+        // buffer and writes as much as the socket takes.
+        void flush(uint64_t id, Connection& c) {
+            while (!c.replies.empty() && c.replies.front().waiting == 0) {
+                Reply& r = c.replies.front();
+                if (!r.error.empty()) r.bytes = error_reply(read_le<uint32_t>(r.bytes.data() + 4), r.error);
+                c.out.insert(c.out.end(), r.bytes.begin(), r.bytes.end());
+                c.replies.pop_front();
+                c.first_seq++;
+            }
+
+            while (c.out_sent < c.out.size()) {
+                ssize_t n = send(c.fd, c.out.data() + c.out_sent, c.out.size() - c.out_sent, MSG_NOSIGNAL);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                    close_connection(id);
+                    return;
+                }
+                c.out_sent += n;
+            }
+            if (c.out_sent == c.out.size()) {
+                c.out.clear();
+                c.out_sent = 0;
+            }
+            update_events(id, c);
+        }
+
+        void reply_now(Connection& c, std::vector<char> bytes) {
+            Reply r;
+            r.bytes = std::move(bytes);
+            c.replies.push_back(std::move(r));
+        }
+
+        void handle_search(uint64_t id, Connection& c, uint32_t tag, const char* body, size_t len) {
+            if (len < 2 * sizeof(uint32_t)) {
+                reply_now(c, error_reply(tag, "short search request"));
+                return;
+            }
+            uint32_t k = read_le<uint32_t>(body);
+            uint32_t nq = read_le<uint32_t>(body + 4);
+            if (k == 0 || nq == 0 || len - 8 != (size_t)nq * dim * sizeof(float)) {
+                reply_now(c, error_reply(tag, "bad search shape"));
+                return;
+            }
+            int max_k = handlers.scheduler->get_max_k();
+            if (max_k > 0 && k > (uint32_t)max_k) {
+                reply_now(c, error_reply(tag, "k exceeds " + std::to_string(max_k)));
+                return;
+            }
+            size_t reply_bytes = REPLY_HEADER + 8 + (size_t)nq * k * RESULT_BYTES;
+            if (reply_bytes > SERVER_MAX_FRAME) {
+                reply_now(c, error_reply(tag, "search reply too large"));
+                return;
+            }
+
+            Reply r;
+            r.bytes = make_reply(tag, STATUS_OK, reply_bytes - REPLY_HEADER);
+            char* p = r.bytes.data() + REPLY_HEADER;
+            write_le<uint32_t>(p, nq);
+            write_le<uint32_t>(p + 4, k);
+            for (size_t i = 0; i < (size_t)nq * k; i++) {
+                write_le<uint64_t>(p + 8 + i * RESULT_BYTES, EMPTY_ID);
+                write_le<float>(p + 8 + i * RESULT_BYTES + 8, FLT_MAX);
+            }
+            r.waiting = nq;
+            uint64_t seq = c.first_seq + c.replies.size();
+            c.replies.push_back(std::move(r));
+
+            const char* vecs = body + 8;
+            for (uint32_t q = 0; q < nq; q++) {
+                std::vector<float> query(dim);
+                std::memcpy(query.data(), vecs + (size_t)q * dim * sizeof(float), dim * sizeof(float));
+                {
+                    std::lock_guard<std::mutex> lock(finished_mutex);
+                    in_flight++;
+                }
+                try {
+                    handlers.scheduler->submit(std::move(query), k,
+                        [this, id, seq, q](std::vector<SearchResult>&& results, std::exception_ptr error) {
+                            {
+                                std::lock_guard<std::mutex> lock(finished_mutex);
+                                finished.push_back({ id, seq, q, std::move(results), error });
+                                in_flight--;
+                            }
+                            finished_cv.notify_all();
+                            uint64_t one = 1;
+                            ssize_t ignored = write(wake_fd, &one, sizeof(one));
+                            (void)ignored;
+                        });
+                } catch (const std::exception& e) {
+                    {
+                        std::lock_guard<std::mutex> lock(finished_mutex);
+                        in_flight--;
+                    }
+                    Reply& failed = c.replies[seq - c.first_seq];
+                    failed.error = e.what();
+                    failed.waiting -= nq - q;
+                    return;
+                }
+            }
+        }
+
+        void handle_request(uint64_t id, Connection& c, const char* frame, size_t len) {
+            uint8_t op = static_cast<uint8_t>(frame[0]);
+            uint32_t tag = read_le<uint32_t>(frame + 1);
+            const char* body = frame + REQUEST_HEADER;
+            size_t body_len = len - REQUEST_HEADER;
+
+            try {
+                if (op == REQ_SEARCH) {
+                    handle_search(id, c, tag, body, body_len);
+                } else if (op == REQ_PUT) {
+                    uint32_t n = body_len >= 4 ? read_le<uint32_t>(body) : 0;
+                    if (body_len < 4 || body_len - 4 != (size_t)n * (sizeof(uint64_t) + dim * sizeof(float))) {
+                        reply_now(c, error_reply(tag, "bad put shape"));
+                        return;
+                    }
+                    const char* ids = body + 4;
+                    const char* vecs = ids + (size_t)n * sizeof(uint64_t);
+                    std::vector<float> vec(dim);
+                    uint32_t inserted = 0;
+                    for (uint32_t i = 0; i < n; i++) {
+                        std::memcpy(vec.data(), vecs + (size_t)i * dim * sizeof(float), dim * sizeof(float));
+                        if (handlers.put(read_le<uint64_t>(ids + i * sizeof(uint64_t)), vec.data())) inserted++;
+                    }
+                    auto bytes = make_reply(tag, STATUS_OK, sizeof(uint32_t));
+                    write_le<uint32_t>(bytes.data() + REPLY_HEADER, inserted);
+                    reply_now(c, std::move(bytes));
+                } else if (op == REQ_DELETE) {
+                    uint32_t n = body_len >= 4 ? read_le<uint32_t>(body) : 0;
+                    if (body_len < 4 || body_len - 4 != (size_t)n * sizeof(uint64_t)) {
+                        reply_now(c, error_reply(tag, "bad delete shape"));
+                        return;
+                    }
+                    std::vector<uint64_t> ids(n);
+                    std::memcpy(ids.data(), body + 4, n * sizeof(uint64_t));
+                    auto bytes = make_reply(tag, STATUS_OK, sizeof(uint32_t));
+                    write_le<uint32_t>(bytes.data() + REPLY_HEADER, handlers.remove(ids.data(), n));
+                    reply_now(c, std::move(bytes));
+                } else if (op == REQ_COUNT) {
+                    auto bytes = make_reply(tag, STATUS_OK, sizeof(uint64_t));
+                    write_le<uint64_t>(bytes.data() + REPLY_HEADER, handlers.count());
+                    reply_now(c, std::move(bytes));
+                } else if (op == REQ_STATS && handlers.stats) {
+                    std::string text = handlers.stats();
+                    auto bytes = make_reply(tag, STATUS_OK, text.size());
+                    std::memcpy(bytes.data() + REPLY_HEADER, text.data(), text.size());
+                    reply_now(c, std::move(bytes));
+                } else {
+                    reply_now(c, error_reply(tag, "unknown op"));
+                }
+            } catch (const std::exception& e) {
+                reply_now(c, error_reply(tag, e.what()));
+            }
+        }
+
+        // Reads what the socket has and runs every complete frame while the
+        // pipeline has room. Returns false if the connection was closed.
+        bool read_requests(uint64_t id, Connection& c) {
+            while (c.replies.size() < SERVER_MAX_PIPELINE) {
+                size_t used = c.in.size();
+                c.in.resize(used + SERVER_READ_CHUNK);
+                ssize_t n = recv(c.fd, c.in.data() + used, SERVER_READ_CHUNK, 0);
+                c.in.resize(used + std::max<ssize_t>(n, 0));
+                if (n == 0) {
+                    close_connection(id);
+                    return false;
+                }
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                    close_connection(id);
+                    return false;
+                }
+                if (!parse_frames(id, c)) return false;
+            }
+            return true;
+        }
+
+        bool parse_frames(uint64_t id, Connection& c) {
+            while (c.replies.size() < SERVER_MAX_PIPELINE) {
+                size_t avail = c.in.size() - c.in_begin;
+                if (avail < sizeof(uint32_t)) break;
+                uint32_t len = read_le<uint32_t>(c.in.data() + c.in_begin);
+                if (len < REQUEST_HEADER || len > SERVER_MAX_FRAME) {
+                    close_connection(id);
+                    return false;
+                }
+                if (avail < sizeof(uint32_t) + len) break;
+                handle_request(id, c, c.in.data() + c.in_begin + sizeof(uint32_t), len);
+                c.in_begin += sizeof(uint32_t) + len;
+            }
+
+            if (c.in_begin == c.in.size()) {
+                c.in.clear();
+                c.in_begin = 0;
+            } else if (c.in_begin > c.in.size() / 2) {
+                c.in.erase(c.in.begin(), c.in.begin() + c.in_begin);
+                c.in_begin = 0;
+            }
+            return true;
+        }
+
+        // Flushes finished replies and keeps running frames that were already
+        // buffered while the pipeline was full, until it fills again or only a
+        // partial frame is left.
+        void service(uint64_t id) {
+            while (true) {
+                auto it = conns.find(id);
+                if (it == conns.end()) return;
+                flush(id, it->second);
+
+                it = conns.find(id);
+                if (it == conns.end()) return;
+                Connection& c = it->second;
+                size_t buffered = c.in.size() - c.in_begin;
+                if (buffered == 0 || c.replies.size() >= SERVER_MAX_PIPELINE) return;
+                if (!parse_frames(id, c)) return;
+                if (c.in.size() - c.in_begin == buffered) return;
+            }
+        }
+
+        void drain_finished() {
+            uint64_t count;
+            ssize_t ignored = read(wake_fd, &count, sizeof(count));
+            (void)ignored;
+            {
+                std::lock_guard<std::mutex> lock(finished_mutex);
+                draining.swap(finished);
+            }
+
+            std::vector<uint64_t> touched;
+            for (auto& f : draining) {
+                auto it = conns.find(f.conn);
+                if (it == conns.end()) continue;   // client went away
+                Connection& c = it->second;
+                Reply& r = c.replies[f.seq - c.first_seq];
+                if (f.error) {
+                    try {
+                        std::rethrow_exception(f.error);
+                    } catch (const std::exception& e) {
+                        r.error = e.what();
+                    } catch (...) {
+                        r.error = "search failed";
+                    }
+                } else {
+                    uint32_t k = read_le<uint32_t>(r.bytes.data() + REPLY_HEADER + 4);
+                    char* slot = r.bytes.data() + REPLY_HEADER + 8 + (size_t)f.query * k * RESULT_BYTES;
+                    for (size_t i = 0; i < f.results.size() && i < k; i++) {
+                        write_le<uint64_t>(slot + i * RESULT_BYTES, f.results[i].id);
+                        write_le<float>(slot + i * RESULT_BYTES + 8, f.results[i].score);
+                    }
+                }
+                r.waiting--;
+                touched.push_back(f.conn);
+            }
+            draining.clear();
+
+            std::sort(touched.begin(), touched.end());
+            touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+            for (uint64_t id : touched) service(id);
+        }
+
+    public:
+        QueryServer(ServerHandlers server_handlers, size_t dimension, uint16_t port)
+            : handlers(std::move(server_handlers)), dim(dimension) {
+            listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listen_fd == -1) {
+                throw std::runtime_error("could not create socket");
+            }
+            int one = 1;
+            int zero = 0;
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+            sockaddr_in6 addr = {};
+            addr.sin6_family = AF_INET6;
+            addr.sin6_addr = in6addr_any;
+            addr.sin6_port = htons(port);
+            if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+                listen(listen_fd, SOMAXCONN) == -1) {
+                close(listen_fd);
+                throw std::runtime_error("could not listen on port " + std::to_string(port));
+            }
+
+            epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (epoll_fd == -1 || wake_fd == -1) {
+                throw std::runtime_error("could not create epoll instance");
+            }
+            watch(LISTENER, listen_fd, EPOLLIN);
+            watch(WAKEUP, wake_fd, EPOLLIN);
+        }
+        QueryServer(const QueryServer&) = delete;
+        QueryServer& operator=(const QueryServer&) = delete;
+
+        // Searches still in the scheduler call back into the server, so wait
+        // for them before tearing it down.
+        ~QueryServer() {
+            {
+                std::unique_lock<std::mutex> lock(finished_mutex);
+                finished_cv.wait(lock, [&] { return in_flight == 0; });
+            }
+            for (auto& [id, c] : conns) close(c.fd);
+            close(listen_fd);
+            close(epoll_fd);
+            close(wake_fd);
+        }
+
+        // Serves until stop(). Blocks the calling thread, which becomes the
+        // writer for put and delete requests.
+        void run() {
+            epoll_event events[SERVER_MAX_EVENTS];
+            while (!stopping) {
+                int n = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    throw std::runtime_error("epoll_wait failed");
+                }
+                for (int i = 0; i < n && !stopping; i++) {
+                    uint64_t id = events[i].data.u64;
+                    if (id == LISTENER) {
+                        accept_all();
+                        continue;
+                    }
+                    if (id == WAKEUP) {
+                        drain_finished();
+                        continue;
+                    }
+
+                    auto it = conns.find(id);
+                    if (it == conns.end()) continue;
+                    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                        close_connection(id);
+                        continue;
+                    }
+                    if ((events[i].events & EPOLLIN) && !read_requests(id, it->second)) continue;
+                    service(id);
+                }
+            }
+        }
+
+        // Async-signal-safe: only sets a flag and writes the eventfd.
+        void stop() {
+            stopping = true;
+            uint64_t one = 1;
+            ssize_t ignored = write(wake_fd, &one, sizeof(one));
+            (void)ignored;
+        }
+};
+
+#endif
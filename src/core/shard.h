@@ -0,0 +1,169 @@
+#pragma once
+#ifndef FIREDB_SHARD_H
+#define FIREDB_SHARD_H
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <mutex>
+#include "slab.h"
+#include "gpu.h"
+#include "thread_pool.h"
+
+// Rows per stripe. Consecutive appends land on different devices quickly, so
+// a bulk import is spread over every card without any per-row table.
+constexpr uint64_t SHARD_STRIPE_ROWS = 8192;
+
+// One GpuIndex per visible device, each holding every shards-th stripe of the
+// slab. A search runs on all devices at once, one host worker per device
+// (every device has its own cuBLAS handle and default stream), and the
+// per-shard top-k lists are merged on the host. Shards do not stream: rows
+// past the combined resident capacity are not searched.
+//
+// Searches and the writer follow GpuIndex's model. They fan out on separate
+// pools, so a bulk add never holds up a search; searches take turns on
+// search_pool.
+class ShardedIndex {
+private:
+    const MatrixSlab& slab;
+    size_t dim;
+    std::vector<std::unique_ptr<GpuIndex>> shards;
+    ThreadPool search_pool;
+    ThreadPool add_pool;
+    std::mutex search_mutex;
+    uint64_t rows_added = 0;
+
+    uint32_t shard_of(uint64_t row) const { return (row / SHARD_STRIPE_ROWS) % shards.size(); }
+
+public:
+    ShardedIndex(const MatrixSlab& source, int devices, size_t wanted_rows, size_t batch,
+                 StoragePrecision storage = STORE_FP32)
+        : slab(source), dim(source.get_dim()), search_pool(devices), add_pool(devices) {
+        size_t per_shard = (wanted_rows + devices - 1) / devices;
+        for (int d = 0; d < devices; d++) {
+            cudaSetDevice(d);
+            size_t capacity = GpuIndex::resident_capacity(dim, per_shard, batch, storage);
+            shards.push_back(std::make_unique<GpuIndex>(dim, capacity, storage, d));
+
+            RowStripe layout;
+            layout.rows = SHARD_STRIPE_ROWS;
+            layout.shards = devices;
+            layout.shard = d;
+            shards.back()->set_layout(layout);
+            shards.back()->attach_slab(slab, false);
+        }
+    }
+
+    size_t num_shards() const { return shards.size(); }
+
+    size_t get_capacity() const {
+        size_t total = 0;
+        for (auto& s : shards) total += s->get_capacity();
+        return total;
+    }
+
+    void set_rerank_factor(int factor) {
+        for (auto& s : shards) s->set_rerank_factor(factor);
+    }
+
+    void attach_ids(IdSlab& source) {
+        for (auto& s : shards) s->attach_ids(source);
+    }
+
+    // Every shard mirrors the filter columns it needs and masks its own rows.
+    void attach_attrs(AttrStore& source) {
+        for (auto& s : shards) s->attach_attrs(source);
+    }
+
+    // Appends slab rows first_row .. first_row + n, which must follow the
+    // rows added so far. Every device uploads its stripes concurrently.
+    void add_vectors(const float* host_vecs, size_t n, uint64_t first_row, const float* host_norms = nullptr) {
+        if (first_row != rows_added) {
+            throw std::runtime_error("sharded rows must be appended in order");
+        }
+
+        // single rows go through the owning shard's append ring, no fan-out
+        if (n == 1) {
+            shards[shard_of(first_row)]->add_single_vector(host_vecs, host_norms);
+            rows_added++;
+            return;
+        }
+
+        add_pool.parallel_for(shards.size(), [&](size_t s) {
+            uint64_t row = first_row;
+            while (row < first_row + n) {
+                uint64_t run = std::min<uint64_t>(SHARD_STRIPE_ROWS - row % SHARD_STRIPE_ROWS, first_row + n - row);
+                if (shard_of(row) == s) {
+                    size_t at = row - first_row;
+                    shards[s]->add_vectors(host_vecs + at * dim, run, host_norms ? host_norms + at : nullptr);
+                }
+                row += run;
+            }
+            cudaDeviceSynchronize();
+        });
+        rows_added += n;
+    }
+
+    void load_data() {
+        for (auto& s : shards) s->clear();
+        rows_added = 0;
+        std::cout << "[GPU] Uploading " << slab.get_count() << " vectors to " << shards.size()
+                  << " devices..." << std::endl;
+        add_vectors(slab.get_data_ptr(), slab.get_count(), 0, slab.get_norms_ptr());
+    }
+
+    // Row numbers change with every stripe boundary, so all shards reload.
+    void compact() { load_data(); }
+
+    std::vector<std::vector<SearchResult>> search(const std::vector<std::vector<float>>& queries, int k,
+                                                  const AttrFilter* filter = nullptr) {
+        std::vector<std::vector<std::vector<SearchResult>>> partial(shards.size());
+        {
+            std::lock_guard<std::mutex> lock(search_mutex);
+            search_pool.parallel_for(shards.size(), [&](size_t s) { partial[s] = shards[s]->search(queries, k, filter); });
+        }
+
+        std::vector<std::vector<SearchResult>> final_results(queries.size());
+        for (size_t q = 0; q < queries.size(); q++) {
+            auto& merged = final_results[q];
+            for (auto& p : partial) {
+                if (q < p.size()) merged.insert(merged.end(), p[q].begin(), p[q].end());
+            }
+            size_t keep = std::min<size_t>(std::max(k, 0), merged.size());
+            std::partial_sort(merged.begin(), merged.begin() + keep, merged.end(),
+                              [](const SearchResult& a, const SearchResult& b) { return a.score < b.score; });
+            merged.resize(keep);
+        }
+        return final_results;
+    }
+
+    std::vector<SearchResult> search_one(const std::vector<float>& query, int k) {
+        return search({query}, k)[0];
+    }
+
+    // GpuIndex::search_rows() over every shard, k slots per query in `out`.
+    void search_rows(const float* queries, int num_queries, int k, SearchResult* out) {
+        size_t slots = std::max(k, 0);
+        std::vector<std::vector<SearchResult>> partial(shards.size(), std::vector<SearchResult>(num_queries * slots));
+        {
+            std::lock_guard<std::mutex> lock(search_mutex);
+            search_pool.parallel_for(shards.size(), [&](size_t s) {
+                shards[s]->search_rows(queries, num_queries, k, partial[s].data());
+            });
+        }
+
+        std::vector<SearchResult> merged;
+        for (int q = 0; q < num_queries; q++) {
+            merged.clear();
+            for (auto& p : partial) merged.insert(merged.end(), p.begin() + q * slots, p.begin() + (q + 1) * slots);
+            std::partial_sort(merged.begin(), merged.begin() + slots, merged.end(),
+                              [](const SearchResult& a, const SearchResult& b) { return a.score < b.score; });
+            std::copy(merged.begin(), merged.begin() + slots, out + q * slots);
+        }
+    }
+
+    size_t get_max_batch() const { return shards[0]->get_max_batch(); }
+};
+
+#endif
@@ -2,217 +2,1143 @@
 #ifndef FIREDB_SLAB_H
 #define FIREDB_SLAB_H
 #include <cstdint>
-#include <fstream>
 #include <string>
-#include <unordered_map>
 #include <vector>
 #include <optional>
+#include <memory>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdexcept>
 #include <cstring>
+#include <cerrno>
 #include <iostream>
 #include <filesystem>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include "flat_map.h"
+#include "metrics.h"
 enum OpCode : uint8_t {
     OP_INSERT = 1,
     OP_DELETE = 2
 };
 
+// When buffered WAL records are written out and fdatasync'ed.
+enum SyncPolicy : uint8_t {
+    SYNC_EVERY_OP = 0,   // every insert/remove call, a batch call counts as one op
+    SYNC_EVERY_N = 1,    // once sync_every records are pending
+    SYNC_INTERVAL = 2,   // by a background thread every sync_interval_ms
+    SYNC_MANUAL = 3      // only on sync() and on close
+};
+
+struct WalOptions {
+    SyncPolicy policy = SYNC_EVERY_OP;
+    size_t sync_every = 1024;
+    uint32_t sync_interval_ms = 10;
+    bool fsync = true;   // false stops at write(), which survives a process crash but not power loss
+    size_t checkpoint_every = 1000000;   // log records between automatic checkpoints, 0 disables
+};
+
+// Layout of the id snapshot written by IdSlab::checkpoint(). The header is
+// followed by auto_row (num_rows int64) and then num_users (user_id, auto_id)
+// pairs, both loaded with bulk copies. slab_generation is only set on the
+// snapshot a compaction writes, see IdSlab::finish_compaction().
+struct IdSnapshotHeader {
+    uint32_t magic = 0x1D5A4B01;
+    uint32_t version = 1;
+    uint64_t auto_id = 0;
+    uint64_t num_rows = 0;
+    uint64_t num_users = 0;
+    uint64_t slab_generation = 0;
+    char _pad[24];
+};
+
+constexpr uint64_t NO_USER = ~0ull;
+
+// Entries of address space IdSlab reserves for row_user, so the reverse index
+// never moves while readers use it. A smaller range is tried when the limit
+// on address space refuses this one.
+constexpr size_t ROW_USER_RESERVE = 1ull << 32;
+constexpr size_t ROW_USER_FALLBACK_RESERVE = 1ull << 26;
+
 class IdSlab {
     private:
-        std::unordered_map<uint64_t ,uint64_t> user_auto;
+        FlatIdMap user_auto;
         std::vector<int64_t> auto_row;
+
+        // Dense reverse index, row_user[row] is the user id stored at that slab
+        // row or NO_USER. For every device copy (tracker) the rows from
+        // row_user_dirty[tracker] on changed since its last
+        // take_dirty_row_users(), which is how the GPU indexes keep their
+        // copies current.
+        //
+        // Searches read row_user while the writer inserts and removes, so it
+        // lives in a fixed reservation whose front is made writable as rows
+        // arrive (entries past row_user_rows are always NO_USER), elements are
+        // stored atomically and the row count is published with release
+        // semantics. The id maps themselves are writer-only.
+        uint64_t* row_user = nullptr;
+        size_t row_user_reserved = 0;
+        size_t row_user_committed = 0;
+        std::atomic<size_t> row_user_rows{ 0 };
+        std::deque<std::atomic<size_t>> row_user_dirty;
         std::string fpath;
-        std::fstream logfile;
+        std::string snap_path;
+        int fd = -1;
         uint64_t auto_id = 0;
+        size_t records_since_checkpoint = 0;
 
-        void replay_log() {
-            logfile.clear();
-            logfile.seekg(0, std::ios::beg);
+        // Group commit state. Records are serialized into `pending` and hit the
+        // file with one write() per commit. log_mutex guards pending and the fd
+        // against the interval flusher thread.
+        WalOptions options;
+        std::vector<char> pending;
+        size_t pending_records = 0;
+        std::mutex log_mutex;
+        std::condition_variable flusher_cv;
+        std::thread flusher;
+        bool stopping = false;
+
+        // Automatic checkpoints copy the maps under log_mutex and leave the
+        // file write, fsync and log rewrite to this thread, so a put never
+        // waits on the disk for a whole snapshot.
+        std::thread checkpointer;
+        std::atomic<bool> checkpoint_running{ false };
+
+        static constexpr size_t LOG_ENTRY_SIZE = sizeof(uint8_t) + 2 * sizeof(uint64_t) + sizeof(int64_t);
+        static constexpr size_t REPLAY_CHUNK = LOG_ENTRY_SIZE * 65536;
+        // SYNC_MANUAL still writes (without fsync) past this many buffered bytes
+        static constexpr size_t MAX_PENDING_BYTES = 64ull << 20;
+
+        void reserve_row_users() {
+            for (size_t entries : { ROW_USER_RESERVE, ROW_USER_FALLBACK_RESERVE }) {
+                void* range = mmap(nullptr, entries * sizeof(uint64_t), PROT_NONE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if (range == MAP_FAILED) continue;
+                row_user = static_cast<uint64_t*>(range);
+                row_user_reserved = entries;
+                return;
+            }
+            throw std::runtime_error("could not reserve row index");
+        }
 
-            uint8_t op_val;
+        // Makes the first `rows` entries writable, doubling so this stays rare.
+        void commit_row_users(size_t rows) {
+            if (rows <= row_user_committed) return;
+            if (rows > row_user_reserved) {
+                throw std::runtime_error("row index reservation exhausted");
+            }
+            size_t page_entries = sysconf(_SC_PAGESIZE) / sizeof(uint64_t);
+            size_t want = std::max({ rows, row_user_committed * 2, (size_t)65536 });
+            want = std::min(row_user_reserved, (want + page_entries - 1) / page_entries * page_entries);
+            if (mprotect(row_user + row_user_committed, (want - row_user_committed) * sizeof(uint64_t),
+                         PROT_READ | PROT_WRITE) == -1) {
+                throw std::runtime_error("could not grow row index");
+            }
+            std::fill(row_user + row_user_committed, row_user + want, NO_USER);
+            row_user_committed = want;
+        }
+
+        // Lowers every tracker's dirty mark to `row`. Readers swap the marks
+        // out concurrently in take_dirty_row_users(); the update is an RMW
+        // even when the mark stays, so a reader whose swap comes later also
+        // sees the entry just stored.
+        void mark_row_user(size_t row) {
+            for (auto& d : row_user_dirty) {
+                size_t cur = d.load(std::memory_order_relaxed);
+                while (!d.compare_exchange_weak(cur, std::min(cur, row), std::memory_order_acq_rel)) {}
+            }
+        }
+
+        void set_row_user(int64_t row, uint64_t uid) {
+            if (row < 0) return;
+            size_t rows = row_user_rows.load(std::memory_order_relaxed);
+            if ((size_t)row >= rows) commit_row_users(row + 1);
+            __atomic_store_n(&row_user[row], uid, __ATOMIC_RELAXED);
+            if ((size_t)row >= rows) row_user_rows.store(row + 1, std::memory_order_release);
+            mark_row_user(row);
+        }
+
+        void clear_row_user(int64_t row, uint64_t uid) {
+            if (row < 0 || (size_t)row >= row_user_rows.load(std::memory_order_relaxed) || row_user[row] != uid) return;
+            __atomic_store_n(&row_user[row], NO_USER, __ATOMIC_RELAXED);
+            mark_row_user(row);
+        }
+
+        // Only while no reader is active (compaction).
+        void clear_row_users() {
+            std::fill(row_user, row_user + row_user_rows.load(), NO_USER);
+            row_user_rows.store(0);
+        }
+
+        void apply_entry(const char* p) {
+            OpCode op = static_cast<OpCode>(static_cast<uint8_t>(p[0]));
             uint64_t user_id;
             uint64_t read_aid;
             int64_t row_index;
+            std::memcpy(&user_id, p + 1, sizeof(user_id));
+            std::memcpy(&read_aid, p + 9, sizeof(read_aid));
+            std::memcpy(&row_index, p + 17, sizeof(row_index));
 
-            while (logfile.read(reinterpret_cast<char*>(&op_val), sizeof(op_val))) {
-                OpCode op = static_cast<OpCode>(op_val);
-                logfile.read(reinterpret_cast<char*>(&user_id), sizeof(user_id));
-                logfile.read(reinterpret_cast<char*>(&read_aid), sizeof(read_aid));
-                logfile.read(reinterpret_cast<char*>(&row_index), sizeof(row_index));
+            if (op == OP_INSERT) {
+                user_auto.assign(user_id, read_aid);
 
-                if (op == OP_INSERT) {
-                    user_auto[user_id] = read_aid;
+                if (read_aid >= auto_row.size()) {
+                    auto_row.resize(read_aid + 1, -1);
+                }
+                auto_row[read_aid] = row_index;
+                set_row_user(row_index, user_id);
 
-                    if (read_aid >= auto_row.size()) {
-                        auto_row.resize(read_aid + 1, -1);
-                    }
-                    auto_row[read_aid] = row_index;
+                if (read_aid >= auto_id) {
+                    auto_id = read_aid + 1;
+                }
+            }
+            else if (op == OP_DELETE) {
+                user_auto.erase(user_id);
+                if (read_aid < auto_row.size()) {
+                    clear_row_user(auto_row[read_aid], user_id);
+                    auto_row[read_aid] = -1;
+                }
+            }
+        }
 
-                    if (read_aid >= auto_id) {
-                        auto_id = read_aid + 1;
-                    }
+        bool load_snapshot() {
+            int sfd = open(snap_path.c_str(), O_RDONLY);
+            if (sfd == -1) return false;
+
+            struct stat st;
+            fstat(sfd, &st);
+            size_t size = st.st_size;
+            if (size < sizeof(IdSnapshotHeader)) {
+                close(sfd);
+                throw std::runtime_error("id snapshot is truncated");
+            }
+
+            void* ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, sfd, 0);
+            close(sfd);
+            if (ptr == MAP_FAILED) {
+                throw std::runtime_error("mmap failed");
+            }
+
+            const IdSnapshotHeader* h = static_cast<const IdSnapshotHeader*>(ptr);
+            IdSnapshotHeader expected;
+            size_t need = sizeof(IdSnapshotHeader) + h->num_rows * sizeof(int64_t)
+                        + h->num_users * 2 * sizeof(uint64_t);
+            if (h->magic != expected.magic || h->version != expected.version || size < need) {
+                munmap(ptr, size);
+                throw std::runtime_error("id snapshot is corrupt");
+            }
+
+            const char* body = static_cast<const char*>(ptr) + sizeof(IdSnapshotHeader);
+            auto_row.resize(h->num_rows);
+            std::memcpy(auto_row.data(), body, h->num_rows * sizeof(int64_t));
+
+            const uint64_t* pairs = reinterpret_cast<const uint64_t*>(body + h->num_rows * sizeof(int64_t));
+            user_auto.reserve(h->num_users);
+            for (uint64_t i = 0; i < h->num_users; i++) {
+                user_auto.assign(pairs[2 * i], pairs[2 * i + 1]);
+                if (pairs[2 * i + 1] < auto_row.size()) {
+                    set_row_user(auto_row[pairs[2 * i + 1]], pairs[2 * i]);
                 }
-                else if (op == OP_DELETE) {
-                    user_auto.erase(user_id);
-                    if (read_aid < auto_row.size()) {
-                        auto_row[read_aid] = -1;
-                    }
+            }
+            auto_id = h->auto_id;
+
+            munmap(ptr, size);
+            return true;
+        }
+
+        // Writes the snapshot to a temp file and renames it into place, then
+        // drops the whole log: every record in it, written or still pending,
+        // is already reflected in the in-memory state. If we crash between the
+        // rename and the truncate, replaying the old log over the new snapshot
+        // is harmless because every record is an idempotent assignment.
+        void checkpoint_locked() {
+            std::string tmp_path = snap_path + ".tmp";
+            write_snapshot(tmp_path, auto_row, 0);
+
+            if (rename(tmp_path.c_str(), snap_path.c_str()) == -1) {
+                throw std::runtime_error("could not install id snapshot");
+            }
+            sync_parent_dir();
+            truncate_log_locked();
+        }
+
+        struct SnapshotImage {
+            IdSnapshotHeader header;
+            std::vector<int64_t> rows;
+            std::vector<uint64_t> pairs;
+        };
+
+        SnapshotImage capture_snapshot(std::vector<int64_t> rows, uint64_t slab_generation) const {
+            SnapshotImage image;
+            image.header.auto_id = auto_id;
+            image.header.num_rows = rows.size();
+            image.header.num_users = user_auto.size();
+            image.header.slab_generation = slab_generation;
+            image.rows = std::move(rows);
+
+            image.pairs.reserve(2 * user_auto.size());
+            user_auto.for_each([&](uint64_t uid, uint64_t aid) {
+                image.pairs.push_back(uid);
+                image.pairs.push_back(aid);
+            });
+            return image;
+        }
+
+        static void write_snapshot_file(const std::string& path, const SnapshotImage& image) {
+            int sfd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (sfd == -1) {
+                throw std::runtime_error("could not create id snapshot");
+            }
+            write_all(sfd, reinterpret_cast<const char*>(&image.header), sizeof(image.header));
+            write_all(sfd, reinterpret_cast<const char*>(image.rows.data()), image.rows.size() * sizeof(int64_t));
+            write_all(sfd, reinterpret_cast<const char*>(image.pairs.data()), image.pairs.size() * sizeof(uint64_t));
+            fsync(sfd);
+            close(sfd);
+        }
+
+        void write_snapshot(const std::string& path, const std::vector<int64_t>& rows, uint64_t slab_generation) {
+            write_snapshot_file(path, capture_snapshot(rows, slab_generation));
+        }
+
+        // Runs on the checkpointer thread. Every record in the first
+        // `log_bytes` of the log is reflected in `image`; once the snapshot is
+        // in place the log is rewritten with only the records after them. A
+        // crash before the rewrite replays the whole log, which is harmless
+        // for the same reason as in checkpoint_locked().
+        void write_checkpoint(const SnapshotImage& image, off_t log_bytes) {
+            try {
+                std::string tmp_path = snap_path + ".tmp";
+                write_snapshot_file(tmp_path, image);
+                if (rename(tmp_path.c_str(), snap_path.c_str()) == -1) {
+                    throw std::runtime_error("could not install id snapshot");
+                }
+                sync_parent_dir();
+
+                std::lock_guard<std::mutex> lock(log_mutex);
+                drop_log_prefix_locked(log_bytes);
+            } catch (const std::exception& e) {
+                std::cout << "[WAL] Checkpoint failed: " << e.what() << "\n";
+            }
+            checkpoint_running = false;
+        }
+
+        void drop_log_prefix_locked(off_t log_bytes) {
+            struct stat st;
+            if (fstat(fd, &st) == -1) throw std::runtime_error("fstat failed");
+            std::vector<char> tail(st.st_size - log_bytes);
+            size_t done = 0;
+            while (done < tail.size()) {
+                ssize_t n = pread(fd, tail.data() + done, tail.size() - done, log_bytes + done);
+                if (n <= 0) {
+                    if (n < 0 && errno == EINTR) continue;
+                    throw std::runtime_error("could not read wal");
+                }
+                done += n;
+            }
+
+            // the old log may hold synced records, so the new one is synced
+            // before it replaces it whatever the sync policy
+            std::string tmp_path = fpath + ".tmp";
+            int nfd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+            if (nfd == -1) throw std::runtime_error("could not create wal");
+            write_all(nfd, tail.data(), tail.size());
+            fdatasync(nfd);
+            if (rename(tmp_path.c_str(), fpath.c_str()) == -1) {
+                close(nfd);
+                throw std::runtime_error("could not install wal");
+            }
+            sync_parent_dir();
+            close(fd);
+            fd = nfd;
+        }
+
+        // Starts a background checkpoint unless one is still running, in
+        // which case records keep counting and the next record retries.
+        void start_checkpoint_locked() {
+            if (checkpoint_running) return;
+            if (checkpointer.joinable()) checkpointer.join();
+
+            struct stat st;
+            if (fstat(fd, &st) == -1) return;
+            checkpoint_running = true;
+            records_since_checkpoint = 0;
+            auto image = std::make_shared<SnapshotImage>(capture_snapshot(auto_row, 0));
+            off_t log_bytes = st.st_size;
+            checkpointer = std::thread([this, image, log_bytes] { write_checkpoint(*image, log_bytes); });
+        }
+
+        // Waits for a background checkpoint. Called without log_mutex before
+        // anything that installs a snapshot or truncates the log itself.
+        void wait_checkpoint() {
+            if (checkpointer.joinable()) checkpointer.join();
+        }
+
+        void truncate_log_locked(bool durable = false) {
+            if (ftruncate(fd, 0) == -1) {
+                throw std::runtime_error("ftruncate failed");
+            }
+            if (durable || options.fsync) fdatasync(fd);
+            pending.clear();
+            pending_records = 0;
+            records_since_checkpoint = 0;
+        }
+
+        void sync_parent_dir() {
+            std::filesystem::path dir = std::filesystem::absolute(snap_path).parent_path();
+            int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+            if (dfd == -1) return;
+            fsync(dfd);
+            close(dfd);
+        }
+
+        static void write_all(int out_fd, const char* data, size_t len) {
+            size_t done = 0;
+            while (done < len) {
+                ssize_t n = write(out_fd, data + done, len - done);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    throw std::runtime_error("write failed");
+                }
+                done += n;
+            }
+        }
+
+        void replay_log() {
+            std::vector<char> buf(REPLAY_CHUNK);
+            size_t carry = 0;
+            size_t valid_bytes = 0;
+
+            lseek(fd, 0, SEEK_SET);
+            while (true) {
+                ssize_t got = read(fd, buf.data() + carry, buf.size() - carry);
+                if (got <= 0) break;
+
+                size_t avail = carry + got;
+                size_t whole = avail / LOG_ENTRY_SIZE * LOG_ENTRY_SIZE;
+                for (size_t at = 0; at < whole; at += LOG_ENTRY_SIZE) {
+                    apply_entry(buf.data() + at);
                 }
+                valid_bytes += whole;
+                records_since_checkpoint += whole / LOG_ENTRY_SIZE;
+
+                carry = avail - whole;
+                std::memmove(buf.data(), buf.data() + whole, carry);
+            }
+
+            // A torn record at the tail is a write that never committed
+            if (carry != 0 && ftruncate(fd, valid_bytes) == -1) {
+                throw std::runtime_error("ftruncate failed");
             }
 
             if (auto_row.size() > auto_id) {
                 auto_id = auto_row.size();
             }
-
-            logfile.clear();
-            logfile.seekp(0, std::ios::end);
         };
 
-        void write_log_entry(OpCode op, uint64_t uid, uint64_t aid, int64_t row) {
-            logfile.write((char*)&op, sizeof(op));
-            logfile.write((char*)&uid, sizeof(uid));
-            logfile.write((char*)&aid, sizeof(aid));
-            logfile.write((char*)&row, sizeof(row));
+        static void append_log_entry(std::vector<char>& buf, OpCode op, uint64_t uid, uint64_t aid, int64_t row) {
+            size_t at = buf.size();
+            buf.resize(at + LOG_ENTRY_SIZE);
+            char* p = buf.data() + at;
+            std::memcpy(p, &op, sizeof(uint8_t));
+            std::memcpy(p + 1, &uid, sizeof(uid));
+            std::memcpy(p + 9, &aid, sizeof(aid));
+            std::memcpy(p + 17, &row, sizeof(row));
+        }
+
+        void write_pending_locked(bool durable) {
+            write_all(fd, pending.data(), pending.size());
+            metrics().add(metrics().wal_writes, 1);
+            metrics().add(metrics().wal_bytes, pending.size());
+            pending.clear();
+            pending_records = 0;
+
+            if (durable && options.fsync) {
+                auto start = std::chrono::steady_clock::now();
+                fdatasync(fd);
+                metrics().add(metrics().wal_syncs, 1);
+                metrics().add(metrics().wal_sync_ns, elapsed_ns(start));
+            }
+        }
+
+        void commit_locked() {
+            if (pending.empty()) return;
+            write_pending_locked(true);
+        }
+
+        // Called with log_mutex held after `records` entries were appended.
+        void records_added_locked(size_t records) {
+            pending_records += records;
+            records_since_checkpoint += records;
 
-            logfile.flush();
+            if (options.checkpoint_every && records_since_checkpoint >= options.checkpoint_every) {
+                start_checkpoint_locked();
+            }
+
+            switch (options.policy) {
+                case SYNC_EVERY_OP:
+                    commit_locked();
+                    break;
+                case SYNC_EVERY_N:
+                    if (pending_records >= options.sync_every) commit_locked();
+                    break;
+                case SYNC_INTERVAL:
+                case SYNC_MANUAL:
+                    if (pending.size() >= MAX_PENDING_BYTES) write_pending_locked(false);
+                    break;
+            }
+        }
+
+        void write_log_entry(OpCode op, uint64_t uid, uint64_t aid, int64_t row) {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            append_log_entry(pending, op, uid, aid, row);
+            records_added_locked(1);
         };
 
-    public:
-        IdSlab(const std::string& path_file) : fpath(path_file) {
-            logfile.open(fpath, std::ios::in | std::ios::out | std::ios::app | std::ios::binary);
+        void flusher_loop() {
+            std::unique_lock<std::mutex> lock(log_mutex);
+            while (!stopping) {
+                flusher_cv.wait_for(lock, std::chrono::milliseconds(options.sync_interval_ms));
+                commit_locked();
+            }
+        }
 
-            if (!logfile.is_open()) {
-                logfile.clear();
-                logfile.open(fpath, std::ios::out | std::ios::binary);
-                logfile.close();
-                logfile.open(fpath, std::ios::in | std::ios::out | std::ios::app | std::ios::binary);
+    public:
+        IdSlab(const std::string& path_file, WalOptions wal_options = WalOptions())
+            : fpath(path_file), snap_path(path_file + ".snap"), options(wal_options) {
+            reserve_row_users();
+            fd = open(fpath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+            if (fd == -1) {
+                throw std::runtime_error("could not open wal");
             }
+            load_snapshot();
             replay_log();
+
+            if (options.checkpoint_every && records_since_checkpoint >= options.checkpoint_every) {
+                checkpoint_locked();
+            }
+
+            if (options.policy == SYNC_INTERVAL) {
+                flusher = std::thread(&IdSlab::flusher_loop, this);
+            }
         };
 
         ~IdSlab() {
-            if (logfile.is_open()) {
-                logfile.close();
+            wait_checkpoint();
+            if (flusher.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lock(log_mutex);
+                    stopping = true;
+                }
+                flusher_cv.notify_one();
+                flusher.join();
             }
+            if (fd != -1) {
+                sync();
+                close(fd);
+            }
+            if (row_user) munmap(row_user, row_user_reserved * sizeof(uint64_t));
+        }
+
+        // Writes and fdatasyncs every buffered record.
+        void sync() {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            commit_locked();
+        }
+
+        // Snapshots the id maps and truncates the log, so the next open only
+        // replays records written after this call.
+        void checkpoint() {
+            wait_checkpoint();
+            std::lock_guard<std::mutex> lock(log_mutex);
+            checkpoint_locked();
+        }
+
+        // Rows below `rows` that still have a live user id, ascending.
+        std::vector<uint64_t> live_rows(size_t rows) const {
+            std::vector<uint64_t> live;
+            size_t end = std::min(rows, row_user_size());
+            for (size_t r = 0; r < end; r++) {
+                if (row_user[r] != NO_USER) live.push_back(r);
+            }
+            return live;
+        }
+
+        // Compaction is a two file commit. prepare_compaction() writes the
+        // remapped snapshot to <snap>.compact tagged with the new slab
+        // generation, then the slab is renamed into place, then
+        // finish_compaction() installs the snapshot. finish_compaction() also
+        // runs at startup: a pending snapshot whose generation matches the slab
+        // is rolled forward, any other one belongs to a compaction that never
+        // committed and is dropped.
+        void prepare_compaction(const std::vector<uint64_t>& live, uint64_t slab_generation) {
+            std::vector<int64_t> new_of_old(row_user_size(), -1);
+            for (size_t i = 0; i < live.size(); i++) new_of_old[live[i]] = i;
+
+            std::vector<int64_t> rows(auto_row.size(), -1);
+            for (size_t aid = 0; aid < auto_row.size(); aid++) {
+                int64_t old = auto_row[aid];
+                if (old >= 0 && (size_t)old < new_of_old.size()) rows[aid] = new_of_old[old];
+            }
+
+            wait_checkpoint();
+            std::lock_guard<std::mutex> lock(log_mutex);
+            write_snapshot(snap_path + ".compact", rows, slab_generation);
+        }
+
+        void finish_compaction(uint64_t slab_generation) {
+            std::string compact_path = snap_path + ".compact";
+            int sfd = open(compact_path.c_str(), O_RDONLY);
+            if (sfd == -1) return;
+
+            IdSnapshotHeader h;
+            ssize_t got = read(sfd, &h, sizeof(h));
+            close(sfd);
+            if (got != (ssize_t)sizeof(h) || h.slab_generation != slab_generation) {
+                std::filesystem::remove(compact_path);
+                return;
+            }
+
+            wait_checkpoint();
+            std::lock_guard<std::mutex> lock(log_mutex);
+            // every logged record uses the old row numbering and replay has no
+            // generation check, so the log goes first. The pending snapshot
+            // holds the full state and is rolled forward if we crash here.
+            truncate_log_locked(true);
+            if (rename(compact_path.c_str(), snap_path.c_str()) == -1) {
+                throw std::runtime_error("could not install id snapshot");
+            }
+            sync_parent_dir();
+
+            user_auto.clear();
+            auto_row.clear();
+            clear_row_users();
+            auto_id = 0;
+            load_snapshot();
+            for (auto& d : row_user_dirty) d.store(0);
         }
 
         std::optional<uint64_t> insert(uint64_t user_id, int64_t row_index) {
-            if (user_auto.count(user_id)) {
+            if (user_auto.contains(user_id)) {
                 return std::nullopt;
             }
 
             uint64_t id = auto_id++;
 
-            user_auto[user_id] = id;
+            user_auto.assign(user_id, id);
             auto_row.push_back(row_index);
+            set_row_user(row_index, user_id);
 
             write_log_entry(OP_INSERT, user_id, id, row_index);
             return id;
         }
+
+        // Inserts user_ids[i] at row first_row + i. All records are appended to
+        // the log buffer under one lock and count as a single op for the sync
+        // policy. Ids that already exist are skipped, the same as insert().
+        // Returns how many ids were inserted.
+        size_t insert_batch(const uint64_t* user_ids, size_t n, int64_t first_row) {
+            user_auto.reserve(user_auto.size() + n);
+            auto_row.reserve(auto_row.size() + n);
+
+            std::lock_guard<std::mutex> lock(log_mutex);
+            pending.reserve(pending.size() + n * LOG_ENTRY_SIZE);
+
+            size_t inserted = 0;
+            for (size_t i = 0; i < n; i++) {
+                if (!user_auto.insert(user_ids[i], auto_id)) continue;
+
+                uint64_t id = auto_id++;
+                auto_row.push_back(first_row + i);
+                set_row_user(first_row + i, user_ids[i]);
+                append_log_entry(pending, OP_INSERT, user_ids[i], id, first_row + i);
+                inserted++;
+            }
+
+            if (inserted) records_added_locked(inserted);
+            return inserted;
+        }
+
         void remove(uint64_t user_id) {
-            if (!user_auto.count(user_id)) return;
+            const uint64_t* found = user_auto.find(user_id);
+            if (!found) return;
 
-            uint64_t aid = user_auto[user_id];
+            uint64_t aid = *found;
             user_auto.erase(user_id);
 
             if (aid < auto_row.size()) {
+                clear_row_user(auto_row[aid], user_id);
                 auto_row[aid] = -1;
             }
 
             write_log_entry(OP_DELETE, user_id, aid, -1);
         }
 
+        // remove() for many ids with a single log append. Returns how many
+        // ids existed.
+        size_t remove_batch(const uint64_t* user_ids, size_t n) {
+            std::lock_guard<std::mutex> lock(log_mutex);
+
+            size_t removed = 0;
+            for (size_t i = 0; i < n; i++) {
+                const uint64_t* found = user_auto.find(user_ids[i]);
+                if (!found) continue;
+
+                uint64_t aid = *found;
+                user_auto.erase(user_ids[i]);
+                if (aid < auto_row.size()) {
+                    clear_row_user(auto_row[aid], user_ids[i]);
+                    auto_row[aid] = -1;
+                }
+                append_log_entry(pending, OP_DELETE, user_ids[i], aid, -1);
+                removed++;
+            }
+
+            if (removed) records_added_locked(removed);
+            return removed;
+        }
+
         int64_t get_row(uint64_t auto_id) {
             if (auto_id >= auto_row.size()) return -1;
             return auto_row[auto_id];
         }
         int64_t get_row_from_user(uint64_t uid) {
-            if (user_auto.find(uid) == user_auto.end()) return -1;
-            return get_row(user_auto[uid]);
+            const uint64_t* aid = user_auto.find(uid);
+            if (!aid) return -1;
+            return get_row(*aid);
         }
+
+        // Translates n user ids to rows in one pass over the id map. Unknown
+        // or deleted ids get -1.
+        void get_rows_from_users(const uint64_t* uids, size_t n, int64_t* rows) {
+            std::vector<uint64_t> aids(n);
+            user_auto.find_batch(uids, n, aids.data(), ~0ull);
+            for (size_t i = 0; i < n; i++) {
+                rows[i] = aids[i] < auto_row.size() ? auto_row[aids[i]] : -1;
+            }
+        }
+
+        size_t size() const { return user_auto.size(); }
+
+        // NO_USER for rows that were never assigned or were removed. This and
+        // the row_user accessors below may be called from search threads.
+        uint64_t get_user_from_row(int64_t row) const {
+            if (row < 0 || (size_t)row >= row_user_size()) return NO_USER;
+            return __atomic_load_n(&row_user[row], __ATOMIC_RELAXED);
+        }
+        // Never moves. Read entries with __atomic_load_n, the writer may be
+        // updating them.
+        const uint64_t* row_user_data() const { return row_user; }
+        size_t row_user_size() const { return row_user_rows.load(std::memory_order_acquire); }
+
+        // Registers one more copy of row_user, initially all dirty. Called
+        // before the copy's searches start.
+        size_t add_row_user_tracker() {
+            row_user_dirty.emplace_back(0);
+            return row_user_dirty.size() - 1;
+        }
+
+        // Returns the [begin, end) range of row_user that changed since the
+        // tracker's previous call and marks it clean for that tracker. Entries
+        // the writer changes meanwhile lower the mark again, so they are
+        // picked up next time.
+        std::pair<size_t, size_t> take_dirty_row_users(size_t tracker) {
+            size_t rows = row_user_size();
+            size_t dirty = row_user_dirty[tracker].exchange(rows, std::memory_order_acquire);
+            return { std::min(dirty, rows), rows };
+        }
+};
+
+// Version 1 files hold the header and capacity * dim floats. Version 2 adds a
+// section of capacity squared L2 norms at norms_offset, right after the
+// vectors, so they are never recomputed at load time.
+constexpr uint32_t SLAB_VERSION = 2;
+
+// Address space a MatrixSlab reserves up front. The file is mapped at the
+// start of the range and growth maps only the new tail behind it, so the
+// data never moves while the range lasts. PROT_NONE costs no memory.
+constexpr size_t SLAB_RESERVE_BYTES = 1ull << 40;
+
+// Distance a database is searched with, fixed when the slab is created.
+// Scores are always "lower is better": squared L2, or the negated inner
+// product for METRIC_IP and METRIC_COSINE. Cosine slabs store unit-length
+// rows, normalized once at ingest, so cosine search is an inner product
+// search with normalized queries.
+enum Metric : uint32_t {
+    METRIC_L2 = 0,
+    METRIC_IP = 1,
+    METRIC_COSINE = 2
 };
 
 struct SlabHeader {
     uint32_t magic = 0x26872687;
-    uint32_t version = 1;
+    uint32_t version = SLAB_VERSION;
     uint64_t count = 0;
     uint64_t dim = 0;
     uint64_t capacity = 0;
-    char _pad[96];
+    uint64_t generation = 0;   // bumped by every compaction, zero in older files
+    uint64_t norms_offset = 0;
+    uint32_t metric = METRIC_L2;   // zero, so L2, in older files
+    uint32_t _reserved = 0;
+    char _pad[72];
 };
 
+inline float squared_norm(const float* v, size_t dim) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < dim; i++) sum += v[i] * v[i];
+    return sum;
+}
+
+// Scales v to unit length in place. Zero vectors are left alone.
+inline void normalize_vector(float* v, size_t dim) {
+    float norm = std::sqrt(squared_norm(v, dim));
+    if (norm == 0.0f) return;
+    for (size_t i = 0; i < dim; i++) v[i] /= norm;
+}
+
+// Read-only mmap of a whole file. Import uses it to hand the float region of
+// an .npy straight to MatrixSlab::add_vectors and the GPU upload, without a
+// staging buffer in between.
+class MappedFile {
+    private:
+        int fd = -1;
+        size_t file_size = 0;
+        char* base = nullptr;
+
+    public:
+        MappedFile(const std::string& path_file) {
+            fd = open(path_file.c_str(), O_RDONLY);
+            if (fd == -1) {
+                throw std::runtime_error("open failed");
+            }
+
+            struct stat st;
+            fstat(fd, &st);
+            file_size = st.st_size;
+            if (file_size == 0) return;
+
+            void* ptr = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("mmap failed");
+            }
+            base = static_cast<char*>(ptr);
+            madvise(base, file_size, MADV_SEQUENTIAL);
+        }
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile() {
+            if (base) munmap(base, file_size);
+            if (fd != -1) close(fd);
+        }
+
+        // Drops the pages of [offset, offset + len) from this mapping and from
+        // the page cache once they are consumed, so memory stays flat.
+        void release(size_t offset, size_t len) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t begin = offset / page * page;
+            size_t end = std::min(offset + len, file_size) / page * page;
+            if (end <= begin) return;
+            madvise(base + begin, end - begin, MADV_DONTNEED);
+            posix_fadvise(fd, begin, end - begin, POSIX_FADV_DONTNEED);
+        }
+
+        const char* data() const { return base; }
+        size_t size() const { return file_size; }
+};
+
+// Concurrency: one writer thread appends while any number of readers search.
+// The writer fills rows and norms past header->count and then publishes the
+// new count with a release store; a reader's acquire load of get_count() is a
+// snapshot under which every row is complete. Growth moves the norms section
+// (and the data too once the reservation is outgrown), so it holds
+// remap_mutex exclusively and readers hold read_lock() while they use the
+// pointers. Plain appends never take it. Compaction replaces the file and
+// must not run while readers are active.
 class MatrixSlab {
     private:
         std::string fpath;
         int fd;
         size_t file_size;
+        char* reserved = nullptr;
+        size_t reserved_bytes = 0;
+        size_t mapped_bytes = 0;
         SlabHeader* header;
         float* data_region;
+        float* norms_region = nullptr;
+        mutable std::shared_mutex remap_mutex;
 
         const size_t INITIAL_CAPACITY = 1000;
 
-        void map_file(size_t file_size_byes) {
-            if (header != nullptr) {
-                munmap(header, this->file_size);
+        size_t norms_offset_for(size_t capacity, size_t dimension) const {
+            return sizeof(SlabHeader) + capacity * dimension * sizeof(float);
+        }
+        size_t file_bytes_for(size_t capacity, size_t dimension) const {
+            return norms_offset_for(capacity, dimension) + capacity * sizeof(float);
+        }
+
+        void update_regions() {
+            char* base = reinterpret_cast<char*>(header);
+            data_region = reinterpret_cast<float*>(base + sizeof(SlabHeader));
+            norms_region = header->norms_offset ? reinterpret_cast<float*>(base + header->norms_offset) : nullptr;
+        }
+
+        void normalize_rows(size_t first, size_t n) {
+            if (header->metric != METRIC_COSINE) return;
+            for (size_t r = first; r < first + n; r++) normalize_vector(data_region + r * header->dim, header->dim);
+        }
+
+        void write_norms(size_t first, size_t n) {
+            for (size_t r = first; r < first + n; r++) {
+                norms_region[r] = squared_norm(data_region + r * header->dim, header->dim);
             }
+        }
+
+        // Version 1 slab: lay out the norms section and fill it once.
+        void upgrade_layout() {
+            size_t bytes = file_bytes_for(header->capacity, header->dim);
+            if (ftruncate(fd, bytes) == -1) {
+                throw std::runtime_error("ftruncate failed");
+            }
+            map_file(bytes);
+            header->norms_offset = norms_offset_for(header->capacity, header->dim);
+            update_regions();
+            write_norms(0, header->count);
+            header->version = SLAB_VERSION;
+        }
 
-            file_size = file_size_byes;
+        static size_t round_to_page(size_t bytes) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            return (bytes + page - 1) / page * page;
+        }
 
-            void* ptr = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-            if (ptr == MAP_FAILED) {
-                throw std::runtime_error("mmap failed");
+        // Maps the file up to `bytes`. Only pages past the current mapping are
+        // added, with MAP_FIXED inside the reservation, so pointers handed out
+        // earlier stay valid. A file outgrowing the reservation is remapped
+        // into a bigger one, the only case in which the data moves.
+        void map_file(size_t bytes) {
+            if (!reserved || round_to_page(bytes) > reserved_bytes) {
+                release_mapping();
+                size_t wanted = std::max(SLAB_RESERVE_BYTES, round_to_page(bytes) * 2);
+                void* range = mmap(nullptr, wanted, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                if (range == MAP_FAILED) {
+                    // address space limits (ulimit -v): leave room for a few doublings
+                    wanted = round_to_page(bytes) * 8;
+                    range = mmap(nullptr, wanted, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                }
+                if (range == MAP_FAILED) {
+                    throw std::runtime_error("mmap failed");
+                }
+                reserved = static_cast<char*>(range);
+                reserved_bytes = wanted;
             }
 
-            header = static_cast<SlabHeader*>(ptr);
-            data_region = reinterpret_cast<float*>(static_cast<char*>(ptr) + sizeof(SlabHeader));
+            size_t end = round_to_page(bytes);
+            if (end > mapped_bytes) {
+                void* ptr = mmap(reserved + mapped_bytes, end - mapped_bytes, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_FIXED, fd, mapped_bytes);
+                if (ptr == MAP_FAILED) {
+                    throw std::runtime_error("mmap failed");
+                }
+                mapped_bytes = end;
+            }
+
+            file_size = bytes;
+            // unchanged unless the reservation moved; get_dim() readers take no lock
+            if (header != reinterpret_cast<SlabHeader*>(reserved)) header = reinterpret_cast<SlabHeader*>(reserved);
+            update_regions();
+        }
+
+        void publish_count(uint64_t count) { __atomic_store_n(&header->count, count, __ATOMIC_RELEASE); }
+
+        void release_mapping() {
+            if (reserved) munmap(reserved, reserved_bytes);
+            reserved = nullptr;
+            reserved_bytes = 0;
+            mapped_bytes = 0;
+            header = nullptr;
         }
 
         void grow_file(size_t new_capacity) {
-            size_t new_capacity_bytes = sizeof(SlabHeader) + new_capacity * sizeof(float)*header->dim;
+            size_t new_capacity_bytes = file_bytes_for(new_capacity, header->dim);
             if (ftruncate(fd, new_capacity_bytes) == -1) {
                 throw std::runtime_error("ftruncate failed");
             }
+            std::unique_lock<std::shared_mutex> lock(remap_mutex);
             map_file(new_capacity_bytes);
+
+            // Capacity at least doubles, so the new norms section starts past
+            // the end of the old one and the old copy stays intact until the
+            // header points at the new one. At 4 bytes a row this is the only
+            // copy growth makes.
+            size_t new_norms = norms_offset_for(new_capacity, header->dim);
+            char* base = reinterpret_cast<char*>(header);
+            std::memmove(base + new_norms, base + header->norms_offset, header->count * sizeof(float));
+            header->norms_offset = new_norms;
             header->capacity = new_capacity;
+            update_regions();
         }
     public:
-        MatrixSlab(const std::string& path_file, uint64_t dimension) : fpath(path_file) , header(nullptr) {
+        // `metric` only applies when the file is created; an existing slab
+        // keeps the one in its header.
+        MatrixSlab(const std::string& path_file, uint64_t dimension, Metric metric = METRIC_L2)
+            : fpath(path_file) , header(nullptr) {
+            // left behind by a compaction that never reached its rename
+            std::filesystem::remove(fpath + ".compact");
             bool is_new = !std::filesystem::exists(fpath);
             fd = open(fpath.c_str(), O_RDWR | O_CREAT , 0644);
             if (is_new) {
-                size_t size = sizeof(SlabHeader) + dimension * sizeof(float)*INITIAL_CAPACITY;
+                size_t size = file_bytes_for(INITIAL_CAPACITY, dimension);
                 ftruncate(fd, size);
                 map_file(size);
                 header->magic = 0x26872687;
+                header->version = SLAB_VERSION;
                 header->count = 0;
                 header->dim = dimension;
                 header->capacity = INITIAL_CAPACITY;
+                header->norms_offset = norms_offset_for(INITIAL_CAPACITY, dimension);
+                header->metric = metric;
+                update_regions();
             }else {
                 struct stat st;
                 fstat(fd, &st);
                 map_file(st.st_size);
+                if (header->version < 2) upgrade_layout();
             }
         }
         ~MatrixSlab() {
-                if (header) munmap(header, file_size);
+                release_mapping();
                 if (fd != -1) close(fd);
         }
 
+        // Grows the file once so the next `rows` appends never remap.
+        void reserve(size_t rows) {
+            if (rows <= header->capacity) return;
+            size_t new_capacity = header->capacity;
+            while (new_capacity < rows) new_capacity *= 2;
+            grow_file(new_capacity);
+        }
+
+        // Writes a copy of the slab holding only `live_rows` (ascending) to
+        // <slab>.compact and fsyncs it. Nothing changes until
+        // install_compacted(). Returns the generation of the new file.
+        uint64_t write_compacted(const std::vector<uint64_t>& live_rows) {
+            std::string tmp_path = fpath + ".compact";
+            int out = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (out == -1) {
+                throw std::runtime_error("could not create compacted slab");
+            }
+
+            SlabHeader h = *header;
+            h.count = live_rows.size();
+            h.capacity = std::max<size_t>(INITIAL_CAPACITY, live_rows.size());
+            h.generation = header->generation + 1;
+
+            h.norms_offset = norms_offset_for(h.capacity, header->dim);
+
+            size_t row_bytes = header->dim * sizeof(float);
+            if (ftruncate(out, file_bytes_for(h.capacity, header->dim)) == -1) {
+                close(out);
+                throw std::runtime_error("ftruncate failed");
+            }
+            pwrite(out, &h, sizeof(h), 0);
+
+            std::vector<float> live_norms(live_rows.size());
+            for (size_t i = 0; i < live_rows.size(); i++) live_norms[i] = norms_region[live_rows[i]];
+            pwrite_all(out, reinterpret_cast<const char*>(live_norms.data()),
+                       live_norms.size() * sizeof(float), h.norms_offset);
+
+            // copy runs of consecutive live rows with one pwrite each
+            size_t i = 0;
+            while (i < live_rows.size()) {
+                size_t j = i + 1;
+                while (j < live_rows.size() && live_rows[j] == live_rows[j - 1] + 1) j++;
+
+                const char* src = reinterpret_cast<const char*>(data_region + live_rows[i] * header->dim);
+                pwrite_all(out, src, (j - i) * row_bytes, sizeof(SlabHeader) + i * row_bytes);
+                i = j;
+            }
+
+            fsync(out);
+            close(out);
+            return h.generation;
+        }
+
+        static void pwrite_all(int out, const char* src, size_t len, size_t at) {
+            size_t done = 0;
+            while (done < len) {
+                ssize_t n = pwrite(out, src + done, len - done, at + done);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    close(out);
+                    throw std::runtime_error("write failed");
+                }
+                done += n;
+            }
+        }
+
+        // Atomically replaces the slab with the file from write_compacted().
+        void install_compacted() {
+            std::string tmp_path = fpath + ".compact";
+            if (rename(tmp_path.c_str(), fpath.c_str()) == -1) {
+                throw std::runtime_error("could not install compacted slab");
+            }
+
+            release_mapping();
+            close(fd);
+
+            fd = open(fpath.c_str(), O_RDWR);
+            if (fd == -1) {
+                throw std::runtime_error("could not reopen slab");
+            }
+            struct stat st;
+            fstat(fd, &st);
+            map_file(st.st_size);
+        }
+
+        void add_vectors(const float* vectors, size_t n) {
+            reserve(header->count + n);
+            size_t offset = header->count * header->dim;
+            std::memcpy(&data_region[offset], vectors, n * header->dim * sizeof(float));
+            normalize_rows(header->count, n);
+            write_norms(header->count, n);
+            publish_count(header->count + n);
+        }
+
         void add_vector(const float* vector_Data) {
             if (header->count >= header->capacity) {
                 grow_file(header->capacity*2);
             }
             size_t offset = header->count * header->dim;
             std::memcpy(&data_region[offset], vector_Data, header->dim * sizeof(float));
-            header->count++;
+            normalize_rows(header->count, 1);
+            write_norms(header->count, 1);
+            publish_count(header->count + 1);
         }
+        // Stays valid across appends and growth; compaction installs a new
+        // file and invalidates it.
         const float* get_data_ptr() const { return data_region; }
-        uint64_t get_count() const { return header->count; }
+        // Squared L2 norm of every row, kept in step with the data. Growth
+        // moves the norms section, so unlike the data pointer this one has to
+        // be fetched again after appends.
+        const float* get_norms_ptr() const { return norms_region; }
+        // Committed rows. Safe to call while the writer appends.
+        uint64_t get_count() const { return __atomic_load_n(&header->count, __ATOMIC_ACQUIRE); }
+        // Keeps the norms pointer from moving (growth waits) while held.
+        std::shared_lock<std::shared_mutex> read_lock() const { return std::shared_lock<std::shared_mutex>(remap_mutex); }
         uint64_t get_capacity() const { return header->capacity; }
         uint64_t get_dim() const { return header->dim; }
+        uint64_t get_generation() const { return header->generation; }
+        Metric get_metric() const { return static_cast<Metric>(header->metric); }
 
 };
 #endif
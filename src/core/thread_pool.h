@@ -0,0 +1,91 @@
+#pragma once
+#ifndef FIREDB_THREAD_POOL_H
+#define FIREDB_THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <exception>
+#include <utility>
+#include <cstdint>
+
+// Fixed set of workers that run one parallel_for at a time. The caller
+// blocks until every task of the call has finished.
+class ThreadPool {
+    private:
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable work_cv;
+        std::condition_variable done_cv;
+
+        const std::function<void(size_t)>* job = nullptr;
+        size_t next = 0;
+        size_t total = 0;
+        size_t pending = 0;
+        uint64_t generation = 0;
+        bool stop = false;
+        std::exception_ptr failure;
+
+        void worker_loop() {
+            uint64_t seen = 0;
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                work_cv.wait(lock, [&] { return stop || (generation != seen && next < total); });
+                if (stop) return;
+
+                while (next < total) {
+                    size_t task = next++;
+                    lock.unlock();
+                    std::exception_ptr error;
+                    try {
+                        (*job)(task);
+                    } catch (...) {
+                        error = std::current_exception();
+                    }
+                    lock.lock();
+                    if (error && !failure) failure = error;
+                    if (--pending == 0) done_cv.notify_all();
+                }
+                seen = generation;
+            }
+        }
+
+    public:
+        explicit ThreadPool(size_t threads = std::thread::hardware_concurrency()) {
+            threads = std::max<size_t>(1, threads);
+            for (size_t i = 0; i < threads; i++) workers.emplace_back([this] { worker_loop(); });
+        }
+
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            work_cv.notify_all();
+            for (auto& w : workers) w.join();
+        }
+
+        size_t size() const { return workers.size(); }
+
+        // Runs fn(0) .. fn(tasks - 1) on the workers. The first exception a
+        // task throws is rethrown here once all tasks are done.
+        void parallel_for(size_t tasks, const std::function<void(size_t)>& fn) {
+            if (tasks == 0) return;
+            std::unique_lock<std::mutex> lock(mutex);
+            job = &fn;
+            next = 0;
+            total = tasks;
+            pending = tasks;
+            generation++;
+            work_cv.notify_all();
+            done_cv.wait(lock, [&] { return pending == 0; });
+            job = nullptr;
+            total = 0;
+            if (failure) std::rethrow_exception(std::exchange(failure, nullptr));
+        }
+};
+
+#endif